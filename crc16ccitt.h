@@ -3,6 +3,16 @@
 
 #include "inttypes.h"
 
+// Number of bytes processed per step when calculating the CRC of a buffer (1, 4 or 8).
+// Each slice needs an additional table of 512 bytes, so the ESP8266 keeps the plain table.
+#ifndef CRC16_CCITT_SLICES
+#  ifdef ESP8266
+#    define CRC16_CCITT_SLICES 1
+#  else
+#    define CRC16_CCITT_SLICES 8
+#  endif
+#endif
+
 /**
  * @brief The Crc16Ccitt class
  */
@@ -23,7 +33,7 @@ public:
 
    /**
     * @brief Init crc calculation
-    * @param u16Init    Initialization value
+    * @param u16Init    Initialization value or a state returned by getCrcState() to continue a calculation
     */
    inline void init(uint16_t u16Init = INIT_FCS) {
       _u16Crc = u16Init;
@@ -39,10 +49,32 @@ public:
 
    /**
     * @brief Calculate CRC of a buffer
+    * 
+    * Uses slicing-by-4 or slicing-by-8 (see CRC16_CCITT_SLICES) for the bulk of the buffer.
     * @param pBuffer    Pointer to the buffer
-    * @param u16Size    Size of the buffer in bytes
+    * @param size       Size of the buffer in bytes
     */
    inline void calc(const uint8_t *pBuffer, int size) {
+#if CRC16_CCITT_SLICES >= 8
+      while (size >= 8) {
+         uint16_t crc = _u16Crc ^ (pBuffer[0] | (pBuffer[1] << 8));
+         _u16Crc = _sliceTable.values[7][crc & 0xFFU] ^ _sliceTable.values[6][crc >> 8] ^
+                   _sliceTable.values[5][pBuffer[2]] ^ _sliceTable.values[4][pBuffer[3]] ^
+                   _sliceTable.values[3][pBuffer[4]] ^ _sliceTable.values[2][pBuffer[5]] ^
+                   _sliceTable.values[1][pBuffer[6]] ^ _crcTable[pBuffer[7]];
+         pBuffer += 8;
+         size -= 8;
+      }
+#endif
+#if CRC16_CCITT_SLICES >= 4
+      while (size >= 4) {
+         uint16_t crc = _u16Crc ^ (pBuffer[0] | (pBuffer[1] << 8));
+         _u16Crc = _sliceTable.values[3][crc & 0xFFU] ^ _sliceTable.values[2][crc >> 8] ^
+                   _sliceTable.values[1][pBuffer[2]] ^ _crcTable[pBuffer[3]];
+         pBuffer += 4;
+         size -= 4;
+      }
+#endif
       while (size > 0) {
          calc(*(pBuffer++));
          size--;
@@ -57,6 +89,10 @@ public:
       return ((_u16Crc & LO_BYTE_MASK) << 8 | ((_u16Crc & HI_BYTE_MASK) >> 8)) ^ INIT_FCS;
    }
 
+   /**
+    * @brief Returns the internal state, which can be passed to init() to continue the calculation
+    * @return Current state
+    */
    inline uint16_t getCrcState() {
       return _u16Crc;
    }
@@ -68,6 +104,29 @@ private:
    /// CRC table to calculate CRCs
    static const uint16_t _crcTable[_u16CrcTableSize];
 
+#if CRC16_CCITT_SLICES > 1
+   /**
+    * @brief Tables for slicing-by-N, derived from _crcTable on startup.
+    * 
+    * values[n][b] is the CRC state after feeding byte b followed by n zero bytes into a zero state.
+    */
+   struct SliceTable {
+      uint16_t values[CRC16_CCITT_SLICES][_u16CrcTableSize];
+
+      SliceTable() {
+         for (int b = 0; b < _u16CrcTableSize; ++b) {
+            values[0][b] = _crcTable[b];
+            for (int n = 1; n < CRC16_CCITT_SLICES; ++n) {
+               values[n][b] = (values[n - 1][b] >> 8) ^ _crcTable[values[n - 1][b] & 0xFFU];
+            }
+         }
+      }
+   };
+
+   /// Tables for slicing-by-N
+   static const SliceTable _sliceTable;
+#endif
+
    /// Current CRC
    uint16_t _u16Crc;
 };
@@ -108,4 +167,9 @@ const uint16_t Crc16Ccitt::_crcTable[Crc16Ccitt::_u16CrcTableSize] = {
       0x7bc7U, 0x6a4eU, 0x58d5U, 0x495cU, 0x3de3U, 0x2c6aU, 0x1ef1U, 0x0f78U
 };
 
+#if CRC16_CCITT_SLICES > 1
+// Initialization of the slicing tables
+const Crc16Ccitt::SliceTable Crc16Ccitt::_sliceTable;
+#endif
+
 #endif // CRC16_CCITT_H
@@ -13,34 +13,72 @@
 class EmeterPacket {
 public:
    // IDs to identify values in the energy meter packets
+   // Power in 0.1 W / var / VA, energy in Ws / vars / VAs, current in mA, voltage in mV, power factor and frequency in 1/1000
    static const uint32_t SMA_POSITIVE_ACTIVE_POWER = 0x00010400;
    static const uint32_t SMA_POSITIVE_REACTIVE_POWER = 0x00030400;
    static const uint32_t SMA_NEGATIVE_ACTIVE_POWER = 0x00020400;
    static const uint32_t SMA_NEGATIVE_REACTIVE_POWER = 0x00040400;
+   static const uint32_t SMA_POSITIVE_APPARENT_POWER = 0x00090400;
+   static const uint32_t SMA_NEGATIVE_APPARENT_POWER = 0x000a0400;
    static const uint32_t SMA_POSITIVE_ENERGY = 0x00010800;
    static const uint32_t SMA_NEGATIVE_ENERGY = 0x00020800;
+   static const uint32_t SMA_POSITIVE_REACTIVE_ENERGY = 0x00030800;
+   static const uint32_t SMA_NEGATIVE_REACTIVE_ENERGY = 0x00040800;
+   static const uint32_t SMA_POSITIVE_APPARENT_ENERGY = 0x00090800;
+   static const uint32_t SMA_NEGATIVE_APPARENT_ENERGY = 0x000a0800;
+   static const uint32_t SMA_CURRENT = 0x000b0400;       // Only per phase
+   static const uint32_t SMA_VOLTAGE = 0x000c0400;       // Only per phase
+   static const uint32_t SMA_POWER_FACTOR = 0x000d0400;
+   static const uint32_t SMA_FREQUENCY = 0x000e0400;     // Only total
    static const uint32_t SMA_VERSION = 0x90000000;
 
+   // Type of the value (measurement value or counter)
+   static const uint32_t SMA_TYPE_MASK = 0x0000ff00;
+   static const uint32_t SMA_COUNTER_TYPE = 0x00000800;
+
+   /**
+   * @brief Get the ID of a value of a phase (e.g. SMA_POSITIVE_ACTIVE_POWER of L1)
+   * @param id     ID of the total value
+   * @param phase  Phase (1-3)
+   */
+   static constexpr uint32_t phaseId(uint32_t id, int phase) {
+      return id + ((uint32_t)(20 * phase) << 16);
+   }
+
+   /**
+   * @brief Returns true, if the ID is a counter (64 bit)
+   */
+   static constexpr bool isCounterId(uint32_t id) {
+      return (id & SMA_TYPE_MASK) == SMA_COUNTER_TYPE;
+   }
+
+   // Maximum number of channels of a frozen layout
+   static const int MAX_CHANNELS = 64;
+
    /**
    * @brief Constructor
    */
-   EmeterPacket(uint32_t serNo = 0U) {
+   EmeterPacket(uint32_t serNo = 0U) : _channelCount(0), _frozen(false) {
       initEmeterPacket(serNo);
       begin(0U);
       end();
    }
 
    /**
-   * @brief Initialize the packet with the given serial number
+   * @brief Initialize the packet with the given serial number (a frozen layout and its values are kept)
    */
    void init(uint32_t serNo) {
       initEmeterPacket(serNo);
+      // The header contains placeholders again, so restore the length of the current payload (without end-tag)
+      storeU16BE(_pDataSize, _length - _headerLength - 4 + INITIAL_PAYLOAD_LENGTH);
    }
 
    /**
    * @brief Begin the update sequence
    */
    void begin(unsigned long timeStampMs) {
+      _channelCount = 0;
+      _frozen = false;
       _pPacketPos = meterPacket + _headerLength;
       storeU32BE(_pMeterTime, timeStampMs);
       // Initial length of packet (ID + SN + TS)
@@ -100,6 +138,104 @@ public:
       return _length;
    }
 
+   /**
+   * @brief Begin the declaration of a frozen layout
+   *
+   * The channels are declared once with addMeasurementChannel() and addCounterChannel() and the layout is
+   * completed with endLayout(). Afterwards the packet is updated in place with setTimeStamp(),
+   * setMeasurementValue() and setCounterValue(), which only write the changed values.
+   * The timestamp is kept, so a layout may be declared again after setTimeStamp().
+   */
+   void beginLayout() {
+      const uint8_t *pTime = _pMeterTime;
+      begin((uint32_t)pTime[0] << 24 | (uint32_t)pTime[1] << 16 | (uint32_t)pTime[2] << 8 | pTime[3]);
+   }
+
+   /**
+   * @brief Declare a measurement channel (32 bit, initial value 0)
+   * @return Index of the channel or -1, if there are too many channels
+   */
+   int addMeasurementChannel(uint32_t id) {
+      if (_frozen || (_channelCount >= MAX_CHANNELS)) {
+         return -1;
+      }
+      _channelOffset[_channelCount] = (uint16_t)(_pPacketPos - meterPacket) + 4;
+      _channelValue[_channelCount] = 0U;
+      addMeasurementValue(id, 0U);
+      return _channelCount++;
+   }
+
+   /**
+   * @brief Declare a counter channel (64 bit, initial value 0)
+   * @return Index of the channel or -1, if there are too many channels
+   */
+   int addCounterChannel(uint32_t id) {
+      if (_frozen || (_channelCount >= MAX_CHANNELS)) {
+         return -1;
+      }
+      _channelOffset[_channelCount] = (uint16_t)(_pPacketPos - meterPacket) + 4;
+      _channelValue[_channelCount] = 0U;
+      addCounterValue(id, 0U);
+      return _channelCount++;
+   }
+
+   /**
+   * @brief Complete the declaration of the layout and render the packet
+   */
+   uint16_t endLayout() {
+      end();
+      _frozen = true;
+      return _length;
+   }
+
+   /**
+   * @brief Returns true, if the packet has a frozen layout
+   */
+   bool isFrozen() const {
+      return _frozen;
+   }
+
+   /**
+   * @brief Set the timestamp of a packet with a frozen layout
+   */
+   void setTimeStamp(unsigned long timeStampMs) {
+      storeU32BE(_pMeterTime, timeStampMs);
+   }
+
+   /**
+   * @brief Set the value of a measurement channel (only written, if it has changed)
+   */
+   void setMeasurementValue(int channel, uint32_t value) {
+      if ((uint64_t)value != _channelValue[channel]) {
+         _channelValue[channel] = value;
+         storeU32BE(meterPacket + _channelOffset[channel], value);
+      }
+   }
+
+   /**
+   * @brief Set the value of a counter channel (only written, if it has changed)
+   */
+   void setCounterValue(int channel, uint64_t value) {
+      if (value != _channelValue[channel]) {
+         _channelValue[channel] = value;
+         storeU64BE(meterPacket + _channelOffset[channel], value);
+      }
+   }
+
+   /**
+   * @brief Get the current value of a channel of a frozen layout
+   */
+   uint64_t getChannelValue(int channel) const {
+      return _channelValue[channel];
+   }
+
+   /**
+   * @brief Get the number of channels of a frozen layout
+   */
+   int getChannelCount() const {
+      return _channelCount;
+   }
+
 private:
    // Initial length of the payload (Protocol-ID + SRC + Time)
    static const int INITIAL_PAYLOAD_LENGTH = 12;
@@ -123,29 +259,59 @@ private:
    // Current length of the packet
    uint16_t _length;
 
+   // Offsets of the values of a frozen layout
+   uint16_t _channelOffset[MAX_CHANNELS];
+
+   // Current values of the channels of a frozen layout
+   uint64_t _channelValue[MAX_CHANNELS];
+
+   // Number of channels of a frozen layout
+   int _channelCount;
+
+   // True, if the layout is frozen
+   bool _frozen;
+
    /**
    * @brief Store an U16 in big endian byte order
    */
    uint8_t *storeU16BE(uint8_t *pPos, uint16_t value) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+      value = __builtin_bswap16(value);
+      memcpy(pPos, &value, sizeof(value));
+      return pPos + sizeof(value);
+#else
       *(pPos++) = value >> 8;
       *(pPos++) = value & 0xff;
       return pPos;
+#endif
    }
 
    /**
    * @brief Store an U32 in big endian byte order
    */
    uint8_t *storeU32BE(uint8_t *pPos, uint32_t value) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+      value = __builtin_bswap32(value);
+      memcpy(pPos, &value, sizeof(value));
+      return pPos + sizeof(value);
+#else
       pPos = storeU16BE(pPos, value >> 16);
       return storeU16BE(pPos, value & 0xffff);
+#endif
    }
 
    /**
    * @brief Store an U64 in big endian byte order
    */
    uint8_t *storeU64BE(uint8_t *pPos, uint64_t value) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+      value = __builtin_bswap64(value);
+      memcpy(pPos, &value, sizeof(value));
+      return pPos + sizeof(value);
+#else
       pPos = storeU32BE(pPos, value >> 32);
       return storeU32BE(pPos, value & 0xffffffff);
+#endif
    }
 
    /**
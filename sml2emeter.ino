@@ -27,7 +27,10 @@
 #include "util/sml_testpacket.h"
 #include "smlstreamreader.h"
 #include "smlparser.h"
+#include "smlstreamparser.h"
 #include "emeterpacket.h"
+#include "smlemetermapping.h"
+#include "udpfanout.h"
 #include "pulsecounter.h"
 #include "webconfparameter.h"
 
@@ -49,6 +52,21 @@ const bool USE_DEMO_DATA = false;
 // Time to wait for demo-data
 const int TEST_PACKET_RECEIVE_TIME_MS = (SML_TEST_PACKET_LENGTH * 8 * 1000) / 9600;
 
+// Time without a complete packet, after which reading from the serial interface is aborted
+const unsigned long SERIAL_TIMEOUT_MS = 2000;
+
+// Time before the serial timeout, when the led is switched on
+const unsigned long SERIAL_TIMEOUT_WARNING_MS = 50;
+
+// Maximum time between two calls of the background tasks (web server, mqtt, led) while waiting for serial data.
+// On the device, the UART receives data by interrupt and delay() yields to the wifi stack, so the loop wakes up
+// every ms. On a PC, poll() sleeps until data is received (the background tasks are stubs there).
+#ifdef ESP8266
+const unsigned long EVENT_INTERVAL_MS = 1;
+#else
+const unsigned long EVENT_INTERVAL_MS = 100;
+#endif
+
 // Default multicast address for energy meter packets
 const IPAddress MCAST_ADDRESS = IPAddress(239, 12, 255, 254);
 
@@ -89,18 +107,34 @@ const char INDEX_HTML[] = "<!doctypehtml><meta charset=utf-8><meta content=\"wid
 // Buffer for serial reading
 const int SML_PACKET_SIZE = 1000;
 
-// Reader for SML streams
-SmlStreamReader smlStreamReader(SML_PACKET_SIZE);
+// CRC verification: The transport CRC and the message CRCs cover the same data. Use CRC_TRANSPORT_ONLY to
+// check only the transport CRC, if the counter "MessageCrcErrors" stays at 0 with CRC_FULL.
+const SmlParser::CrcPolicy SML_CRC_POLICY = SmlParser::CRC_FULL;
 
-// Parser for SML packets
-SmlParser smlParser;
+// Reader for SML streams (the CRC is calculated once per packet instead of once per received byte,
+// line noise between packets is skipped without buffering it). The packet buffer is part of the reader,
+// so it doesn't use the heap.
+StaticSmlStreamReader<SML_PACKET_SIZE,
+   SmlStaticPolicy<SmlParser::checksTransportCrc(SML_CRC_POLICY), SmlStreamReaderBase::CRC_PER_FRAME, true> > smlStreamReader;
+
+// Parser for SML packets (decodes the packet while it's received)
+SmlStreamParser smlParser(SML_CRC_POLICY);
 
 // Class for generating e-meter packets
 EmeterPacket emeterPacket;
 
+// Mapping of the parsed values to the channels of the e-meter packet
+SmlEmeterMapping emeterMapping;
+
 // Errors while reading packets from the serial interface
 uint32_t readErrors = 0;
 
+// Data, which was read from the serial interface, but not yet added to the stream reader
+const int SERIAL_CHUNK_SIZE = 256;
+uint8_t serialData[SERIAL_CHUNK_SIZE];
+int serialDataPos = 0;
+int serialDataLength = 0;
+
 // Errors while reading packets from the serial interface
 uint32_t mqttSendErrors = 0;
 
@@ -116,13 +150,27 @@ unsigned long nextLedChange = 0;
 // Additional serial port to mirror SML messages
 SoftwareSerial mirrorSerial;
 
-// Destination addresses for sending meter packets
-const int DEST_ADDRESSES_SIZE = 2;
-IPAddress destAddresses[DEST_ADDRESSES_SIZE];
-uint8_t numDestAddresses = 0;
+// Destinations for sending meter packets (each address parameter contains a list of addresses)
+UdpFanout udpFanout;
+
+// Payloads of the destinations
+enum UdpPayloadIndex {
+   PAYLOAD_EMETER,
+   PAYLOAD_SML,
+   PAYLOAD_COUNT
+};
+
+// Separators of the addresses in the address parameters
+const char ADDRESS_SEPARATORS[] = ",; ";
+
+// Maximum length of an address with port ("255.255.255.255:65535")
+const int ADDRESS_LEN = 21;
 
-// Destination ports
-uint16_t ports[DEST_ADDRESSES_SIZE];
+// Characters of an address list
+const char ADDRESS_LIST_CHARS[] = "0123456789.:,; ";
+
+// Length of the additional address list: it can hold all destinations of the fan-out (addresses and separators)
+const int ADDRESS_LIST_LEN = UdpFanout::MAX_DESTINATIONS * (ADDRESS_LEN + 1);
 
 // UDP instance for sending packets
 WiFiUDP Udp;
@@ -161,6 +209,10 @@ WebConfParameter separator3(iotWebConf, "Pulse counting");
 WebConfParameter pulseTimeoutMsParam(iotWebConf, "Debounce time (default 500ms, 0 to turn off)", "pulseTimeoutMs", NUMBER_LEN, "number", "0", "min='0' max='100000' step='1'");
 WebConfParameter pulseFactorParam(iotWebConf, "Factor for m3 calculation", "pulseFactor", NUMBER_LEN, "number", "0.01", "min='0' max='100000' step='0.01'");
 
+// Parameters are stored in the order of their definition, so new parameters are added at the end to keep the stored configuration
+WebConfParameter separator4(iotWebConf, "Additional energy-meter destinations");
+WebConfParameter destinationAddress3Param(iotWebConf, "Unicast addresses", "destinationAddress3", ADDRESS_LIST_LEN);
+
 /**
    @brief Turn status led on
 */
@@ -219,94 +271,142 @@ void signalConnectionState() {
    }
 }
 
+/**
+   @brief Handle the background tasks (web server, led, mqtt keepalive)
+*/
+void handleEvents() {
+   iotWebConf.doLoop();
+   signalConnectionState();
+   if ((mqttPort > 0) && (iotWebConf.getState() == IOTWEBCONF_STATE_ONLINE)) {
+     mqttClient.loop();
+   }
+}
+
 /**
    @brief Wait the given time in ms
 */
 void delayMs(unsigned long delayMs) {
    unsigned long start = millis();
    while (millis() - start < delayMs) {
-      iotWebConf.doLoop();
-      signalConnectionState();
-      if ((mqttPort > 0) && (iotWebConf.getState() == IOTWEBCONF_STATE_ONLINE)) {
-        mqttClient.loop();
-      }      
+      handleEvents();
       delay(1);
    }
    storePulseCounter();
 }
 
 /**
-   @brief Update the energy meter packet
+   @brief Wait up to the given time in ms for serial data, the background tasks are handled meanwhile
+   @return true, if serial data is available
 */
-void updateEmeterPacket() {
-   emeterPacket.begin(millis());
-
-   // Store active and reactive power (convert from centi-W to deci-W)
-   emeterPacket.addMeasurementValue(EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, smlParser.getPowerIn() / 10);
-   emeterPacket.addMeasurementValue(EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER, smlParser.getPowerOut() / 10);
-   emeterPacket.addMeasurementValue(EmeterPacket::SMA_POSITIVE_REACTIVE_POWER, 0);
-   emeterPacket.addMeasurementValue(EmeterPacket::SMA_NEGATIVE_REACTIVE_POWER, 0);
+bool waitForSerial(unsigned long timeoutMs) {
+   unsigned long start = millis();
+   bool dataAvailable = Serial.available();
+   while (!dataAvailable && (millis() - start < timeoutMs)) {
+      handleEvents();
+      unsigned long remaining = timeoutMs - (millis() - start);
+      unsigned long waitMs = (remaining < EVENT_INTERVAL_MS) ? remaining : EVENT_INTERVAL_MS;
+#ifdef ESP8266
+      delay(waitMs);
+      dataAvailable = Serial.available();
+#else
+      dataAvailable = Serial.waitAvailable(waitMs);
+#endif
+   }
+   storePulseCounter();
+   return dataAvailable;
+}
 
-   // Store energy (convert from centi-Wh to Ws)
-   emeterPacket.addCounterValue(EmeterPacket::SMA_POSITIVE_ENERGY, smlParser.getEnergyIn() * 36UL);
-   emeterPacket.addCounterValue(EmeterPacket::SMA_NEGATIVE_ENERGY, smlParser.getEnergyOut() * 36UL);
+/**
+   @brief Update the energy meter packet (all values of the packet of the meter are copied to the packet)
+*/
+void updateEmeterPacket(const SmlParser &parser) {
+   emeterPacket.setTimeStamp(millis());
+   emeterMapping.update(emeterPacket, parser);
+}
 
-   emeterPacket.end();
+/**
+   @brief Read all data, which is available from the serial interface without waiting
+   @return Number of bytes read
+*/
+int readSerialData(uint8_t *pBuffer, int size) {
+#ifdef ESP8266
+   int available = Serial.available();
+   return (available > 0) ? (int)Serial.read((char *)pBuffer, (available < size) ? available : size) : 0;
+#else
+   return Serial.readAvailable(pBuffer, size);
+#endif
 }
 
 /**
    @brief Read next packet from the serial interface
+   @return true, if a complete packet was received (false after a timeout)
 */
-void readSerial() {
+bool readSerial() {
    Serial.print("W");
    ledOff();
    bool receiving = false;
-   int waitCount = 0;
+   unsigned long start = millis();
    do {
-      int data = Serial.read();
-      if (data >= 0) {
+      if (serialDataPos == serialDataLength) {
+         serialDataPos = 0;
+         serialDataLength = readSerialData(serialData, SERIAL_CHUNK_SIZE);
+      }
+      if (serialDataPos < serialDataLength) {
          if (!receiving) {
             Serial.print("R");
             ledOnFor(500);
             receiving = true;
-            waitCount = 0;
+            start = millis();
          }
-         uint8_t dataByte = (uint8_t)data;
+         // Add all data up to the end of the packet, the rest is kept for the next packet
+         int length = serialDataLength - serialDataPos;
+         int result = smlStreamReader.addData(serialData + serialDataPos, length);
+         int usedLength = (result >= 0) ? result : length;
          if (MIRROR_SERIAL_PIN >= 0) {
-            mirrorSerial.write(dataByte);
+            mirrorSerial.write(serialData + serialDataPos, usedLength);
          }
-         if (smlStreamReader.addData(&dataByte, 1) >= 0) {
-            break;
+         serialDataPos += usedLength;
+         if (result >= 0) {
+            return true;
          }
       }
       else {
-         ++waitCount;
-         if (waitCount == 195) {
-            ledOn();
-         }
-         if (waitCount == 200) {
+         unsigned long elapsed = millis() - start;
+         if (elapsed >= SERIAL_TIMEOUT_MS) {
             Serial.print("T");
             ledOff();
-            waitCount = 0;
             ++readErrors;
-            break;
+            return false;
+         }
+         // Parse the part of the packet, which was received so far and send queued UDP packets
+         smlParser.update(smlStreamReader);
+         udpFanout.flush();
+
+         // Wait for the next data (the led is switched on shortly before the timeout)
+         unsigned long remaining = SERIAL_TIMEOUT_MS - elapsed;
+         if (remaining <= SERIAL_TIMEOUT_WARNING_MS) {
+            ledOn();
+            waitForSerial(remaining);
+         }
+         else {
+            waitForSerial(remaining - SERIAL_TIMEOUT_WARNING_MS);
          }
-         delayMs(10);
       }
    } while (true);
 }
 
 /**
    @brief Read test packet
+   @return true, if a complete packet was received
 */
-void readTestPacket() {
+bool readTestPacket() {
    Serial.print("W");
    ledOff();
    ledOnFor(1000 - TEST_PACKET_RECEIVE_TIME_MS);
    Serial.print("R");
    ledOn();
    delayMs(TEST_PACKET_RECEIVE_TIME_MS);
-   smlStreamReader.addData(SML_TEST_PACKET, SML_TEST_PACKET_LENGTH);
+   return smlStreamReader.addData(SML_TEST_PACKET, SML_TEST_PACKET_LENGTH) >= 0;
 }
 
 /**
@@ -327,23 +427,25 @@ void handleRoot()
 
 /**
    @brief Get current meter data as JSON data
+   @param parser Parser with the values of the last packet
+   @param readerStats Counters of the stream reader
    @param detailed Return detailed data if true
 */
-String getCurrentDataAsJson(bool detailed = true) {
+String getCurrentDataAsJson(const SmlParser &parser, const SmlStreamReaderStats &readerStats, bool detailed = true) {
    bool addComma = false;
    
    String data = "{";
 
    // Basic data of energy-meter
-   if (smlParser.getParsedOk() > 0) {
+   if (parser.getParsedOk() > 0) {
       data += "\"PowerIn\":";
-      data += smlParser.getPowerIn() / 100.0;
+      data += parser.getPowerIn() / 100.0;
       data += ",\"EnergyIn\":";
-      data += smlParser.getEnergyIn() / 100.0;
+      data += parser.getEnergyIn() / 100.0;
       data += ",\"PowerOut\":";
-      data += smlParser.getPowerOut() / 100.0;
+      data += parser.getPowerOut() / 100.0;
       data += ",\"EnergyOut\":";
-      data += smlParser.getEnergyOut() / 100.0;
+      data += parser.getEnergyOut() / 100.0;
       addComma = true;
    }
 
@@ -351,11 +453,37 @@ String getCurrentDataAsJson(bool detailed = true) {
    if (detailed) {
       data += addComma ? "," : "";
       data += "\"Ok\":";
-      data += (unsigned int)smlParser.getParsedOk();
+      data += (unsigned int)parser.getParsedOk();
       data += ",\"ReadErrors\":";
       data += (unsigned int)readErrors;
       data += ",\"ParseErrors\":";
-      data += (unsigned int)(smlParser.getParseErrors() + smlStreamReader.getParseErrors());
+      data += (unsigned int)(parser.getParseErrors() + readerStats.parseErrors);
+      data += ",\"DiscardedBytes\":";
+      data += (unsigned int)readerStats.discardedBytes;
+      data += ",\"Resyncs\":";
+      data += (unsigned int)readerStats.resyncCount;
+      data += ",\"LongestGap\":";
+      data += (unsigned int)readerStats.longestGap;
+      data += ",\"MessageCrcErrors\":";
+      data += (unsigned int)parser.getMessageCrcErrors();
+      data += ",\"Destinations\":[";
+      for (int i = 0; i < udpFanout.getCount(); ++i) {
+         const UdpDestination &destination = udpFanout.getDestination(i);
+         data += (i > 0) ? ",{\"Packets\":" : "{\"Packets\":";
+         data += (unsigned int)destination.packets;
+         data += ",\"Errors\":";
+         data += (unsigned int)destination.errors;
+         data += ",\"WouldBlock\":";
+         data += (unsigned int)destination.wouldBlock;
+         data += ",\"Drops\":";
+         data += (unsigned int)destination.drops;
+         data += ",\"LatencyUs\":";
+         data += (unsigned int)destination.lastLatencyUs;
+         data += ",\"MaxLatencyUs\":";
+         data += (unsigned int)destination.maxLatencyUs;
+         data += "}";
+      }
+      data += "]";
       addComma = true;
    }
 
@@ -390,20 +518,48 @@ String getCurrentDataAsJson(bool detailed = true) {
    @brief Return the current readings as json object
 */
 void handleData() {
-   server.send(200, "application/json", getCurrentDataAsJson());
+   server.send(200, "application/json", getCurrentDataAsJson(smlParser, smlStreamReader.getStats()));
 }
 
 /**
-   @brief Check, whether a valid IP address is given
+   @brief Get the next address of a list of addresses (the list isn't copied)
+   @param pList Position in the list, which is moved behind the address
+   @param address Buffer for the address (empty, if the address is too long)
+   @return false at the end of the list
 */
-bool checkIp(WebConfParameter &parameter) {
+bool getNextAddress(const char *&pList, char (&address)[ADDRESS_LEN + 1]) {
+   pList += strspn(pList, ADDRESS_SEPARATORS);
+   size_t length = strcspn(pList, ADDRESS_SEPARATORS);
+   if (length == 0) {
+      return false;
+   }
+   size_t copyLength = (length <= (size_t)ADDRESS_LEN) ? length : 0U;
+   memcpy(address, pList, copyLength);
+   address[copyLength] = 0;
+   pList += length;
+   return true;
+}
+
+/**
+   @brief Check, whether only valid IP addresses are given
+   @param count Number of addresses of all lists, which is increased by the addresses of this list
+*/
+bool checkIp(WebConfParameter &parameter, int &count) {
    IotWebConfParameter &iotWebConfParameter = *parameter.get();
    IPAddress ip;
 
    String arg = server.arg(iotWebConfParameter.getId());
-   if (arg.length() > 0) {
-      char ipAddress[STRING_LEN + 1] = { 0 };
-      strncpy(ipAddress, arg.c_str(), STRING_LEN);
+   if (arg.length() > (size_t)parameter.getLength()) {
+      iotWebConfParameter.errorMessage = "Too many addresses!";
+      return false;
+   }
+   const char *pList = arg.c_str();
+   char ipAddress[ADDRESS_LEN + 1];
+   while (getNextAddress(pList, ipAddress)) {
+      if (++count > UdpFanout::MAX_DESTINATIONS) {
+         iotWebConfParameter.errorMessage = "Too many addresses!";
+         return false;
+      }
       char *pPortPos = strchr(ipAddress, ':');
       if (pPortPos != NULL) {
          *pPortPos = 0;
@@ -421,7 +577,9 @@ bool checkIp(WebConfParameter &parameter) {
 */
 bool formValidator() {
    Serial.println("Validating form.");
-   bool valid = checkIp(destinationAddress1Param) && checkIp(destinationAddress2Param);
+   int count = 0;
+   bool valid = checkIp(destinationAddress1Param, count) && checkIp(destinationAddress2Param, count) &&
+                checkIp(destinationAddress3Param, count);
 
    return valid;
 }
@@ -429,19 +587,27 @@ bool formValidator() {
 /**
    @brief Parse IP addresses and ports
  */
-void parseDestinationAddress(const char *pDestinationAddressValue) {
-   char destinationAddress[STRING_LEN + 1] = { 0 };
-   strncpy(destinationAddress, pDestinationAddressValue, STRING_LEN);
-   char *pPortPos = strchr(destinationAddress, ':');
-   if (pPortPos == NULL) {
-      ports[numDestAddresses] = portParam.getInt();
-   }
-   else {
+void parseDestinationAddress(char *pDestinationAddress) {
+   uint16_t port = portParam.getInt();
+   char *pPortPos = strchr(pDestinationAddress, ':');
+   if (pPortPos != NULL) {
       *pPortPos = 0;
-      ports[numDestAddresses] = atoi(pPortPos + 1);
+      port = atoi(pPortPos + 1);
    }
-   if (destAddresses[numDestAddresses].fromString(destinationAddress)) {
-      ++numDestAddresses;
+   IPAddress address;
+   if (address.fromString(pDestinationAddress)) {
+      udpFanout.add(address, port, (port == SMA_ENERGYMETER_PORT) ? PAYLOAD_EMETER : PAYLOAD_SML);
+   }
+}
+
+/**
+   @brief Parse a list of destination addresses (e.g. "192.168.1.10, 192.168.1.11:9523")
+*/
+void parseDestinationAddresses(const char *pDestinationAddressesValue) {
+   const char *pList = pDestinationAddressesValue;
+   char destinationAddress[ADDRESS_LEN + 1];
+   while (getNextAddress(pList, destinationAddress)) {
+      parseDestinationAddress(destinationAddress);
    }
 }
 
@@ -450,16 +616,21 @@ void parseDestinationAddress(const char *pDestinationAddressValue) {
 */
 void configSaved() {
    Serial.println("Configuration was updated.");
-   numDestAddresses = 0;
-   parseDestinationAddress(destinationAddress1Param.getText());
-   parseDestinationAddress(destinationAddress2Param.getText());
+   udpFanout.clear();
+   parseDestinationAddresses(destinationAddress1Param.getText());
+   parseDestinationAddresses(destinationAddress2Param.getText());
+   parseDestinationAddresses(destinationAddress3Param.getText());
+   if (udpFanout.getCount() == 0) {
+      uint16_t port = portParam.getInt();
+      udpFanout.add(MCAST_ADDRESS, port, (port == SMA_ENERGYMETER_PORT) ? PAYLOAD_EMETER : PAYLOAD_SML, true);
+   }
 
    Serial.print("serNo: "); Serial.println(serialNumberParam.getInt());
-   for (int i = 0; i < numDestAddresses; ++i) {
+   for (int i = 0; i < udpFanout.getCount(); ++i) {
       Serial.print("Destination address: ");
-      Serial.print(destAddresses[i].toString());
+      Serial.print(udpFanout.getDestination(i).address.toString());
       Serial.print(", port: ");
-      Serial.println(ports[i]);
+      Serial.println(udpFanout.getDestination(i).port);
    }
 
    emeterPacket.init(serialNumberParam.getInt());
@@ -547,6 +718,11 @@ void setup() {
 
    // Initializing the configuration.
    iotWebConf.init();
+   // A configuration of an older version doesn't contain the additional addresses (the memory may contain anything)
+   const char *pAddresses = destinationAddress3Param.getText();
+   if (strspn(pAddresses, ADDRESS_LIST_CHARS) != strlen(pAddresses)) {
+      destinationAddress3Param.setText("");
+   }
    configSaved();
 
    // Set up required URL handlers on the web server.
@@ -568,37 +744,27 @@ void setup() {
 
 /**
    @brief Publish data for emeter-protocol
+   @param parser Parser with the values of the packet
+   @param pSmlData Raw SML packet (sent to destinations, which don't use the emeter-protocol)
+   @param smlLength Length of the raw SML packet
 */
-void publishEmeter() {
-   if (ports[0] > 0) {
-      updateEmeterPacket();
-      // We use a do..while loop here to force at least one execution of the loop-body.
-      int i = 0;
-      do {
-         Serial.print("S");
-         if (numDestAddresses == 0) {
-            Udp.beginPacketMulticast(MCAST_ADDRESS, ports[0], WiFi.localIP(), 1);                     
-         }
-         else {
-            Udp.beginPacket(destAddresses[i], ports[i]);           
-         }
-
-         if (ports[i] == SMA_ENERGYMETER_PORT) {
-            Udp.write(emeterPacket.getData(), emeterPacket.getLength());
-         }
-         else {
-            Udp.write(smlStreamReader.getData(), smlStreamReader.getLength());
-         }
-
-         Udp.endPacket();      
-      } while (++i < numDestAddresses);
+void publishEmeter(const SmlParser &parser, const uint8_t *pSmlData, int smlLength) {
+   if (udpFanout.getCount() > 0) {
+      updateEmeterPacket(parser);
+      Serial.print("S");
+      UdpPayload payloads[PAYLOAD_COUNT] = {
+         { emeterPacket.getData(), emeterPacket.getLength() },
+         { pSmlData, smlLength }
+      };
+      udpFanout.send(Udp, payloads, PAYLOAD_COUNT);
    }
 }
 
 /**
    @brief Publish data to mqtt broker
+   @param parser Parser with the values of the packet
 */
-void publishMqtt() {
+void publishMqtt(const SmlParser &parser) {
    if ((mqttPort == 0) || (iotWebConf.getState() != IOTWEBCONF_STATE_ONLINE)) {
       return;
    }
@@ -620,7 +786,7 @@ void publishMqtt() {
    }
 
    mqttClient.loop();
-   if (mqttClient.publish(mqttTopic.c_str(), getCurrentDataAsJson(false).c_str())) {
+   if (mqttClient.publish(mqttTopic.c_str(), getCurrentDataAsJson(parser, smlStreamReader.getStats(), false).c_str())) {
       Serial.print("S");
    }
    else {
@@ -637,17 +803,15 @@ void loop() {
    Serial.print("_");
 
    // Read the next packet
-   if (!USE_DEMO_DATA) {
-      readSerial();
-   }
-   else {
-      readTestPacket();
-   }
+   bool received = !USE_DEMO_DATA ? readSerial() : readTestPacket();
 
-   // Send the packet
-   if (smlParser.parsePacket(smlStreamReader.getData(), smlStreamReader.getLength())) {
-      publishEmeter();
-      publishMqtt();
+   // Send the packet (only a complete packet with a valid CRC may be finished)
+   if (!received) {
+      Serial.print("E");
+   }
+   else if (smlParser.finish(smlStreamReader)) {
+      publishEmeter(smlParser, smlStreamReader.getData(), smlStreamReader.getLength());
+      publishMqtt(smlParser);
    }
    else {
       Serial.print("E");
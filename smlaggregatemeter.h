@@ -0,0 +1,218 @@
+#ifndef SMLAGGREGATEMETER_H
+#define SMLAGGREGATEMETER_H
+
+#include <stdint.h>
+#include "smlparser.h"
+#include "emeterpacket.h"
+#include "smlemetermapping.h"
+
+/**
+ * @brief Virtual meter, which adds or subtracts the values of several physical meters.
+ *
+ * Power, energy and current are summed with the sign of the input (e.g. grid meter minus heat pump meter).
+ * The power of an input is its net power (16.7.0 or 1.7.0 - 2.7.0), so the aggregate only provides the signed
+ * power sum and no separate imported and exported power.
+ * Voltage and frequency are taken from the input, which was updated last. A summed value is only available,
+ * if every input provides it. Energy and current are never negative.
+ *
+ * Every update of an input replaces its contribution to the sums (no recalculation over all inputs) and renders
+ * the energy meter packet again, so the packet follows the fastest input. The packet is only updated, if all
+ * inputs were received within the staleness window, otherwise the update is counted as stale and all channels
+ * of the packet are set to 0. Values, which the aggregate doesn't provide any more, are removed from the packet.
+ *
+ * Example:
+ *    SmlAggregateMeter aggregate(1900000100U);
+ *    int grid = aggregate.addInput(1);
+ *    int heatPump = aggregate.addInput(-1);
+ *    ...
+ *    if (aggregate.update(grid, gridParser, millis())) {
+ *       send(aggregate.getPacket().getData(), aggregate.getPacket().getLength());
+ *    }
+ */
+class SmlAggregateMeter {
+public:
+   static const int MAX_INPUTS = 8;
+   /// Default maximum age of the values of an input in ms
+   static const unsigned long DEFAULT_MAX_AGE_MS = 5000;
+
+   /**
+    * @brief Constructor
+    * @param serialNumber  Serial number of the energy meter packet
+    * @param maxAgeMs      Maximum time between the reception of the oldest and the newest input
+    */
+   explicit SmlAggregateMeter(uint32_t serialNumber, unsigned long maxAgeMs = DEFAULT_MAX_AGE_MS) :
+      _packet(serialNumber), _serialNumber(serialNumber), _maxAgeMs(maxAgeMs), _inputCount(0), _commonSlots(0U), _latestSlots(0U),
+      _renderedSlots(0U), _updates(0U), _staleUpdates(0U)
+   {
+      for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+         _sums[slot] = 0;
+         _latestValues[slot] = 0;
+      }
+   }
+
+   /**
+    * @brief Add an input.
+    * @param sign  1 to add the values of the input, -1 to subtract them
+    * @return Index of the input or -1, if there are too many inputs
+    */
+   int addInput(int sign) {
+      if (_inputCount >= MAX_INPUTS) {
+         return -1;
+      }
+      Input &input = _inputs[_inputCount];
+      input.sign = (sign < 0) ? -1 : 1;
+      input.received = false;
+      input.receivedMs = 0UL;
+      input.slots = 0U;
+      for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+         input.values[slot] = 0;
+      }
+      _commonSlots = 0U;
+      return _inputCount++;
+   }
+
+   /**
+    * @brief Update the values of an input and render the packet.
+    * @param index       Index of the input
+    * @param parser      Parser with the values of the last packet of the input
+    * @param receivedMs  Time, when the packet was received (e.g. millis())
+    * @return true, if the packet was updated (all inputs are within the staleness window)
+    */
+   bool update(int index, const SmlParser &parser, unsigned long receivedMs) {
+      Input &input = _inputs[index];
+      // Only the values of the last packet count (hasValue() is set for every value, which was ever received)
+      uint32_t packetSlots = parser.getPacketSlots();
+      uint32_t slots = 0U;
+      for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+         if (((packetSlots >> slot) & 1U) == 0U) {
+            continue;
+         }
+         int64_t value = parser.getValue((SmlValueSlot)slot);
+         if (isSummed(slot)) {
+            setContribution(input, slot, value);
+            slots |= 1U << slot;
+         }
+         else if ((LATEST_SLOTS >> slot) & 1U) {
+            _latestValues[slot] = value;
+            _latestSlots |= 1U << slot;
+         }
+      }
+      // Net power of meters, which only send imported and exported power
+      const uint32_t POWER_IN_OUT = (1U << SML_POWER_IN) | (1U << SML_POWER_OUT);
+      if (((packetSlots & (1U << SML_POWER_SUM)) == 0U) && ((packetSlots & POWER_IN_OUT) == POWER_IN_OUT)) {
+         setContribution(input, SML_POWER_SUM, parser.getValue(SML_POWER_IN) - parser.getValue(SML_POWER_OUT));
+         slots |= 1U << SML_POWER_SUM;
+      }
+      // Values, which the input doesn't provide any more, don't contribute
+      for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+         if ((input.slots & ~slots) & (1U << slot)) {
+            setContribution(input, slot, 0);
+         }
+      }
+      input.slots = slots;
+      input.received = true;
+      input.receivedMs = receivedMs;
+
+      bool fresh = true;
+      _commonSlots = SUMMED_SLOTS;
+      for (int i = 0; i < _inputCount; ++i) {
+         unsigned long age = receivedMs - _inputs[i].receivedMs;
+         fresh = fresh && _inputs[i].received && ((age <= _maxAgeMs) || (0UL - age <= _maxAgeMs));
+         _commonSlots &= _inputs[i].slots;
+      }
+      if (!fresh) {
+         // Don't keep the sums of the last update in the packet
+         _mapping.clear(_packet, _renderedSlots);
+         _renderedSlots = 0U;
+         ++_staleUpdates;
+         return false;
+      }
+      _packet.setTimeStamp(receivedMs);
+      _mapping.update(_packet, *this);
+      _renderedSlots = getPacketSlots();
+      ++_updates;
+      return true;
+   }
+
+   /// Returns true, if the aggregate provides the value
+   inline bool hasValue(SmlValueSlot slot) const {
+      return ((getPacketSlots() >> slot) & 1U) != 0U;
+   }
+
+   /// Slots, which the aggregate provides (like SmlParser::getPacketSlots())
+   inline uint32_t getPacketSlots() const { return _commonSlots | _latestSlots; }
+
+   /// Aggregated value in the unit of the slot (see SmlValueSlot)
+   inline int64_t getValue(SmlValueSlot slot) const {
+      if (!isSummed(slot)) {
+         return _latestValues[slot];
+      }
+      bool signedSlot = (slot == SML_POWER_SUM) || ((slot >= SML_POWER_L1) && (slot <= SML_POWER_L3));
+      return (signedSlot || (_sums[slot] > 0)) ? _sums[slot] : 0;
+   }
+
+   /// Energy meter packet with the aggregated values
+   inline const EmeterPacket &getPacket() const { return _packet; }
+
+   /// Serial number of the energy meter packet
+   inline uint32_t getSerialNumber() const { return _serialNumber; }
+
+   /// Number of inputs
+   inline int getInputCount() const { return _inputCount; }
+
+   /// Number of updates of the packet
+   inline uint32_t getUpdates() const { return _updates; }
+
+   /// Number of updates, which were rejected, because an input was missing or too old
+   inline uint32_t getStaleUpdates() const { return _staleUpdates; }
+
+private:
+   /// Slots, which are summed over all inputs (power, energy and current)
+   static const uint32_t SUMMED_SLOTS = (1U << SML_POWER_SUM) |
+      (1U << SML_ENERGY_IN) | (1U << SML_ENERGY_OUT) | (1U << SML_ENERGY_IN_T1) | (1U << SML_ENERGY_IN_T2) |
+      (1U << SML_ENERGY_OUT_T1) | (1U << SML_ENERGY_OUT_T2) | (1U << SML_POWER_L1) | (1U << SML_POWER_L2) |
+      (1U << SML_POWER_L3) | (1U << SML_CURRENT_L1) | (1U << SML_CURRENT_L2) | (1U << SML_CURRENT_L3);
+   /// Slots, which are taken from the input, which was updated last (imported and exported power are part of the net power)
+   static const uint32_t LATEST_SLOTS = (1U << SML_VOLTAGE_L1) | (1U << SML_VOLTAGE_L2) | (1U << SML_VOLTAGE_L3) |
+      (1U << SML_FREQUENCY);
+
+   /**
+    * @brief Values of an input, which are part of the sums.
+    */
+   struct Input {
+      int sign;
+      bool received;
+      unsigned long receivedMs;
+      uint32_t slots;
+      int64_t values[SML_VALUE_SLOTS];
+   };
+
+   EmeterPacket _packet;
+   uint32_t _serialNumber;
+   SmlEmeterMapping _mapping;
+   unsigned long _maxAgeMs;
+   Input _inputs[MAX_INPUTS];
+   int _inputCount;
+   int64_t _sums[SML_VALUE_SLOTS];
+   int64_t _latestValues[SML_VALUE_SLOTS];
+   uint32_t _commonSlots;
+   uint32_t _latestSlots;
+   // Slots, which were written to the packet by the last update
+   uint32_t _renderedSlots;
+   uint32_t _updates;
+   uint32_t _staleUpdates;
+
+   static inline bool isSummed(int slot) {
+      return ((SUMMED_SLOTS >> slot) & 1U) != 0U;
+   }
+
+   /**
+    * @brief Replace the contribution of an input to a sum.
+    */
+   void setContribution(Input &input, int slot, int64_t value) {
+      _sums[slot] += input.sign * (value - input.values[slot]);
+      input.values[slot] = value;
+   }
+};
+
+#endif // SMLAGGREGATEMETER_H
@@ -0,0 +1,246 @@
+#ifndef SML_CURSOR_H
+#define SML_CURSOR_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Read-only view of the elements of a SML packet.
+ *
+ * The cursor points to an element of a sequence (e.g. the messages of a packet or the entries of a list)
+ * and decodes the type-length field on demand. The data of the packet is never copied.
+ *
+ * All accesses are checked against the end of the packet. If the current element doesn't fit into the packet
+ * or the sequence is complete, isValid() returns false and the cursor can't be moved any further.
+ *
+ * Example:
+ *    for (SmlCursor entry = list.getChildren(); entry.isValid(); entry.next()) { ... }
+ */
+class SmlCursor {
+public:
+   // ----------------------------------------------------------------------------
+   // SML constants
+   // For details see:
+   // https://www.bsi.bund.de/SharedDocs/Downloads/DE/BSI/Publikationen/TechnischeRichtlinien/TR03109/TR-03109-1_Anlage_Feinspezifikation_Drahtgebundene_LMN-Schnittstelle_Teilb.pdf?__blob=publicationFile
+   // ----------------------------------------------------------------------------
+   static const uint8_t SML_OCTET_ID = 0x00;
+   static const uint8_t SML_BOOL_ID = 0x40;
+   static const uint8_t SML_INT_ID = 0x50;
+   static const uint8_t SML_UINT_ID = 0x60;
+   static const uint8_t SML_LIST_ID = 0x70;
+   static const uint8_t SML_END_OF_MESSAGE = 0x00;
+   static const uint8_t SML_OPTIONAL = 0x01;
+
+   /**
+    * @brief Construct an invalid cursor.
+    */
+   SmlCursor() : _pElement(NULL), _pEnd(NULL), _remaining(0), _type(0), _length(0), _headerLength(0), _size(0), _valid(false) {}
+
+   /**
+    * @brief Construct a cursor for a sequence of elements.
+    * @param pData First element
+    * @param length Number of bytes available (usually up to the end of the packet)
+    * @param elements Number of elements in the sequence or -1 to read elements up to the end of the data
+    */
+   SmlCursor(const uint8_t *pData, int length, int elements = -1) :
+      _pElement(pData), _pEnd(pData + length), _remaining(elements), _type(0), _length(0), _headerLength(0), _size(0), _valid(false)
+   {
+      decode();
+   }
+
+   /**
+    * @brief Returns true, if the cursor points to an element, which is completely contained in the data.
+    */
+   inline bool isValid() const { return _valid; }
+
+   /**
+    * @brief Returns the type of the element (SML_OCTET_ID, SML_BOOL_ID, SML_INT_ID, SML_UINT_ID or SML_LIST_ID).
+    */
+   inline uint8_t getType() const { return _type; }
+
+   /**
+    * @brief Returns the length of the element as stored in the type-length field.
+    *
+    * For lists, this is the number of elements. For all other types, this is the size of the element in bytes
+    * including the type-length field.
+    */
+   inline int getLength() const { return _length; }
+
+   /**
+    * @brief Returns the size of the type-length field in bytes.
+    */
+   inline int getHeaderLength() const { return _headerLength; }
+
+   /**
+    * @brief Returns the first byte of the element (the type-length field).
+    */
+   inline const uint8_t *getElement() const { return _pElement; }
+
+   /**
+    * @brief Returns the data of the element, which follows the type-length field.
+    */
+   inline const uint8_t *getData() const { return _pElement + _headerLength; }
+
+   /**
+    * @brief Returns the size of the data in bytes (0 for lists).
+    */
+   inline int getDataLength() const { return _size - _headerLength; }
+
+   /**
+    * @brief Returns true, if the element is an end of message marker.
+    */
+   inline bool isEndOfMessage() const { return _valid && (*_pElement == SML_END_OF_MESSAGE); }
+
+   /**
+    * @brief Returns true, if the element is an unused optional value.
+    */
+   inline bool isOptional() const { return _valid && (*_pElement == SML_OPTIONAL); }
+
+   /**
+    * @brief Returns the value of a boolean element (false for all other types).
+    */
+   inline bool getBool() const {
+      return _valid && (_type == SML_BOOL_ID) && (getDataLength() > 0) && (getData()[0] != 0);
+   }
+
+   /**
+    * @brief Returns the value of an integer element (supports both, signed and unsigned types).
+    *
+    * The value is decoded with a single big-endian load, if at least 8 bytes are available.
+    * @return The value or 0, if the element is no integer or has no data
+    */
+   int64_t getInt() const {
+      int dataLength = getDataLength();
+      if (!_valid || ((_type != SML_INT_ID) && (_type != SML_UINT_ID)) || (dataLength < 1) || (dataLength > 8)) {
+         return 0;
+      }
+      const uint8_t *pData = getData();
+      uint64_t value = 0U;
+      if (_pEnd - pData >= 8) {
+         value = loadBigEndian64(pData);
+      }
+      else {
+         for (int i = 0; i < dataLength; ++i) {
+            value |= (uint64_t)pData[i] << (56 - 8 * i);
+         }
+      }
+      int shift = 64 - 8 * dataLength;
+      if (_type == SML_INT_ID) {
+         return (int64_t)value >> shift;
+      }
+      return (int64_t)(value >> shift);
+   }
+
+   /**
+    * @brief Returns a cursor for the elements of a list (an invalid cursor for all other types).
+    */
+   SmlCursor getChildren() const {
+      if (!_valid || (_type != SML_LIST_ID)) {
+         return SmlCursor();
+      }
+      return SmlCursor(getData(), (int)(_pEnd - getData()), _length);
+   }
+
+   /**
+    * @brief Move to the next element of the sequence (the elements of a list are skipped).
+    * @return true, if the cursor points to a valid element
+    */
+   bool next() {
+      if (!_valid) {
+         return false;
+      }
+      const uint8_t *pNext = _pElement + _size;
+      if (_type == SML_LIST_ID) {
+         // Skip all elements of the list and all nested lists
+         int pending = _length;
+         while (pending > 0) {
+            SmlCursor child(pNext, (int)(_pEnd - pNext));
+            if (!child.isValid()) {
+               _valid = false;
+               return false;
+            }
+            pNext += child._size;
+            pending += ((child._type == SML_LIST_ID) ? child._length : 0) - 1;
+         }
+      }
+      _pElement = pNext;
+      if (_remaining > 0) {
+         --_remaining;
+      }
+      decode();
+      return _valid;
+   }
+
+   /**
+    * @brief Move forward by the given number of elements.
+    * @return true, if the cursor points to a valid element
+    */
+   bool skip(int elements) {
+      while ((elements-- > 0) && next()) {
+      }
+      return _valid;
+   }
+
+private:
+   static const uint8_t SML_MORE_FLAG = 0x80;
+   static const uint8_t SML_TAG_MASK = 0x70;
+   static const uint8_t SML_LENGTH_MASK = 0x0F;
+   static const int SML_MAX_HEADER_LENGTH = 4;
+
+   const uint8_t *_pElement;
+   const uint8_t *_pEnd;
+   int _remaining;
+   uint8_t _type;
+   int _length;
+   int _headerLength;
+   int _size;
+   bool _valid;
+
+   /**
+    * @brief Decode the type-length field of the current element.
+    */
+   void decode() {
+      _valid = false;
+      _size = 0;
+      _headerLength = 0;
+      if ((_remaining == 0) || (_pElement == NULL) || (_pElement >= _pEnd)) {
+         return;
+      }
+      const uint8_t *pPos = _pElement;
+      _type = *pPos & SML_TAG_MASK;
+      _length = *pPos & SML_LENGTH_MASK;
+      while (*pPos & SML_MORE_FLAG) {
+         if ((++pPos >= _pEnd) || (pPos - _pElement >= SML_MAX_HEADER_LENGTH)) {
+            return;
+         }
+         _length = (_length << 4) | (*pPos & SML_LENGTH_MASK);
+      }
+      _headerLength = (int)(pPos - _pElement) + 1;
+      // The end of message marker has the length 0
+      _size = ((_type == SML_LIST_ID) || (_length < _headerLength)) ? _headerLength : _length;
+      _valid = (_size <= _pEnd - _pElement);
+   }
+
+   /**
+    * @brief Load 8 bytes in big-endian order.
+    */
+   static inline uint64_t loadBigEndian64(const uint8_t *pData) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+      uint64_t value;
+      memcpy(&value, pData, sizeof(value));
+      return __builtin_bswap64(value);
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+      uint64_t value;
+      memcpy(&value, pData, sizeof(value));
+      return value;
+#else
+      uint64_t value = 0U;
+      for (int i = 0; i < 8; ++i) {
+         value = (value << 8) | pData[i];
+      }
+      return value;
+#endif
+   }
+};
+
+#endif // SML_CURSOR_H
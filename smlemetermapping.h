@@ -0,0 +1,224 @@
+#ifndef SMLEMETERMAPPING_H
+#define SMLEMETERMAPPING_H
+
+#include <stdint.h>
+#include "smlparser.h"
+#include "emeterpacket.h"
+
+/**
+ * @brief Mapping of the values of the SML parser (OBIS codes) to the channels of the SMA energy meter packet.
+ *
+ * The packet only contains the channels of the values, which the meter sent in the last packet (in the order of
+ * a SMA energy meter). A channel without a value would tell the receiver 0 V, 0 Hz or cos phi = 0. The layout of
+ * the packet is frozen with the first update and declared again, whenever the set of values changes, so an
+ * update usually only writes the values, which have changed.
+ *
+ * Example:
+ *    SmlEmeterMapping mapping;
+ *    ...
+ *    emeterPacket.setTimeStamp(millis());
+ *    mapping.update(emeterPacket, smlParser);
+ */
+class SmlEmeterMapping {
+public:
+   /**
+    * @brief Conversion from the unit of the slot to the unit of the SMA channel.
+    */
+   enum Conversion {
+      /// No conversion (mA, mV, mHz)
+      SMA_CONVERT_NONE,
+      /// centi W to 0.1 W
+      SMA_CONVERT_DECI,
+      /// Positive part of a signed value, centi W to 0.1 W
+      SMA_CONVERT_POSITIVE_DECI,
+      /// Negative part of a signed value, centi W to 0.1 W
+      SMA_CONVERT_NEGATIVE_DECI,
+      /// centi Wh to Ws
+      SMA_CONVERT_WS
+   };
+
+   /**
+    * @brief Entry of the mapping table.
+    */
+   struct Entry {
+      /// Slot of the parser (see SmlObisTable for the OBIS code)
+      uint8_t slot;
+      /// ID of the SMA channel
+      uint32_t id;
+      /// Conversion of the value
+      uint8_t conversion;
+   };
+
+   // Note: If the meter sends both, 16.7.0 and 1.7.0 / 2.7.0, the later entries win.
+   static constexpr Entry ENTRIES[] = {
+      { SML_POWER_SUM, EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, SMA_CONVERT_POSITIVE_DECI },
+      { SML_POWER_SUM, EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER, SMA_CONVERT_NEGATIVE_DECI },
+      { SML_POWER_IN, EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, SMA_CONVERT_DECI },
+      { SML_POWER_OUT, EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER, SMA_CONVERT_DECI },
+      { SML_ENERGY_IN, EmeterPacket::SMA_POSITIVE_ENERGY, SMA_CONVERT_WS },
+      { SML_ENERGY_OUT, EmeterPacket::SMA_NEGATIVE_ENERGY, SMA_CONVERT_WS },
+      { SML_FREQUENCY, EmeterPacket::SMA_FREQUENCY, SMA_CONVERT_NONE },
+      { SML_POWER_L1, EmeterPacket::phaseId(EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, 1), SMA_CONVERT_POSITIVE_DECI },
+      { SML_POWER_L1, EmeterPacket::phaseId(EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER, 1), SMA_CONVERT_NEGATIVE_DECI },
+      { SML_CURRENT_L1, EmeterPacket::phaseId(EmeterPacket::SMA_CURRENT, 1), SMA_CONVERT_NONE },
+      { SML_VOLTAGE_L1, EmeterPacket::phaseId(EmeterPacket::SMA_VOLTAGE, 1), SMA_CONVERT_NONE },
+      { SML_POWER_L2, EmeterPacket::phaseId(EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, 2), SMA_CONVERT_POSITIVE_DECI },
+      { SML_POWER_L2, EmeterPacket::phaseId(EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER, 2), SMA_CONVERT_NEGATIVE_DECI },
+      { SML_CURRENT_L2, EmeterPacket::phaseId(EmeterPacket::SMA_CURRENT, 2), SMA_CONVERT_NONE },
+      { SML_VOLTAGE_L2, EmeterPacket::phaseId(EmeterPacket::SMA_VOLTAGE, 2), SMA_CONVERT_NONE },
+      { SML_POWER_L3, EmeterPacket::phaseId(EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, 3), SMA_CONVERT_POSITIVE_DECI },
+      { SML_POWER_L3, EmeterPacket::phaseId(EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER, 3), SMA_CONVERT_NEGATIVE_DECI },
+      { SML_CURRENT_L3, EmeterPacket::phaseId(EmeterPacket::SMA_CURRENT, 3), SMA_CONVERT_NONE },
+      { SML_VOLTAGE_L3, EmeterPacket::phaseId(EmeterPacket::SMA_VOLTAGE, 3), SMA_CONVERT_NONE },
+   };
+   static const int ENTRY_COUNT = sizeof(ENTRIES) / sizeof(ENTRIES[0]);
+
+   /**
+    * @brief Constructor
+    */
+   SmlEmeterMapping() : _mappedSlots(0U), _layoutSlots(0U) {
+      for (int i = 0; i < ENTRY_COUNT; ++i) {
+         _channels[i] = -1;
+         _mappedSlots |= 1U << ENTRIES[i].slot;
+      }
+   }
+
+   /**
+    * @brief Declare the SMA channels of the given slots in the order of a SMA energy meter and freeze the layout.
+    * @param packet  Packet
+    * @param slots   Slots with a value (bit n is set for slot n, e.g. SmlParser::getPacketSlots())
+    */
+   void initLayout(EmeterPacket &packet, uint32_t slots) {
+      // Power and energy channels, which exist for the total and every phase
+      static const uint32_t POWER_IDS[] = {
+         EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER,
+         EmeterPacket::SMA_POSITIVE_REACTIVE_POWER, EmeterPacket::SMA_NEGATIVE_REACTIVE_POWER,
+         EmeterPacket::SMA_POSITIVE_APPARENT_POWER, EmeterPacket::SMA_NEGATIVE_APPARENT_POWER
+      };
+      static const uint32_t ENERGY_IDS[] = {
+         EmeterPacket::SMA_POSITIVE_ENERGY, EmeterPacket::SMA_NEGATIVE_ENERGY,
+         EmeterPacket::SMA_POSITIVE_REACTIVE_ENERGY, EmeterPacket::SMA_NEGATIVE_REACTIVE_ENERGY,
+         EmeterPacket::SMA_POSITIVE_APPARENT_ENERGY, EmeterPacket::SMA_NEGATIVE_APPARENT_ENERGY
+      };
+
+      for (int i = 0; i < ENTRY_COUNT; ++i) {
+         _channels[i] = -1;
+      }
+      _layoutSlots = slots & _mappedSlots;
+      packet.beginLayout();
+      for (int phase = 0; phase <= 3; ++phase) {
+         for (int i = 0; i < 6; ++i) {
+            addChannel(packet, EmeterPacket::phaseId(POWER_IDS[i], phase));
+            addChannel(packet, EmeterPacket::phaseId(ENERGY_IDS[i], phase));
+         }
+         if (phase == 0) {
+            addChannel(packet, EmeterPacket::SMA_FREQUENCY);
+         }
+         else {
+            addChannel(packet, EmeterPacket::phaseId(EmeterPacket::SMA_CURRENT, phase));
+            addChannel(packet, EmeterPacket::phaseId(EmeterPacket::SMA_VOLTAGE, phase));
+         }
+      }
+      packet.endLayout();
+   }
+
+   /**
+    * @brief Copy the values of the last packet to the packet (the layout is declared again, if the values have changed).
+    * @param packet  Energy meter packet
+    * @param values  SmlParser or another source of slot values with getPacketSlots() and getValue() (e.g. SmlAggregateMeter)
+    */
+   template <class Values>
+   void update(EmeterPacket &packet, const Values &values) {
+      uint32_t slots = values.getPacketSlots() & _mappedSlots;
+      if (!packet.isFrozen() || (slots != _layoutSlots)) {
+         initLayout(packet, slots);
+      }
+      for (int i = 0; i < ENTRY_COUNT; ++i) {
+         const Entry &entry = ENTRIES[i];
+         if (_channels[i] < 0) {
+            continue;
+         }
+         int64_t value = values.getValue((SmlValueSlot)entry.slot);
+         switch (entry.conversion) {
+         case SMA_CONVERT_DECI:
+            value /= 10;
+            break;
+         case SMA_CONVERT_POSITIVE_DECI:
+            value = (value > 0) ? value / 10 : 0;
+            break;
+         case SMA_CONVERT_NEGATIVE_DECI:
+            value = (value < 0) ? -value / 10 : 0;
+            break;
+         case SMA_CONVERT_WS:
+            value *= 36;
+            break;
+         default:
+            break;
+         }
+         if (EmeterPacket::isCounterId(entry.id)) {
+            packet.setCounterValue(_channels[i], (uint64_t)value);
+         }
+         else {
+            packet.setMeasurementValue(_channels[i], (uint32_t)value);
+         }
+      }
+   }
+
+   /**
+    * @brief Set the channels of slots to 0 (e.g. when the values are outdated).
+    * @param packet  Packet with a layout, which was declared by initLayout()
+    * @param slots   Slots to clear (bit n is set for slot n)
+    */
+   void clear(EmeterPacket &packet, uint32_t slots) const {
+      for (int i = 0; i < ENTRY_COUNT; ++i) {
+         const Entry &entry = ENTRIES[i];
+         if ((_channels[i] < 0) || (((slots >> entry.slot) & 1U) == 0U)) {
+            continue;
+         }
+         if (EmeterPacket::isCounterId(entry.id)) {
+            packet.setCounterValue(_channels[i], 0U);
+         }
+         else {
+            packet.setMeasurementValue(_channels[i], 0U);
+         }
+      }
+   }
+
+   /**
+    * @brief Get the channel of an entry of the mapping table (-1, if the slot of the entry isn't part of the layout)
+    */
+   inline int getChannel(int entry) const { return _channels[entry]; }
+
+   /**
+    * @brief Get the slots of the current layout.
+    */
+   inline uint32_t getLayoutSlots() const { return _layoutSlots; }
+
+private:
+   // Channel of the packet for every entry of the mapping table
+   int8_t _channels[ENTRY_COUNT];
+   // Slots with an entry in the mapping table
+   uint32_t _mappedSlots;
+   // Slots of the current layout
+   uint32_t _layoutSlots;
+
+   /**
+    * @brief Add a channel, if an entry with the ID has a slot of the layout, and assign it to these entries.
+    */
+   void addChannel(EmeterPacket &packet, uint32_t id) {
+      int channel = -1;
+      for (int i = 0; i < ENTRY_COUNT; ++i) {
+         if ((ENTRIES[i].id != id) || (((_layoutSlots >> ENTRIES[i].slot) & 1U) == 0U)) {
+            continue;
+         }
+         if (channel < 0) {
+            channel = EmeterPacket::isCounterId(id) ? packet.addCounterChannel(id) : packet.addMeasurementChannel(id);
+         }
+         _channels[i] = (int8_t)channel;
+      }
+   }
+};
+
+constexpr SmlEmeterMapping::Entry SmlEmeterMapping::ENTRIES[];
+
+#endif // SMLEMETERMAPPING_H
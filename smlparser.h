@@ -2,22 +2,510 @@
 #define SMLPARSER_H
 
 #include <inttypes.h>
+#include <string.h>
 #include "crc16ccitt.h"
+#include "smlcursor.h"
+
+// ----------------------------------------------------------------------------
+// OBIS table
+//
+// For details see:
+// https://www.promotic.eu/en/pmdoc/Subsystems/Comm/PmDrivers/IEC62056_OBIS.htm
+// https://www.bundesnetzagentur.de/DE/Service-Funktionen/Beschlusskammern/BK06/BK6_81_GPKE_GeLi/Mitteilung_Nr_20/Anlagen/Obis-Kennzahlen-System_2.0.pdf?__blob=publicationFile&v=2
+// ----------------------------------------------------------------------------
+
+/**
+ * @brief Values, which are extracted from a SML packet.
+ */
+enum SmlValueSlot {
+   /// Imported power in centi W (1.7.0)
+   SML_POWER_IN,
+   /// Exported power in centi W (2.7.0)
+   SML_POWER_OUT,
+   /// Sum of imported and exported power in centi W (16.7.0), negative for export
+   SML_POWER_SUM,
+   /// Imported energy in centi Wh (1.8.0)
+   SML_ENERGY_IN,
+   /// Exported energy in centi Wh (2.8.0)
+   SML_ENERGY_OUT,
+   /// Imported energy of tariff 1 and 2 in centi Wh (1.8.1, 1.8.2)
+   SML_ENERGY_IN_T1,
+   SML_ENERGY_IN_T2,
+   /// Exported energy of tariff 1 and 2 in centi Wh (2.8.1, 2.8.2)
+   SML_ENERGY_OUT_T1,
+   SML_ENERGY_OUT_T2,
+   /// Power per phase in centi W (36.7.0, 56.7.0, 76.7.0), negative for export
+   SML_POWER_L1,
+   SML_POWER_L2,
+   SML_POWER_L3,
+   /// Current per phase in mA (31.7.0, 51.7.0, 71.7.0)
+   SML_CURRENT_L1,
+   SML_CURRENT_L2,
+   SML_CURRENT_L3,
+   /// Voltage per phase in mV (32.7.0, 52.7.0, 72.7.0)
+   SML_VOLTAGE_L1,
+   SML_VOLTAGE_L2,
+   SML_VOLTAGE_L3,
+   /// Grid frequency in mHz (14.7.0)
+   SML_FREQUENCY,
+   SML_VALUE_SLOTS
+};
+
+/**
+ * @brief Entry of the OBIS table.
+ */
+struct SmlObisEntry {
+   /// OBIS code A-B:C.D.E*F
+   uint8_t code[6];
+   /// Slot for the value
+   uint8_t slot;
+   /// Decimal exponent of the stored value (e.g. -2 for centi W). Values are scaled to this exponent.
+   int8_t exponent;
+};
+
+/**
+ * @brief Table of all OBIS codes, which are extracted from a SML packet.
+ *
+ * The entries are found with a perfect hash of the bytes C, D and E of the OBIS code. The multiplier
+ * of the hash is searched at compile time, so every lookup costs one hash and one compare.
+ * Like the original parser, a code only has to match the medium (A = 1, electricity) and C, D and E. The channel
+ * (B) and F are ignored, so meters, which send e.g. 1-1:1.8.0*255 or 1-0:1.8.0*0, are supported too.
+ */
+class SmlObisTable {
+public:
+   static const int OBIS_LENGTH = 6;
+   static constexpr SmlObisEntry ENTRIES[] = {
+      { { 0x01, 0x00, 0x01, 0x07, 0x00, 0xff }, SML_POWER_IN, -2 },
+      { { 0x01, 0x00, 0x02, 0x07, 0x00, 0xff }, SML_POWER_OUT, -2 },
+      { { 0x01, 0x00, 0x10, 0x07, 0x00, 0xff }, SML_POWER_SUM, -2 },
+      { { 0x01, 0x00, 0x01, 0x08, 0x00, 0xff }, SML_ENERGY_IN, -2 },
+      { { 0x01, 0x00, 0x02, 0x08, 0x00, 0xff }, SML_ENERGY_OUT, -2 },
+      { { 0x01, 0x00, 0x01, 0x08, 0x01, 0xff }, SML_ENERGY_IN_T1, -2 },
+      { { 0x01, 0x00, 0x01, 0x08, 0x02, 0xff }, SML_ENERGY_IN_T2, -2 },
+      { { 0x01, 0x00, 0x02, 0x08, 0x01, 0xff }, SML_ENERGY_OUT_T1, -2 },
+      { { 0x01, 0x00, 0x02, 0x08, 0x02, 0xff }, SML_ENERGY_OUT_T2, -2 },
+      { { 0x01, 0x00, 0x24, 0x07, 0x00, 0xff }, SML_POWER_L1, -2 },
+      { { 0x01, 0x00, 0x38, 0x07, 0x00, 0xff }, SML_POWER_L2, -2 },
+      { { 0x01, 0x00, 0x4c, 0x07, 0x00, 0xff }, SML_POWER_L3, -2 },
+      { { 0x01, 0x00, 0x1f, 0x07, 0x00, 0xff }, SML_CURRENT_L1, -3 },
+      { { 0x01, 0x00, 0x33, 0x07, 0x00, 0xff }, SML_CURRENT_L2, -3 },
+      { { 0x01, 0x00, 0x47, 0x07, 0x00, 0xff }, SML_CURRENT_L3, -3 },
+      { { 0x01, 0x00, 0x20, 0x07, 0x00, 0xff }, SML_VOLTAGE_L1, -3 },
+      { { 0x01, 0x00, 0x34, 0x07, 0x00, 0xff }, SML_VOLTAGE_L2, -3 },
+      { { 0x01, 0x00, 0x48, 0x07, 0x00, 0xff }, SML_VOLTAGE_L3, -3 },
+      { { 0x01, 0x00, 0x0e, 0x07, 0x00, 0xff }, SML_FREQUENCY, -3 },
+   };
+   static const int ENTRY_COUNT = sizeof(ENTRIES) / sizeof(ENTRIES[0]);
+
+   /// Number of bits of the hash
+   static const int HASH_BITS = 7;
+
+   /// Multiplier of the perfect hash (see below)
+   static const uint32_t HASH_MULTIPLIER;
+
+   /**
+    * @brief Returns the entry for an OBIS code or NULL, if the code is not in the table.
+    * @param pCode OBIS code (6 bytes)
+    */
+   static inline const SmlObisEntry *find(const uint8_t *pCode) {
+      uint8_t index = _buckets.values[getHash(getKey(pCode), HASH_MULTIPLIER)];
+      if ((index != EMPTY_BUCKET) && matches(ENTRIES[index], pCode)) {
+         return &ENTRIES[index];
+      }
+      return NULL;
+   }
+
+   /**
+    * @brief Returns true, if an OBIS code matches an entry (bytes A, C, D and E).
+    * @param pCode OBIS code (6 bytes)
+    */
+   static inline bool matches(const SmlObisEntry &entry, const uint8_t *pCode) {
+      return (entry.code[0] == pCode[0]) && (getKey(entry.code) == getKey(pCode));
+   }
+
+   /**
+    * @brief Returns the key of an OBIS code for the hash (bytes C, D and E).
+    */
+   static constexpr uint32_t getKey(const uint8_t *pCode) {
+      return ((uint32_t)pCode[2] << 16) | ((uint32_t)pCode[3] << 8) | pCode[4];
+   }
+
+   /**
+    * @brief Multiplicative hash of a key.
+    */
+   static constexpr uint8_t getHash(uint32_t key, uint32_t multiplier) {
+      return (uint8_t)((uint32_t)(key * multiplier) >> (32 - HASH_BITS));
+   }
+
+   /**
+    * @brief Returns true, if the hash of entry i differs from the hashes of all following entries.
+    */
+   static constexpr bool isUnique(uint32_t multiplier, int i, int j) {
+      return (j >= ENTRY_COUNT) ||
+             ((getHash(getKey(ENTRIES[i].code), multiplier) != getHash(getKey(ENTRIES[j].code), multiplier)) &&
+              isUnique(multiplier, i, j + 1));
+   }
+
+   /**
+    * @brief Returns true, if the hash is perfect for all entries starting with entry i.
+    */
+   static constexpr bool isPerfect(uint32_t multiplier, int i = 0) {
+      return (i >= ENTRY_COUNT) || (isUnique(multiplier, i, i + 1) && isPerfect(multiplier, i + 1));
+   }
+
+   /**
+    * @brief Search the first multiplier starting at the given one, which results in a perfect hash.
+    */
+   static constexpr uint32_t findMultiplier(uint32_t multiplier) {
+      return isPerfect(multiplier) ? multiplier : findMultiplier(multiplier + 2U);
+   }
+
+private:
+   static const uint8_t EMPTY_BUCKET = 0xff;
+
+   /**
+    * @brief Index of the entry for every hash value, generated on startup.
+    */
+   struct Buckets {
+      uint8_t values[1 << HASH_BITS];
+
+      Buckets() {
+         memset(values, EMPTY_BUCKET, sizeof(values));
+         for (int i = 0; i < ENTRY_COUNT; ++i) {
+            values[getHash(getKey(ENTRIES[i].code), HASH_MULTIPLIER)] = (uint8_t)i;
+         }
+      }
+   };
+
+   static const Buckets _buckets;
+};
+
+constexpr SmlObisEntry SmlObisTable::ENTRIES[];
+const uint32_t SmlObisTable::HASH_MULTIPLIER = SmlObisTable::findMultiplier(0x9e3779b1U);
+const SmlObisTable::Buckets SmlObisTable::_buckets;
+
+static_assert(SmlObisTable::isPerfect(SmlObisTable::HASH_MULTIPLIER), "The hash of the OBIS table is not perfect");
+static_assert(SmlObisTable::ENTRY_COUNT < 0xff, "Too many entries in the OBIS table");
+
+/**
+ * @brief Status of a message in a SML frame.
+ */
+struct SmlMessageStatus {
+   /// Type of the message body (e.g. 0x0701 for GET_LIST_RES), 0 if the CRC doesn't match
+   uint16_t type;
+   /// True, if the CRC of the message matches
+   bool crcOk;
+};
+
+/**
+ * @brief Information about all messages of a SML frame, collected by SmlParser::parseFrame().
+ */
+struct SmlFrameInfo {
+   /// Maximum number of messages with a status
+   static const int MAX_MESSAGES = 8;
+   /// Maximum length of the server id
+   static const int MAX_SERVER_ID_LENGTH = 16;
+
+   // SML_Time types
+   static const uint8_t SML_TIME_NONE = 0;
+   static const uint8_t SML_TIME_SEC_INDEX = 1;
+   static const uint8_t SML_TIME_TIMESTAMP = 2;
+
+   /// Number of messages in the frame (the status is stored for the first MAX_MESSAGES messages)
+   int messageCount;
+   SmlMessageStatus messages[MAX_MESSAGES];
+   /// Number of messages with a wrong CRC
+   int crcErrors;
+   /// Number of GET_LIST_RES messages, which were parsed successfully
+   int listResponses;
+   /// True, if the frame contains an OPEN_RES and a CLOSE_RES message with a correct CRC
+   bool openResponse;
+   bool closeResponse;
+   /// Server id of the meter (from the OPEN_RES or the first GET_LIST_RES message)
+   uint8_t serverId[MAX_SERVER_ID_LENGTH];
+   int serverIdLength;
+   /// Time of the meter (seconds since an arbitrary start for SML_TIME_SEC_INDEX, UNIX time for SML_TIME_TIMESTAMP)
+   uint8_t timeType;
+   uint32_t time;
+
+   /**
+    * @brief Reset all information.
+    */
+   void clear() {
+      memset(this, 0, sizeof(*this));
+   }
+};
+
+/**
+ * @brief Layout of a SML packet as learned by the parser (shape cache).
+ *
+ * Meters send telegrams with an identical structure every second, only the values, the CRCs and the
+ * transaction ids change. The shape stores the offsets of the messages and of all extracted values
+ * of a successfully parsed packet, so the next packets can be read directly without walking the
+ * type-length fields.
+ *
+ * The fingerprint of a shape is the packet length, the type-length fields at all stored offsets and the
+ * OBIS codes of all values. It's checked in place, so a packet with a different layout is never read
+ * with a wrong offset.
+ */
+class SmlShape {
+public:
+   /// Maximum number of messages
+   static const int MAX_MESSAGES = SmlFrameInfo::MAX_MESSAGES;
+   /// Maximum number of extracted values
+   static const int MAX_VALUES = 2 * SML_VALUE_SLOTS;
+   /// Maximum packet length (offsets are stored with 16 bits)
+   static const int MAX_PACKET_LENGTH = 0xffff;
+
+   /**
+    * @brief Offsets of a message and its CRC.
+    */
+   struct Message {
+      uint16_t start;
+      uint16_t crc;
+      uint16_t type;
+      uint8_t startTl;
+      uint8_t crcTl;
+   };
+
+   /**
+    * @brief Offsets of an extracted value.
+    */
+   struct Value {
+      uint16_t obis;
+      uint16_t scaler;
+      uint16_t value;
+      uint8_t scalerTl;
+      uint8_t valueTl;
+      uint8_t entry;
+   };
+
+   /**
+    * @brief Offset of a single element (used for the frame information).
+    */
+   struct Field {
+      uint16_t offset;
+      uint8_t tl;
+      bool valid;
+   };
+
+   SmlShape() : _packetLength(0), _messageCount(0), _valueCount(0), _valid(false), _overflow(false), _frame(false),
+                _timeType(SmlFrameInfo::SML_TIME_NONE), _serverId(), _time() {}
+
+   /// True, if a layout has been learned
+   inline bool isValid() const { return _valid; }
+
+   inline int getMessageCount() const { return _messageCount; }
+   inline const Message &getMessage(int i) const { return _messages[i]; }
+
+   inline int getValueCount() const { return _valueCount; }
+   inline const Value &getValue(int i) const { return _values[i]; }
+
+   inline const Field &getServerId() const { return _serverId; }
+   inline const Field &getTime() const { return _time; }
+   inline uint8_t getTimeType() const { return _timeType; }
+
+   /// True, if the layout was learned by SmlParser::parseFrame()
+   inline bool isFrame() const { return _frame; }
+
+   /**
+    * @brief Start learning the layout of a packet.
+    * @param packetLength  Length of the packet
+    * @param frame         True, if all messages of the frame are parsed (see SmlParser::parseFrame())
+    */
+   void begin(int packetLength, bool frame) {
+      _packetLength = packetLength;
+      _messageCount = 0;
+      _valueCount = 0;
+      _valid = false;
+      _overflow = (packetLength > MAX_PACKET_LENGTH);
+      _frame = frame;
+      _serverId.valid = false;
+      _time.valid = false;
+   }
+
+   /**
+    * @brief Add a message.
+    * @param pPacket   Start of the packet
+    * @param pMessage  Start of the message
+    * @param pCrc      CRC of the message
+    * @param type      Type of the message body
+    */
+   void addMessage(const uint8_t *pPacket, const uint8_t *pMessage, const uint8_t *pCrc, uint16_t type) {
+      if (_messageCount >= MAX_MESSAGES) {
+         _overflow = true;
+         return;
+      }
+      Message &message = _messages[_messageCount++];
+      message.start = (uint16_t)(pMessage - pPacket);
+      message.crc = (uint16_t)(pCrc - pPacket);
+      message.startTl = *pMessage;
+      message.crcTl = *pCrc;
+      message.type = type;
+   }
+
+   /**
+    * @brief Add a value.
+    * @param pPacket  Start of the packet
+    * @param entry    Index of the entry in the OBIS table
+    * @param pObis    OBIS code (type-length field)
+    * @param pScaler  Scaler (type-length field)
+    * @param pValue   Value (type-length field)
+    */
+   void addValue(const uint8_t *pPacket, int entry, const uint8_t *pObis, const uint8_t *pScaler, const uint8_t *pValue) {
+      if (_valueCount >= MAX_VALUES) {
+         _overflow = true;
+         return;
+      }
+      Value &value = _values[_valueCount++];
+      value.obis = (uint16_t)(pObis - pPacket);
+      value.scaler = (uint16_t)(pScaler - pPacket);
+      value.value = (uint16_t)(pValue - pPacket);
+      value.scalerTl = *pScaler;
+      value.valueTl = *pValue;
+      value.entry = (uint8_t)entry;
+   }
+
+   /**
+    * @brief Set the server id (type-length field).
+    */
+   void setServerId(const uint8_t *pPacket, const uint8_t *pServerId) {
+      setField(_serverId, pPacket, pServerId);
+   }
+
+   /**
+    * @brief Set the time of the meter (type-length field).
+    */
+   void setTime(const uint8_t *pPacket, const uint8_t *pTime, uint8_t timeType) {
+      setField(_time, pPacket, pTime);
+      _timeType = timeType;
+   }
+
+   /**
+    * @brief Finish learning. The shape is only used, if all offsets could be stored.
+    */
+   void end() {
+      _valid = !_overflow && (_messageCount > 0);
+   }
+
+   /**
+    * @brief Discard the learned layout.
+    */
+   inline void clear() { _valid = false; }
+
+   /**
+    * @brief Returns true, if the packet has the learned layout.
+    */
+   bool matches(const uint8_t *pPacket, int packetLength, bool frame) const {
+      if (!_valid || (packetLength != _packetLength) || (frame != _frame)) {
+         return false;
+      }
+      if ((_serverId.valid && (pPacket[_serverId.offset] != _serverId.tl)) || (_time.valid && (pPacket[_time.offset] != _time.tl))) {
+         return false;
+      }
+      for (int i = 0; i < _messageCount; ++i) {
+         const Message &message = _messages[i];
+         if ((pPacket[message.start] != message.startTl) || (pPacket[message.crc] != message.crcTl)) {
+            return false;
+         }
+      }
+      for (int i = 0; i < _valueCount; ++i) {
+         const Value &value = _values[i];
+         if ((pPacket[value.scaler] != value.scalerTl) || (pPacket[value.value] != value.valueTl) ||
+             (pPacket[value.obis] != (SmlCursor::SML_OCTET_ID | (SmlObisTable::OBIS_LENGTH + 1))) ||
+             !SmlObisTable::matches(SmlObisTable::ENTRIES[value.entry], pPacket + value.obis + 1)) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+private:
+   int _packetLength;
+   int _messageCount;
+   int _valueCount;
+   bool _valid;
+   bool _overflow;
+   bool _frame;
+   uint8_t _timeType;
+   Field _serverId;
+   Field _time;
+   Message _messages[MAX_MESSAGES];
+   Value _values[MAX_VALUES];
+
+   static void setField(Field &field, const uint8_t *pPacket, const uint8_t *pElement) {
+      field.offset = (uint16_t)(pElement - pPacket);
+      field.tl = *pElement;
+      field.valid = true;
+   }
+};
 
 /**
  * @brief Parser to read power and energy-values from a SML packet
  */
 class SmlParser {
 public:
-   /// Constructor
-   SmlParser() : _parsedOk(0U), _parseErrors(0U), _powerInW(0U), _powerOutW(0U), _energyInWh(0UL), _energyOutWh(0UL),
-      _pPacket(NULL), _packetLength(0) {}
+   /**
+    * @brief CRC verification policy.
+    *
+    * Every packet has a transport CRC, which is checked by the stream reader, and every message has an own CRC,
+    * which is checked by the parser. Both cover the same bytes, so one of them can be skipped to save CPU time.
+    */
+   enum CrcPolicy {
+      /// Check the transport CRC and the CRC of every message
+      CRC_FULL,
+      /// Check only the transport CRC
+      CRC_TRANSPORT_ONLY,
+      /// Check only the CRC of every message
+      CRC_MESSAGE_ONLY,
+      /// Don't check any CRC
+      CRC_NONE
+   };
+
+   /// True, if the stream reader has to check the transport CRC for the policy
+   static constexpr bool checksTransportCrc(CrcPolicy crcPolicy) {
+      return (crcPolicy == CRC_FULL) || (crcPolicy == CRC_TRANSPORT_ONLY);
+   }
+
+   /// True, if the parser has to check the CRC of every message for the policy
+   static constexpr bool checksMessageCrc(CrcPolicy crcPolicy) {
+      return (crcPolicy == CRC_FULL) || (crcPolicy == CRC_MESSAGE_ONLY);
+   }
+
+   /**
+    * @brief Constructor
+    * @param useShapeCache  Read packets with the layout of the previous packet directly from the learned offsets
+    */
+   explicit SmlParser(bool useShapeCache = true, CrcPolicy crcPolicy = CRC_FULL) :
+      _parsedOk(0U), _parseErrors(0U), _shapeHits(0U), _shapeMisses(0U), _messageCrcChecks(0U), _messageCrcErrors(0U),
+      _messageCrcSkipped(0U), _receivedSlots(0U), _packetSlots(0U), _powerInW(0U), _powerOutW(0U), _useShapeCache(useShapeCache), _crcPolicy(crcPolicy)
+   {
+      memset(_values, 0, sizeof(_values));
+   }
 
    /// Number of successfully parsed packets.
    inline uint32_t getParsedOk() const { return _parsedOk; }
 
    /// Number of parse errors.
    inline uint32_t getParseErrors() const { return _parseErrors; }
+
+   /// Number of checked message CRCs.
+   inline uint32_t getMessageCrcChecks() const { return _messageCrcChecks; }
+
+   /// Number of wrong message CRCs. With CRC_FULL, these are errors, which weren't detected by the transport CRC.
+   inline uint32_t getMessageCrcErrors() const { return _messageCrcErrors; }
+
+   /// Number of message CRCs, which were skipped because of the CRC policy.
+   inline uint32_t getMessageCrcSkipped() const { return _messageCrcSkipped; }
+
+   /// CRC verification policy
+   inline CrcPolicy getCrcPolicy() const { return _crcPolicy; }
+
+   /// Number of packets read with the learned layout.
+   inline uint32_t getShapeHits() const { return _shapeHits; }
+
+   /// Number of packets, which didn't match the learned layout and were parsed completely.
+   inline uint32_t getShapeMisses() const { return _shapeMisses; }
    
    /// Imported power in centi W (1cW = 0.01W)
    inline uint32_t getPowerIn() const { return _powerInW; }
@@ -26,10 +514,22 @@ public:
    inline uint32_t getPowerOut() const { return _powerOutW; }
 
    /// Imported energy in centi Wh (1cW = 0.01Wh)
-   inline uint64_t getEnergyIn() const { return _energyInWh; }
+   inline uint64_t getEnergyIn() const { return (uint64_t)_values[SML_ENERGY_IN]; }
 
    /// Exported energy in centi Wh (1cW = 0.01Wh)
-   inline uint64_t getEnergyOut() const { return _energyOutWh; }
+   inline uint64_t getEnergyOut() const { return (uint64_t)_values[SML_ENERGY_OUT]; }
+
+   /// Value of a slot of the OBIS table (see SmlValueSlot for the units)
+   inline int64_t getValue(SmlValueSlot slot) const { return _values[slot]; }
+
+   /// True, if a value for the slot was received at least once
+   inline bool hasValue(SmlValueSlot slot) const { return (_receivedSlots & (1UL << slot)) != 0U; }
+
+   /// Slots received with the last packet (bit n is set for slot n)
+   inline uint32_t getPacketSlots() const { return _packetSlots; }
+
+   /// Information about the messages of the last frame (see parseFrame())
+   inline const SmlFrameInfo &getFrameInfo() const { return _frameInfo; }
 
    /**
     * @brief Parse a SML packet
@@ -38,35 +538,34 @@ public:
     * @return true, if the packet could be parsed successfully
     */
    bool parsePacket(const uint8_t *pPacket, int packetLength) {
-      _pPacket = pPacket;
-      _packetLength = packetLength;
-
-      int pos = 0;
-
-      while (pos < packetLength) {
-         if (pPacket[pos] == SML_END_OF_MESSAGE) {
-            break;
+      _packetSlots = 0U;
+      if (_useShapeCache) {
+         if (_shape.matches(pPacket, packetLength, false) && parseShape(pPacket, packetLength)) {
+            ++_shapeHits;
+            ++_parsedOk;
+            return true;
          }
-         int messageStart = pos;
-         getLength(pos);      // Skip list identifier of message
-         int messageBody = getNextElement(pos, 3);
-         getNextElement(pos); // Skip to crc
-         int messageLength = pos - messageStart;
-         uint16_t crc16Expected = (uint16_t)getNextIntValue(pos);
+         ++_shapeMisses;
+      }
+      _shape.begin(packetLength, false);
+      for (SmlCursor message(pPacket, packetLength); message.isValid() && !message.isEndOfMessage(); message.next()) {
+         // Message: transactionId, groupNo, abortOnError, messageBody, crc16, endOfMessage
+         SmlCursor element = message.getChildren();
+         element.skip(3);
+         SmlCursor messageBody = element;
+         element.next();
+         int messageLength = (int)(element.getElement() - message.getElement());
 
          // Check crc
-         _crc16.init();
-         _crc16.calc(pPacket + messageStart, messageLength);
-         if (crc16Expected == _crc16.getCrc()) {
-            if (parseMessageBody(messageBody)) {
+         if (checkMessageCrc(message.getElement(), messageLength, element)) {
+            _shape.addMessage(pPacket, message.getElement(), element.getElement(), getMessageType(messageBody));
+            if (parseMessageBody(messageBody, pPacket)) {
+               _shape.end();
                ++_parsedOk;
                return true;
             }
-            // Skip 'end of message'
-            ++pos;
          }
          else {
-            //printf("Parser: Warning %04x != %04x\n", crc16Expected, _crc16.getCrc());
             ++_parseErrors;
             return false;
          }
@@ -75,197 +574,375 @@ public:
       return false;
    }
 
+   /**
+    * @brief Parse all messages of a SML frame
+    *
+    * In contrast to parsePacket(), the values of all GET_LIST_RES messages are stored and a message with
+    * a wrong CRC doesn't discard the other messages of the frame. The status of every message, the server id
+    * and the time of the meter are available with getFrameInfo().
+    * A frame with at least one wrong CRC is counted as parse error, even if other messages could be parsed.
+    * @param pPacket       Packet to parse
+    * @param packetLength  Length of the packet in bytes
+    * @return true, if at least one GET_LIST_RES message could be parsed
+    */
+   bool parseFrame(const uint8_t *pPacket, int packetLength) {
+      _frameInfo.clear();
+      _packetSlots = 0U;
+      if (_useShapeCache) {
+         if (_shape.matches(pPacket, packetLength, true) && parseShape(pPacket, packetLength)) {
+            ++_shapeHits;
+            ++_parsedOk;
+            return true;
+         }
+         ++_shapeMisses;
+      }
+      _shape.begin(packetLength, true);
+      for (SmlCursor message(pPacket, packetLength); message.isValid() && !message.isEndOfMessage(); message.next()) {
+         // Message: transactionId, groupNo, abortOnError, messageBody, crc16, endOfMessage
+         SmlCursor element = message.getChildren();
+         element.skip(3);
+         SmlCursor messageBody = element;
+         element.next();
+         int messageLength = (int)(element.getElement() - message.getElement());
+
+         // Check crc
+         bool crcOk = checkMessageCrc(message.getElement(), messageLength, element);
+         uint16_t type = crcOk ? getMessageType(messageBody) : 0U;
+         if (_frameInfo.messageCount < SmlFrameInfo::MAX_MESSAGES) {
+            _frameInfo.messages[_frameInfo.messageCount].type = type;
+            _frameInfo.messages[_frameInfo.messageCount].crcOk = crcOk;
+         }
+         ++_frameInfo.messageCount;
+         if (!crcOk) {
+            ++_frameInfo.crcErrors;
+            continue;
+         }
+         _shape.addMessage(pPacket, message.getElement(), element.getElement(), type);
+
+         // Message body: messageType, content
+         SmlCursor content = messageBody.getChildren();
+         content.next();
+         switch (type) {
+         case SML_OPEN_RES:
+            _frameInfo.openResponse = true;
+            parseOpenResponse(content, pPacket);
+            break;
+         case SML_GET_LIST_RES:
+            if (parseMessageBody(messageBody, pPacket)) {
+               ++_frameInfo.listResponses;
+               parseListMetadata(content, pPacket);
+            }
+            break;
+         case SML_CLOSE_RES:
+            _frameInfo.closeResponse = true;
+            break;
+         }
+      }
+
+      if (_frameInfo.crcErrors > 0) {
+         ++_parseErrors;
+      }
+      if (_frameInfo.listResponses == 0) {
+         return false;
+      }
+      if (_frameInfo.crcErrors == 0) {
+         _shape.end();
+      }
+      ++_parsedOk;
+      return true;
+   }
+
 protected:
    // ----------------------------------------------------------------------------
    // SML constants
    // For details see:
    // https://www.bsi.bund.de/SharedDocs/Downloads/DE/BSI/Publikationen/TechnischeRichtlinien/TR03109/TR-03109-1_Anlage_Feinspezifikation_Drahtgebundene_LMN-Schnittstelle_Teilb.pdf?__blob=publicationFile
    // ----------------------------------------------------------------------------
-   static const uint8_t SML_MORE_FLAG = 0x80;
-   static const uint8_t SML_TAG_MASK = 0x70;
-   static const uint8_t SML_LENGTH_MASK = 0x0F;
-   static const uint8_t SML_OCTED_ID = 0x00;
-   static const uint8_t SML_BOOL_ID = 0x40;
-   static const uint8_t SML_INT_ID = 0x50;
-   static const uint8_t SML_UINT_ID = 0x60;
-   static const uint8_t SML_LIST_ID = 0x70;
-   static const uint8_t SML_END_OF_MESSAGE = 0x00;
-
+   static const uint16_t SML_OPEN_RES = 0x0101;
+   static const uint16_t SML_CLOSE_RES = 0x0201;
    static const uint16_t SML_GET_LIST_RES = 0x0701;
+   static const uint8_t SML_TIME_LOCAL_TIMESTAMP = 3;
 
-   static const int SML_MIN_SCALE = -2;
-   static const int SML_MAX_SCALE = 5;
-   static const int SML_SCALE_VALUES = SML_MAX_SCALE - SML_MIN_SCALE + 1;
-   static const int32_t SCALE_FACTORS[SML_SCALE_VALUES];
-
-   // ----------------------------------------------------------------------------
-   // OBIS constants
-   //
-   // For details see:
-   // https://www.promotic.eu/en/pmdoc/Subsystems/Comm/PmDrivers/IEC62056_OBIS.htm
-   // https://www.bundesnetzagentur.de/DE/Service-Funktionen/Beschlusskammern/BK06/BK6_81_GPKE_GeLi/Mitteilung_Nr_20/Anlagen/Obis-Kennzahlen-System_2.0.pdf?__blob=publicationFile&v=2
-   // ----------------------------------------------------------------------------
-   static const uint8_t OBIS_TARIFF = 0;
-   static const uint8_t OBIS_INSTANTANEOUS_POWER_TYPE = 7;
-   static const uint8_t OBIS_ENERGY_TYPE = 8;
-   static const uint8_t OBIS_POSITIVE_ACTIVE_POWER = 1;
-   static const uint8_t OBIS_NEGATIVE_ACTIVE_POWER = 2;
-   static const uint8_t OBIS_SUM_ACTIVE_POWER = 16;
+   static const int SML_MAX_SCALE_SHIFT = 7;
+   static const int32_t SCALE_FACTORS[SML_MAX_SCALE_SHIFT + 1];
 
    uint32_t _parsedOk;
    uint32_t _parseErrors;
+   uint32_t _shapeHits;
+   uint32_t _shapeMisses;
+   uint32_t _messageCrcChecks;
+   uint32_t _messageCrcErrors;
+   uint32_t _messageCrcSkipped;
+   uint32_t _receivedSlots;
+   uint32_t _packetSlots;
 
    uint32_t _powerInW;
    uint32_t _powerOutW;
 
-   uint64_t _energyInWh;
-   uint64_t _energyOutWh;
+   int64_t _values[SML_VALUE_SLOTS];
 
-   Crc16Ccitt _crc16;
+   bool _useShapeCache;
+   CrcPolicy _crcPolicy;
+   SmlShape _shape;
 
-   const uint8_t *_pPacket;
-   int _packetLength;
+   SmlFrameInfo _frameInfo;
+
+   Crc16Ccitt _crc16;
 
    /**
-    * @brief Parse the message body and store parsed information
-    * @param pos  Position in the packet
+    * @brief Read a packet with the learned layout.
+    * @return false, if a CRC doesn't match (the packet is parsed completely in this case)
     */
-   bool parseMessageBody(int pos) {
-      getLength(pos);            // Skip list identifier of message
-      uint16_t message = (uint16_t)getNextIntValue(pos);
-      if (message != SML_GET_LIST_RES) {
-         return false;
+   bool parseShape(const uint8_t *pPacket, int packetLength) {
+      for (int i = 0; i < _shape.getMessageCount(); ++i) {
+         const SmlShape::Message &message = _shape.getMessage(i);
+         SmlCursor crc(pPacket + message.crc, packetLength - message.crc);
+         if (!checkMessageCrc(pPacket + message.start, message.crc - message.start, crc, false)) {
+            return false;
+         }
       }
-      getLength(pos);            // Skip list identifier of message body
-      getNextElement(pos, 4);    // Skip first 4 entries of GET_LIST_RES message
-      int listElements = getLength(pos);
-      for (int i = 0; i < listElements; ++i) {
-         getLength(pos);         // Skip the list identifier of the SML_LIST_ENTRY
-         pos += 3;               // Skip the beginning of the value-identifier
-         uint8_t index = _pPacket[pos++];
-         uint8_t type = _pPacket[pos++];
-         uint8_t tariff = _pPacket[pos++];
-         ++pos;                  // Skip next value
-         getNextElement(pos, 2);  // Skip status and timestamp
-         getNextIntValue(pos);      // Skip unit
-         int8_t scale = (int8_t)getNextIntValue(pos);
-         int64_t value = (int64_t)getNextIntValue(pos);
-         getNextElement(pos);    // Skip signature
-
-         // Store the value in fields
-         if ((tariff == OBIS_TARIFF) && (scale >= SML_MIN_SCALE) && (scale <= SML_MAX_SCALE)) {
-            value *= SCALE_FACTORS[scale - SML_MIN_SCALE];
-            switch (type) {
-            case OBIS_INSTANTANEOUS_POWER_TYPE:
-               switch (index) {
-               case OBIS_POSITIVE_ACTIVE_POWER:
-                  _powerInW = (uint32_t)value;
-                  break;
-               case OBIS_NEGATIVE_ACTIVE_POWER:
-                  _powerOutW = (uint32_t)value;;
-                  break;
-               case OBIS_SUM_ACTIVE_POWER:
-                  _powerInW = (uint32_t)(value >= 0 ? value : 0U);
-                  _powerOutW = (uint32_t)(value <= 0 ? -value : 0U);
-                  break;
-               }
-               break;
-
-            case OBIS_ENERGY_TYPE:
-               switch (index) {
-               case OBIS_POSITIVE_ACTIVE_POWER:
-                  _energyInWh = (uint64_t)value;
-                  break;
-               case OBIS_NEGATIVE_ACTIVE_POWER:
-                  _energyOutWh = (uint64_t)value;
-                  break;
-               }
-               break;
-            }
+      // Count the CRCs only now, a packet with a wrong CRC is parsed again completely
+      if (checksMessageCrc(_crcPolicy)) {
+         _messageCrcChecks += _shape.getMessageCount();
+      }
+      else {
+         _messageCrcSkipped += _shape.getMessageCount();
+      }
+      for (int i = 0; i < _shape.getValueCount(); ++i) {
+         const SmlShape::Value &value = _shape.getValue(i);
+         SmlCursor scaler(pPacket + value.scaler, packetLength - value.scaler);
+         SmlCursor field(pPacket + value.value, packetLength - value.value);
+         storeScaledValue(SmlObisTable::ENTRIES[value.entry], (int8_t)scaler.getInt(), field.getInt());
+      }
+      if (_shape.isFrame()) {
+         // All messages of the learned layout had a correct CRC
+         for (int i = 0; i < _shape.getMessageCount(); ++i) {
+            uint16_t type = _shape.getMessage(i).type;
+            _frameInfo.messages[i].type = type;
+            _frameInfo.messages[i].crcOk = true;
+            _frameInfo.openResponse |= (type == SML_OPEN_RES);
+            _frameInfo.closeResponse |= (type == SML_CLOSE_RES);
+            _frameInfo.listResponses += (type == SML_GET_LIST_RES) ? 1 : 0;
+         }
+         _frameInfo.messageCount = _shape.getMessageCount();
+         const SmlShape::Field &serverId = _shape.getServerId();
+         if (serverId.valid) {
+            readServerId(SmlCursor(pPacket + serverId.offset, packetLength - serverId.offset));
+         }
+         const SmlShape::Field &time = _shape.getTime();
+         if (time.valid) {
+            _frameInfo.time = (uint32_t)SmlCursor(pPacket + time.offset, packetLength - time.offset).getInt();
+            _frameInfo.timeType = _shape.getTimeType();
          }
       }
       return true;
    }
 
    /**
-    * @brief Get the type of the current element
-    * @param pos  Position in the packet
-    * @return The type of the current element
+    * @brief Check the CRC of a message, if this is required by the CRC policy.
+    * @param pMessage       Start of the message
+    * @param messageLength  Length of the message up to the CRC
+    * @param crc            CRC of the message
+    * @param count          Update the CRC counters
+    * @return true, if the CRC matches or isn't checked
+    */
+   bool checkMessageCrc(const uint8_t *pMessage, int messageLength, const SmlCursor &crc, bool count = true) {
+      if (!crc.isValid()) {
+         return false;
+      }
+      if (!checksMessageCrc(_crcPolicy)) {
+         _messageCrcSkipped += count ? 1U : 0U;
+         return true;
+      }
+      _crc16.init();
+      _crc16.calc(pMessage, messageLength);
+      bool crcOk = ((uint16_t)crc.getInt() == _crc16.getCrc());
+      if (count) {
+         countMessageCrc(crcOk);
+      }
+      return crcOk;
+   }
+
+   /**
+    * @brief Update the CRC counters for a checked message CRC.
     */
-   inline uint8_t getType(int pos) const { return _pPacket[pos] & SML_TAG_MASK; }
+   inline void countMessageCrc(bool crcOk) {
+      ++_messageCrcChecks;
+      if (!crcOk) {
+         ++_messageCrcErrors;
+      }
+   }
 
    /**
-    * @brief Get the length of the current element
-    * @param pos  Position in the packet
-    * @param updatePosition Flag that indicates wether the position should be updated
-    * @return The length of the current element in bytes
+    * @brief Returns the type of a message body.
     */
-   uint16_t getLength(int &pos, bool updatePosition = true) const {
-      int localPos = pos;
+   static uint16_t getMessageType(const SmlCursor &messageBody) {
+      // Message body: messageType, content
+      return (uint16_t)messageBody.getChildren().getInt();
+   }
 
-      uint16_t result = _pPacket[localPos] & SML_LENGTH_MASK;
-      while ((_pPacket[localPos] & SML_MORE_FLAG) && (localPos < _packetLength)) {
-         result = (result << 4) | (_pPacket[++localPos] & SML_LENGTH_MASK);
+   /**
+    * @brief Read the server id and the time of the meter from an OPEN_RES message.
+    */
+   void parseOpenResponse(const SmlCursor &content, const uint8_t *pPacket) {
+      // OPEN_RES: codepage, clientId, reqFileId, serverId, refTime, smlVersion
+      SmlCursor element = content.getChildren();
+      element.skip(3);
+      if (readServerId(element)) {
+         _shape.setServerId(pPacket, element.getElement());
       }
-      ++localPos;
+      element.next();
+      readTime(element, pPacket);
+   }
 
-      if (updatePosition) {
-         pos = localPos;
+   /**
+    * @brief Read the server id and the time of the meter from a GET_LIST_RES message, if they are still unknown.
+    */
+   void parseListMetadata(const SmlCursor &content, const uint8_t *pPacket) {
+      // GET_LIST_RES: clientId, serverId, listName, actSensorTime, valList, listSignature, actGatewayTime
+      SmlCursor element = content.getChildren();
+      element.next();
+      if ((_frameInfo.serverIdLength == 0) && readServerId(element)) {
+         _shape.setServerId(pPacket, element.getElement());
+      }
+      element.skip(2);
+      if (_frameInfo.timeType == SmlFrameInfo::SML_TIME_NONE) {
+         readTime(element, pPacket);
       }
-      return result;
    }
 
    /**
-    * @brief Get the position of the next element
-    * @param pos  Position in the packet (will be updated!)
-    * @param elementsToRead Elements to skip
-    * @return The position of the next element in the packet
+    * @brief Copy the server id to the frame information.
+    * @return true, if the element contains a valid server id
     */
-   int getNextElement(int &pos, int elementsToRead = 1) {
-      while ((elementsToRead > 0) && (pos < _packetLength)) {
-         --elementsToRead;
-         uint8_t elementType = getType(pos);
-         uint16_t elementLength = getLength(pos, false);
+   bool readServerId(const SmlCursor &serverId) {
+      int length = serverId.getDataLength();
+      if (!serverId.isValid() || (serverId.getType() != SmlCursor::SML_OCTET_ID) ||
+          (length <= 0) || (length > SmlFrameInfo::MAX_SERVER_ID_LENGTH)) {
+         return false;
+      }
+      memcpy(_frameInfo.serverId, serverId.getData(), length);
+      _frameInfo.serverIdLength = length;
+      return true;
+   }
+
+   /**
+    * @brief Read a SML_Time element to the frame information.
+    */
+   void readTime(const SmlCursor &time, const uint8_t *pPacket) {
+      // SML_Time: choice (1: secIndex, 2: timestamp, 3: localTimestamp), value
+      if ((time.getType() != SmlCursor::SML_LIST_ID) || (time.getLength() != 2)) {
+         return;
+      }
+      SmlCursor element = time.getChildren();
+      uint8_t timeType = (uint8_t)element.getInt();
+      element.next();
+      if (timeType == SML_TIME_LOCAL_TIMESTAMP) {
+         // SML_TimestampLocal: timestamp, localOffset, seasonTimeOffset
+         element = element.getChildren();
+         timeType = SmlFrameInfo::SML_TIME_TIMESTAMP;
+      }
+      if (!element.isValid() || (element.getType() != SmlCursor::SML_UINT_ID) ||
+          ((timeType != SmlFrameInfo::SML_TIME_SEC_INDEX) && (timeType != SmlFrameInfo::SML_TIME_TIMESTAMP))) {
+         return;
+      }
+      _frameInfo.time = (uint32_t)element.getInt();
+      _frameInfo.timeType = timeType;
+      _shape.setTime(pPacket, element.getElement(), timeType);
+   }
 
-         if (elementType == SML_LIST_ID) {
-            ++pos;
-            elementsToRead += elementLength;
+   /**
+    * @brief Parse the message body and store parsed information
+    * @param messageBody  Cursor pointing to the message body
+    * @param pPacket      Start of the packet (for the learned layout)
+    */
+   bool parseMessageBody(const SmlCursor &messageBody, const uint8_t *pPacket) {
+      // Message body: messageType, content
+      SmlCursor element = messageBody.getChildren();
+      uint16_t message = (uint16_t)element.getInt();
+      if (message != SML_GET_LIST_RES) {
+         return false;
+      }
+      // GET_LIST_RES: clientId, serverId, listName, actSensorTime, valList, listSignature, actGatewayTime
+      element.next();
+      SmlCursor valList = element.getChildren();
+      valList.skip(4);
+      for (SmlCursor entry = valList.getChildren(); entry.isValid(); entry.next()) {
+         // SML_LIST_ENTRY: objName, status, valTime, unit, scaler, value, valueSignature
+         SmlCursor field = entry.getChildren();
+         const SmlObisEntry *pEntry = (field.getDataLength() == SmlObisTable::OBIS_LENGTH) ? SmlObisTable::find(field.getData()) : NULL;
+         if (pEntry == NULL) {
+            continue;
          }
-         else {
-            pos += elementLength;
+         const uint8_t *pObis = field.getElement();
+         field.skip(4);
+         SmlCursor scaler = field;
+         field.next();
+         if (!field.isValid()) {
+            continue;
          }
+         _shape.addValue(pPacket, (int)(pEntry - SmlObisTable::ENTRIES), pObis, scaler.getElement(), field.getElement());
+         storeScaledValue(*pEntry, (int8_t)scaler.getInt(), field.getInt());
       }
-      return pos;
+      return true;
    }
 
    /**
-    * @brief Get the next integer value (supports both, uint and int types)
-    * @param pos  Position in the packet (will be updated!)
-    * @return The value as uint64
-    * @note This function returns 0 if the element-type is invalid
+    * @brief Scale a value to the exponent of its slot and store it.
     */
-   int64_t getNextIntValue(int &pos) {
-      uint8_t elementType = getType(pos);
-      uint16_t elementLength = getLength(pos);
-      int64_t value = 0UL;
-      if (((elementType == SML_INT_ID) || (elementType == SML_UINT_ID)) && elementLength > 1) {
-         value = (elementType == (int64_t)(SML_INT_ID) ? (int8_t)_pPacket[pos++] : _pPacket[pos++]);
-         for (int i = 2; i < elementLength; ++i) {
-            value = (value << 8) | _pPacket[pos++];
-         }
+   void storeScaledValue(const SmlObisEntry &entry, int scale, int64_t value) {
+      if (scaleValue(entry, scale, value)) {
+         storeValue((SmlValueSlot)entry.slot, value);
+      }
+   }
+
+   /**
+    * @brief Scale a value to the exponent of its slot.
+    * @return false, if the scaler is out of range
+    */
+   static bool scaleValue(const SmlObisEntry &entry, int scale, int64_t &value) {
+      int scaleShift = scale - entry.exponent;
+      if ((scaleShift > SML_MAX_SCALE_SHIFT) || (scaleShift < -SML_MAX_SCALE_SHIFT)) {
+         return false;
+      }
+      if (scaleShift >= 0) {
+         value *= SCALE_FACTORS[scaleShift];
       }
       else {
-         pos += elementLength - 1;
+         value /= SCALE_FACTORS[-scaleShift];
+      }
+      return true;
+   }
+
+   /**
+    * @brief Store a value in its slot.
+    */
+   void storeValue(SmlValueSlot slot, int64_t value) {
+      _values[slot] = value;
+      _receivedSlots |= (1UL << slot);
+      _packetSlots |= (1UL << slot);
+      switch (slot) {
+      case SML_POWER_IN:
+         _powerInW = (uint32_t)value;
+         break;
+      case SML_POWER_OUT:
+         _powerOutW = (uint32_t)value;
+         break;
+      case SML_POWER_SUM:
+         _powerInW = (uint32_t)(value >= 0 ? value : 0U);
+         _powerOutW = (uint32_t)(value <= 0 ? -value : 0U);
+         break;
+      default:
+         break;
       }
-      return value;
    }
 };
 
 // Scale factors
-// Note: Exponent of the scale factors is shifted by 2 (10^0 becomes 10^2, etc.)
+// Note: The index is the difference between the scaler of the value and the exponent of its slot
+//       (e.g. a scaler of 1 results in 1000 for a value in centi W).
 //       This is done to keep integer calculations as long as possible.
-//       As a result, all values are returned as Centi-W or Centi-Wh.
-//                                                                     -2  -1    0     1      2       3        4         5
-const int32_t SmlParser::SCALE_FACTORS[SmlParser::SML_SCALE_VALUES] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+//                                                                          0   1    2     3      4       5        6         7
+const int32_t SmlParser::SCALE_FACTORS[SmlParser::SML_MAX_SCALE_SHIFT + 1] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
 
 #endif // SMLPARSER_H
@@ -0,0 +1,421 @@
+#ifndef SML_STREAM_PARSER_H
+#define SML_STREAM_PARSER_H
+
+#include <stdint.h>
+#include "crc16ccitt.h"
+#include "smlcursor.h"
+#include "smlparser.h"
+
+/**
+ * @brief Parser, which decodes a SML packet while it's still being received.
+ *
+ * update() walks all elements of the payload received so far and keeps its position in a small stack of
+ * list depths and remaining element counts. Extracted values are staged and the CRC of every message is
+ * calculated on the way. finish() parses the last bytes after the stream reader found a valid packet CRC and
+ * commits the staged values, so almost no work is left after the last byte was received.
+ *
+ * The results are the same as with parseFrame(): values of messages with a wrong CRC are discarded, and the
+ * packet is parsed completely with parseFrame(), if its structure can't be followed.
+ *
+ * Example:
+ *    while (reader.addData(&dataByte, 1) < 0) { ...; parser.update(reader); }
+ *    parser.finish(reader);
+ */
+class SmlStreamParser : public SmlParser {
+public:
+   /// Maximum nesting depth of lists
+   static const int MAX_DEPTH = 8;
+   /// Maximum number of staged values per packet
+   static const int MAX_STAGED_VALUES = SmlShape::MAX_VALUES;
+
+   /**
+    * @brief Constructor
+    * @param crcPolicy  CRC verification policy (the policy of the stream reader must match)
+    */
+   explicit SmlStreamParser(CrcPolicy crcPolicy = CRC_FULL) :
+      SmlParser(false, crcPolicy), _fullParses(0U), _active(false), _packetNumber(0U), _pos(0), _endPos(0), _depth(0), _error(false),
+      _crcPos(0), _crcChecked(false), _crcOk(false), _messageType(0U), _contentStart(0),
+      _firstStaged(0), _pEntry(NULL), _scale(0), _stagedCrcChecks(0U), _stagedCrcErrors(0U), _stagedCrcSkipped(0U),
+      _stagedCount(0), _contentCount(0)
+   {
+      _stagedInfo.clear();
+   }
+
+   /// Number of packets, whose structure couldn't be followed and which were parsed completely by finish()
+   inline uint32_t getFullParses() const { return _fullParses; }
+
+   /**
+    * @brief Parse the payload of the current packet, which was received so far.
+    * @param packetNumber  Number of the packet (changes, when a new packet starts)
+    * @param pPayload      Payload received so far
+    * @param length        Number of bytes, which can't change anymore
+    */
+   void update(uint32_t packetNumber, const uint8_t *pPayload, int length) {
+      if (packetNumber != _packetNumber) {
+         start(packetNumber);
+      }
+      else if (!_active || (length < _pos)) {
+         // The packet was already finished
+         return;
+      }
+      walk(pPayload, length);
+      if ((_depth > 0) && !_crcChecked && checksMessageCrc(_crcPolicy)) {
+         _messageCrc.calc(pPayload + _crcPos, _pos - _crcPos);
+         _crcPos = _pos;
+      }
+   }
+
+   /**
+    * @brief Parse the payload received so far by a stream reader.
+    */
+   template <class Reader>
+   inline void update(Reader &reader) {
+      update(reader.getPacketNumber(), reader.getData(), reader.getPayloadLength());
+   }
+
+   /**
+    * @brief Parse the rest of a complete packet and commit the staged values.
+    *
+    * Must only be called for packets with a valid CRC.
+    * @param packetNumber  Number of the packet
+    * @param pPacket       Complete packet
+    * @param packetLength  Length of the packet in bytes (without padding)
+    * @return true, if at least one GET_LIST_RES message could be parsed
+    */
+   bool finish(uint32_t packetNumber, const uint8_t *pPacket, int packetLength) {
+      if ((packetNumber != _packetNumber) || !_active) {
+         start(packetNumber);
+      }
+      walk(pPacket, packetLength);
+      _active = false;
+      // Padding bytes after the last message may already be parsed as end of message markers
+      if (_error || (_depth > 0) || (_pos < packetLength) || (_endPos > packetLength)) {
+         ++_fullParses;
+         return parseFrame(pPacket, packetLength);
+      }
+      return commit(pPacket, packetLength);
+   }
+
+   /**
+    * @brief Parse the rest of the last packet of a stream reader and commit the staged values.
+    */
+   template <class Reader>
+   inline bool finish(Reader &reader) {
+      return finish(reader.getPacketNumber(), reader.getData(), reader.getLength());
+   }
+
+protected:
+   // Positions in the packet
+   static const int MESSAGE_DEPTH = 1;
+   static const int BODY_DEPTH = 2;
+   static const int CONTENT_DEPTH = 3;
+   static const int ENTRY_DEPTH = 5;
+   static const int MESSAGE_CRC_INDEX = 4;
+   static const int BODY_TYPE_INDEX = 0;
+   static const int BODY_CONTENT_INDEX = 1;
+   static const int LIST_VAL_LIST_INDEX = 4;
+   static const int ENTRY_OBIS_INDEX = 0;
+   static const int ENTRY_SCALER_INDEX = 4;
+   static const int ENTRY_VALUE_INDEX = 5;
+
+   /**
+    * @brief Value, which is stored when the packet is committed.
+    */
+   struct StagedValue {
+      uint8_t slot;
+      int64_t value;
+   };
+
+   /**
+    * @brief Content of a message with a correct CRC, which contains meta data.
+    */
+   struct Content {
+      uint16_t type;
+      int offset;
+   };
+
+   uint32_t _fullParses;
+
+   bool _active;
+   uint32_t _packetNumber;
+   int _pos;
+   int _endPos;
+
+   // Stack of open lists: number of elements left and index of the current element
+   int _depth;
+   int _remaining[MAX_DEPTH];
+   uint8_t _index[MAX_DEPTH];
+   bool _error;
+
+   // Current message
+   int _crcPos;
+   bool _crcChecked;
+   bool _crcOk;
+   uint16_t _messageType;
+   int _contentStart;
+   int _firstStaged;
+   Crc16Ccitt _messageCrc;
+
+   // Current list entry
+   const SmlObisEntry *_pEntry;
+   int _scale;
+
+   SmlFrameInfo _stagedInfo;
+   // Message CRC counters of the current packet
+   uint32_t _stagedCrcChecks;
+   uint32_t _stagedCrcErrors;
+   uint32_t _stagedCrcSkipped;
+   int _stagedCount;
+   StagedValue _staged[MAX_STAGED_VALUES];
+   int _contentCount;
+   Content _contents[SmlFrameInfo::MAX_MESSAGES];
+
+   /**
+    * @brief Start a new packet and discard all staged values.
+    */
+   void start(uint32_t packetNumber) {
+      _active = true;
+      _packetNumber = packetNumber;
+      _pos = 0;
+      _endPos = 0;
+      _depth = 0;
+      _error = false;
+      _stagedCount = 0;
+      _contentCount = 0;
+      _stagedInfo.clear();
+      _stagedCrcChecks = 0U;
+      _stagedCrcErrors = 0U;
+      _stagedCrcSkipped = 0U;
+   }
+
+   /**
+    * @brief Parse all complete elements.
+    */
+   void walk(const uint8_t *pData, int length) {
+      while (!_error && (_pos < length)) {
+         if ((_depth == 0) && (pData[_pos] == SmlCursor::SML_END_OF_MESSAGE)) {
+            // Padding after the last message
+            ++_pos;
+            continue;
+         }
+         SmlCursor element(pData + _pos, length - _pos, 1);
+         if (!element.isValid()) {
+            // Wait for the rest of the element
+            return;
+         }
+         if (element.getType() == SmlCursor::SML_LIST_ID) {
+            openList(element);
+         }
+         else if (_depth == 0) {
+            _error = true;
+         }
+         else {
+            readElement(pData, element);
+            _pos += element.getHeaderLength() + element.getDataLength();
+            nextElement();
+         }
+      }
+   }
+
+   /**
+    * @brief Enter a list.
+    */
+   void openList(const SmlCursor &list) {
+      if (_depth >= MAX_DEPTH) {
+         _error = true;
+         return;
+      }
+      if (_depth == 0) {
+         startMessage();
+      }
+      else if ((_depth == BODY_DEPTH) && (_index[BODY_DEPTH - 1] == BODY_CONTENT_INDEX)) {
+         _contentStart = _pos;
+      }
+      _pos += list.getHeaderLength();
+      _remaining[_depth] = list.getLength();
+      _index[_depth] = 0;
+      ++_depth;
+      if (_depth == ENTRY_DEPTH) {
+         _pEntry = NULL;
+      }
+      closeLists();
+   }
+
+   /**
+    * @brief Move to the next element of the current list.
+    */
+   void nextElement() {
+      ++_index[_depth - 1];
+      --_remaining[_depth - 1];
+      closeLists();
+   }
+
+   /**
+    * @brief Leave all complete lists.
+    */
+   void closeLists() {
+      while ((_depth > 0) && (_remaining[_depth - 1] <= 0)) {
+         --_depth;
+         if (_depth == 0) {
+            endMessage();
+         }
+         else {
+            ++_index[_depth - 1];
+            --_remaining[_depth - 1];
+         }
+      }
+   }
+
+   /**
+    * @brief Handle an element depending on its position in the packet.
+    */
+   void readElement(const uint8_t *pData, const SmlCursor &element) {
+      uint8_t index = _index[_depth - 1];
+      if (_depth == MESSAGE_DEPTH) {
+         // Message: transactionId, groupNo, abortOnError, messageBody, crc16, endOfMessage
+         if (index == MESSAGE_CRC_INDEX) {
+            _crcChecked = true;
+            if (checksMessageCrc(_crcPolicy)) {
+               _messageCrc.calc(pData + _crcPos, _pos - _crcPos);
+               _crcPos = _pos;
+               _crcOk = ((uint16_t)element.getInt() == _messageCrc.getCrc());
+               ++_stagedCrcChecks;
+               _stagedCrcErrors += _crcOk ? 0U : 1U;
+            }
+            else {
+               _crcOk = true;
+               ++_stagedCrcSkipped;
+            }
+         }
+      }
+      else if (_depth == BODY_DEPTH) {
+         // Message body: messageType, content
+         if (index == BODY_TYPE_INDEX) {
+            _messageType = (uint16_t)element.getInt();
+         }
+      }
+      else if ((_depth == ENTRY_DEPTH) && (_messageType == SML_GET_LIST_RES) &&
+               (_index[CONTENT_DEPTH - 1] == LIST_VAL_LIST_INDEX)) {
+         // SML_LIST_ENTRY: objName, status, valTime, unit, scaler, value, valueSignature
+         switch (index) {
+         case ENTRY_OBIS_INDEX:
+            _pEntry = (element.getDataLength() == SmlObisTable::OBIS_LENGTH) ? SmlObisTable::find(element.getData()) : NULL;
+            break;
+         case ENTRY_SCALER_INDEX:
+            _scale = (int8_t)element.getInt();
+            break;
+         case ENTRY_VALUE_INDEX:
+            stageValue(element);
+            break;
+         }
+      }
+   }
+
+   /**
+    * @brief Stage the value of the current list entry.
+    */
+   void stageValue(const SmlCursor &element) {
+      int64_t value = element.getInt();
+      if ((_pEntry == NULL) || !scaleValue(*_pEntry, _scale, value)) {
+         return;
+      }
+      if (_stagedCount >= MAX_STAGED_VALUES) {
+         _error = true;
+         return;
+      }
+      _staged[_stagedCount].slot = _pEntry->slot;
+      _staged[_stagedCount].value = value;
+      ++_stagedCount;
+   }
+
+   /**
+    * @brief Start a new message.
+    */
+   void startMessage() {
+      _crcPos = _pos;
+      _crcChecked = false;
+      _crcOk = false;
+      _messageType = 0U;
+      _contentStart = -1;
+      _firstStaged = _stagedCount;
+      _messageCrc.init();
+   }
+
+   /**
+    * @brief Update the status of the frame after a message is complete.
+    */
+   void endMessage() {
+      _endPos = _pos;
+      bool crcOk = _crcChecked && _crcOk;
+      uint16_t type = crcOk ? _messageType : 0U;
+      if (_stagedInfo.messageCount < SmlFrameInfo::MAX_MESSAGES) {
+         _stagedInfo.messages[_stagedInfo.messageCount].type = type;
+         _stagedInfo.messages[_stagedInfo.messageCount].crcOk = crcOk;
+      }
+      ++_stagedInfo.messageCount;
+      if (!crcOk) {
+         // Discard the values of the message
+         _stagedCount = _firstStaged;
+         ++_stagedInfo.crcErrors;
+         return;
+      }
+      switch (type) {
+      case SML_OPEN_RES:
+         _stagedInfo.openResponse = true;
+         addContent(type);
+         break;
+      case SML_GET_LIST_RES:
+         ++_stagedInfo.listResponses;
+         addContent(type);
+         break;
+      case SML_CLOSE_RES:
+         _stagedInfo.closeResponse = true;
+         break;
+      }
+   }
+
+   /**
+    * @brief Remember the content of the current message to read the meta data on commit.
+    */
+   void addContent(uint16_t type) {
+      if ((_contentStart >= 0) && (_contentCount < SmlFrameInfo::MAX_MESSAGES)) {
+         _contents[_contentCount].type = type;
+         _contents[_contentCount].offset = _contentStart;
+         ++_contentCount;
+      }
+   }
+
+   /**
+    * @brief Store the staged values and the frame information.
+    */
+   bool commit(const uint8_t *pPacket, int packetLength) {
+      _frameInfo = _stagedInfo;
+      // The message CRCs are only counted for packets, which were accepted by the stream reader
+      _messageCrcChecks += _stagedCrcChecks;
+      _messageCrcErrors += _stagedCrcErrors;
+      _messageCrcSkipped += _stagedCrcSkipped;
+      _packetSlots = 0U;
+      for (int i = 0; i < _contentCount; ++i) {
+         SmlCursor content(pPacket + _contents[i].offset, packetLength - _contents[i].offset, 1);
+         if (_contents[i].type == SML_OPEN_RES) {
+            parseOpenResponse(content, pPacket);
+         }
+         else {
+            parseListMetadata(content, pPacket);
+         }
+      }
+      if (_frameInfo.crcErrors > 0) {
+         ++_parseErrors;
+      }
+      if (_frameInfo.listResponses == 0) {
+         return false;
+      }
+      for (int i = 0; i < _stagedCount; ++i) {
+         storeValue((SmlValueSlot)_staged[i].slot, _staged[i].value);
+      }
+      ++_parsedOk;
+      return true;
+   }
+};
+
+#endif // SML_STREAM_PARSER_H
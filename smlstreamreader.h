@@ -1,10 +1,269 @@
 #ifndef SML_STREAM_READER_H
 #define SML_STREAM_READER_H
 
+#include <string.h>
+#include <array>
 #include "crc16ccitt.h"
 #include "util/sml_demodata.h"
 #include "smlparser.h"
 
+/**
+ * @brief A complete packet extracted from a SML stream.
+ */
+struct SmlFrame {
+   /// Payload of the packet (without escape sequences and padding)
+   const uint8_t *pData;
+   /// Length of the payload in bytes
+   int length;
+   /// CRC of the packet
+   uint16_t crc16;
+   /// Offset of the payload in the caller's buffer or -1, if the payload was copied to the buffer of the reader
+   int offset;
+   /// Number of padding bytes following the payload
+   uint8_t padding;
+};
+
+/**
+ * @brief Counters of a SML stream reader (a copy, which can be handed to other threads).
+ */
+struct SmlStreamReaderStats {
+   uint32_t parseErrors;
+   uint32_t discardedBytes;
+   uint32_t resyncCount;
+   uint32_t longestGap;
+};
+
+/**
+ * @brief Types shared by all variants of the SML stream reader.
+ */
+class SmlStreamReaderBase {
+public:
+   /// Modes to calculate the CRC of a packet
+   enum CrcMode {
+      /// Update the CRC with every received byte
+      CRC_PER_BYTE,
+      /// Calculate the CRC once per packet from the packet buffer (escape sequences are re-inserted)
+      CRC_PER_FRAME
+   };
+};
+
+/**
+ * @brief Packet buffer allocated on the heap. The size is set at runtime.
+ */
+class SmlHeapBuffer {
+public:
+   explicit SmlHeapBuffer(int size) : _size(size) {
+      _pData = new uint8_t[_size];
+   }
+
+   ~SmlHeapBuffer() {
+      delete[] _pData;
+   }
+
+   inline uint8_t *data() { return _pData; }
+   inline const uint8_t *data() const { return _pData; }
+   inline int size() const { return _size; }
+
+private:
+   SmlHeapBuffer(const SmlHeapBuffer &);
+   SmlHeapBuffer &operator=(const SmlHeapBuffer &);
+
+   uint8_t *_pData;
+   int _size;
+};
+
+/**
+ * @brief Packet buffer stored inline in the reader. The size is set at compile time.
+ */
+template <int SIZE>
+class SmlArrayBuffer {
+public:
+   inline uint8_t *data() { return _data.data(); }
+   inline const uint8_t *data() const { return _data.data(); }
+   static constexpr int size() { return SIZE; }
+
+private:
+   std::array<uint8_t, SIZE> _data;
+};
+
+/**
+ * @brief Reader settings, which are set at runtime (used by SmlStreamReader).
+ */
+class SmlRuntimePolicy {
+public:
+   SmlRuntimePolicy(bool checkCrcErrors, SmlStreamReaderBase::CrcMode crcMode, bool resync) :
+      _checkCrcErrors(checkCrcErrors),
+      _crcMode(crcMode),
+      _resync(resync)
+   {
+   }
+
+   inline bool checkCrcErrors() const { return _checkCrcErrors; }
+   inline SmlStreamReaderBase::CrcMode crcMode() const { return _crcMode; }
+   inline bool resync() const { return _resync; }
+   static constexpr bool stripPadding() { return true; }
+   static constexpr bool statistics() { return true; }
+
+private:
+   bool _checkCrcErrors;
+   SmlStreamReaderBase::CrcMode _crcMode;
+   bool _resync;
+};
+
+/**
+ * @brief Reader settings, which are set at compile time (used by StaticSmlStreamReader).
+ * 
+ * All settings are constant, so the code for disabled features is removed by the compiler.
+ * @tparam CHECK_CRC Enables CRC checking.
+ * @tparam CRC_MODE Controls when the CRC is calculated.
+ * @tparam RESYNC Enables the resync mode.
+ * @tparam STRIP_PADDING Removes the padding bytes from the packet. Otherwise, they are included in the packet length.
+ * @tparam STATISTICS Enables the parse error and resync counters. Otherwise, all counters stay 0.
+ */
+template <bool CHECK_CRC = true,
+          SmlStreamReaderBase::CrcMode CRC_MODE = SmlStreamReaderBase::CRC_PER_BYTE,
+          bool RESYNC = false,
+          bool STRIP_PADDING = true,
+          bool STATISTICS = true>
+class SmlStaticPolicy {
+public:
+   static constexpr bool checkCrcErrors() { return CHECK_CRC; }
+   static constexpr SmlStreamReaderBase::CrcMode crcMode() { return CRC_MODE; }
+   static constexpr bool resync() { return RESYNC; }
+   static constexpr bool stripPadding() { return STRIP_PADDING; }
+   static constexpr bool statistics() { return STATISTICS; }
+};
+
+/**
+ * @brief Transition table for the transport layer of SML (escape sequences).
+ * 
+ * States:
+ * - DATA_0 - DATA_3: Payload, the last 0-3 bytes were 1b
+ * - ESC_0: 1b 1b 1b 1b was received, the next 4 bytes are the escape data
+ * - START_1 - START_3, ESCAPED_1 - ESCAPED_3, END_1 - END_3, UNKNOWN_1 - UNKNOWN_3: 1-3 bytes of the escape data
+ *   were received, which are the beginning of 01 01 01 01, 1b 1b 1b 1b, 1a xx xx xx or any other sequence.
+ * - RESYNC: Search for the next start sequence (resync mode only)
+ * 
+ * A transition contains the next state (bits 0-4) and the action to execute (bits 5-7).
+ * The table is generated on startup.
+ */
+class SmlTransportDfa {
+public:
+   enum State {
+      DATA_0 = 0,
+      DATA_3 = 3,
+      ESC_0 = 4,
+      START_1 = 5,
+      ESCAPED_1 = 8,
+      END_1 = 11,
+      UNKNOWN_1 = 14,
+      RESYNC = 17,
+      STATE_COUNT = 18
+   };
+
+   enum Action {
+      /// Add the byte to the payload
+      ACTION_STORE = 0,
+      /// Add the byte to the payload, it completes 1b 1b 1b 1b
+      ACTION_ESC_BEGIN,
+      /// Add the byte to the escape data
+      ACTION_ESC_DATA,
+      /// The escape data is complete: 01 01 01 01
+      ACTION_START,
+      /// The escape data is complete: 1b 1b 1b 1b
+      ACTION_ESCAPED,
+      /// The escape data is complete: 1a xx xx xx
+      ACTION_END,
+      /// The escape data is complete: any other sequence
+      ACTION_UNKNOWN,
+      /// Search for a start sequence
+      ACTION_RESYNC
+   };
+
+   /**
+    * @brief Returns the transition for the given state and byte.
+    */
+   static inline uint8_t next(uint8_t state, uint8_t currentByte) {
+      return _table.transitions[state][_table.byteClass[currentByte]];
+   }
+
+   /**
+    * @brief Returns true, if the transition only adds the byte to the payload.
+    */
+   static inline bool isStore(uint8_t transition) { return transition < (ACTION_ESC_BEGIN << ACTION_SHIFT); }
+
+   static inline uint8_t getState(uint8_t transition) { return transition & STATE_MASK; }
+   static inline uint8_t getAction(uint8_t transition) { return transition >> ACTION_SHIFT; }
+   static inline bool isData(uint8_t state) { return state <= DATA_3; }
+   static inline bool isEscape(uint8_t state) { return (state >= ESC_0) && (state < RESYNC); }
+
+private:
+   static const uint8_t STATE_MASK = 0x1f;
+   static const int ACTION_SHIFT = 5;
+
+   enum ByteClass {
+      CLASS_OTHER,
+      CLASS_VERSION1,
+      CLASS_END,
+      CLASS_ESC,
+      CLASS_COUNT
+   };
+
+   /**
+    * @brief Byte classes and transitions, generated from the rules of the transport layer.
+    */
+   struct Table {
+      uint8_t byteClass[256];
+      uint8_t transitions[STATE_COUNT][CLASS_COUNT];
+
+      Table() {
+         const uint8_t FIRST_ESCAPE_STATE[CLASS_COUNT] = { UNKNOWN_1, START_1, END_1, ESCAPED_1 };
+         memset(byteClass, CLASS_OTHER, sizeof(byteClass));
+         byteClass[0x01] = CLASS_VERSION1;
+         byteClass[0x1a] = CLASS_END;
+         byteClass[0x1b] = CLASS_ESC;
+         for (int c = 0; c < CLASS_COUNT; ++c) {
+            for (int n = 0; n < 4; ++n) {
+               transitions[DATA_0 + n][c] = (c != CLASS_ESC) ? transition(DATA_0, ACTION_STORE) :
+                                            (n < 3) ? transition(DATA_0 + n + 1, ACTION_STORE) : transition(ESC_0, ACTION_ESC_BEGIN);
+            }
+            transitions[ESC_0][c] = transition(FIRST_ESCAPE_STATE[c], ACTION_ESC_DATA);
+            transitions[RESYNC][c] = transition(RESYNC, ACTION_RESYNC);
+         }
+         for (int n = 0; n < 3; ++n) {
+            escapeData(START_1 + n, n, CLASS_VERSION1, ACTION_START);
+            escapeData(ESCAPED_1 + n, n, CLASS_ESC, ACTION_ESCAPED);
+            escapeData(END_1 + n, n, CLASS_COUNT, ACTION_END);
+            escapeData(UNKNOWN_1 + n, n, CLASS_COUNT, ACTION_UNKNOWN);
+         }
+      }
+
+      static uint8_t transition(int state, int action) {
+         return (uint8_t)(state | (action << ACTION_SHIFT));
+      }
+
+      /**
+       * @brief Set the transitions of a state, which has received n + 1 bytes of the escape data.
+       * @param expectedClass Class of the remaining bytes of the escape data or CLASS_COUNT for any class
+       */
+      void escapeData(int state, int n, int expectedClass, Action action) {
+         for (int c = 0; c < CLASS_COUNT; ++c) {
+            bool matches = (expectedClass == CLASS_COUNT) || (c == expectedClass);
+            if (n < 2) {
+               transitions[state][c] = matches ? transition(state + 1, ACTION_ESC_DATA) : transition(UNKNOWN_1 + n + 1, ACTION_ESC_DATA);
+            }
+            else {
+               transitions[state][c] = transition(DATA_0, matches ? action : ACTION_UNKNOWN);
+            }
+         }
+      }
+   };
+
+   static const Table _table;
+};
+
+const SmlTransportDfa::Table SmlTransportDfa::_table;
+
 /**
  * @brief Class to extract packets from a SML version 1 data stream.
  * 
@@ -22,55 +281,122 @@
  * 
  * Escaping:
  * - If the payload contains the escape sequence 1b 1b 1b 1b, then the escape sequence is transmitted twice (1b 1b 1b 1b becomes 1b 1b 1b 1b  1b 1b 1b 1b).
+ * 
+ * Use SmlStreamReader to set the buffer size and settings at runtime or StaticSmlStreamReader
+ * to set them at compile time.
+ * @tparam Buffer Packet buffer (SmlHeapBuffer or SmlArrayBuffer)
+ * @tparam Policy Reader settings (SmlRuntimePolicy or SmlStaticPolicy)
  */
-class SmlStreamReader {
+template <class Buffer, class Policy>
+class BasicSmlStreamReader : public SmlStreamReaderBase {
 public:
    /**
     * @brief Contruct a new stream reader
-    * @param maxPacketSize Reserved memory for a packet in bytes.
-    * @param checkCrcErrors Enables CRC checking (on by default).
+    * @param policy Reader settings
+    * @param bufferArgs Arguments for the constructor of the packet buffer
     */
-   SmlStreamReader(int maxPacketSize, bool checkCrcErrors = true) : 
-      _currentState(&SmlStreamReader::stateReadData),
-      _maxPacketSize(maxPacketSize),
-      _checkCrcErrors(checkCrcErrors),
-      _escLen(0), 
+   template <class... BufferArgs>
+   explicit BasicSmlStreamReader(const Policy &policy, BufferArgs... bufferArgs) :
+      _state(SmlTransportDfa::DATA_0),
+      _policy(policy),
       _escData(0U), 
       _parseErrors(0U),
       _packetPos(0),
       _packetLength(0),
-      _crc16Expected(0)
+      _packetNumber(0U),
+      _crcPos(0),
+      _packetOverflow(false),
+      _packetPadding(0),
+      _crc16Expected(0),
+      _buffer(bufferArgs...),
+      _zeroCopy(false),
+      _inPlace(false),
+      _pPacketStart(NULL),
+      _pInput(NULL),
+      _pInputEnd(NULL),
+      _pRing(NULL),
+      _ringSize(0),
+      _syncLen(0),
+      _gapLength(0U),
+      _discardedBytes(0U),
+      _resyncCount(0U),
+      _longestGap(0U)
    {
-      _data = new uint8_t[_maxPacketSize];
-   }
-
-   /**
-    * @brief Destructor
-    */
-   ~SmlStreamReader() {
-      delete[] _data;
+      if (_policy.resync()) {
+         startResync();
+      }
    }
 
    /**
     * @brief Returns the current packet buffer.
+    * @note Packets reported by addFrames() or addRingData() are only available through SmlFrame.
     */
-   inline const uint8_t *getData() { return _data; }
+   inline const uint8_t *getData() { return _buffer.data(); }
 
    /**
     * @brief Returns the length of the current packet buffer.
     */
    inline int getLength() { return _packetLength; }
 
+   /**
+    * @brief Returns the number of payload bytes of the current packet, which were received so far.
+    *
+    * Bytes, which may still turn out to be part of an escape sequence, are not included, so the
+    * returned part of the packet buffer doesn't change anymore while the packet is received.
+    * Used to parse a packet before it's complete (see SmlStreamParser).
+    * @note Only valid for packets received with addData().
+    */
+   inline int getPayloadLength() const {
+      return _packetPos - (SmlTransportDfa::isData(_state) ? _state - SmlTransportDfa::DATA_0 : 0);
+   }
+
+   /**
+    * @brief Returns the number of the current packet, which is incremented whenever a new packet starts.
+    */
+   inline uint32_t getPacketNumber() const { return _packetNumber; }
+
    /**
     * @brief Returns the expected CRC.
     */
    inline uint16_t getCrc16() { return _crc16Expected; }
 
+   /**
+    * @brief Returns the number of padding bytes of the current packet.
+    */
+   inline uint8_t getPadding() const { return _packetPadding; }
+
    /**
     * @brief Returns the number of parse errors.
     */
    inline uint32_t getParseErrors() const { return _parseErrors; }
 
+   /**
+    * @brief Returns the number of bytes skipped while searching for the start of a packet (resync mode only).
+    */
+   inline uint32_t getDiscardedBytes() const { return _discardedBytes; }
+
+   /**
+    * @brief Returns the number of times bytes had to be skipped to find the start of a packet (resync mode only).
+    */
+   inline uint32_t getResyncCount() const { return _resyncCount; }
+
+   /**
+    * @brief Returns the largest number of bytes skipped at once (resync mode only).
+    */
+   inline uint32_t getLongestGap() const { return _longestGap; }
+
+   /**
+    * @brief Returns a copy of all counters.
+    */
+   SmlStreamReaderStats getStats() const {
+      SmlStreamReaderStats stats;
+      stats.parseErrors = _parseErrors;
+      stats.discardedBytes = _discardedBytes;
+      stats.resyncCount = _resyncCount;
+      stats.longestGap = _longestGap;
+      return stats;
+   }
+
    /**
     * @brief Adds data from the stream to the parser.
     * @param pData Data to add
@@ -78,89 +404,516 @@ public:
     * @return The size of the complete packet or -1 if the packet is not ready.
     */
    int addData(const uint8_t *pData, int length) {
-      for (int i = 0; i < length; ++i) {
-         _crc16.calc(pData[i]);
-         if ((this->*_currentState)(pData[i])) {
-            return i + 1;
-         }
+      _zeroCopy = false;
+      if (_inPlace) {
+         copyInPlacePacket();
       }
-      return -1;
+      return readData(pData, length);
    }
 
+   /**
+    * @brief Adds a chunk of data from the stream and reports every complete packet in it.
+    * 
+    * Incomplete packets at the end of the chunk are continued with the next call.
+    * Packets which are completely contained in the chunk and don't contain escaped 1b 1b 1b 1b sequences
+    * are reported directly from the chunk without copying them.
+    * @param pData Data to add
+    * @param length Number of bytes to add
+    * @param onFrame Function with the signature void(const SmlFrame &frame), which is called for every complete packet.
+    *                The payload of the frame is only valid during the call.
+    * @return The number of complete packets.
+    */
+   template <class FrameHandler>
+   int addFrames(const uint8_t *pData, int length, FrameHandler onFrame) {
+      int frames = readFrames(pData, length, pData, onFrame);
+      // The chunk may be gone after the call, so copy the beginning of the current packet
+      if (_inPlace) {
+         copyInPlacePacket();
+      }
+      return frames;
+   }
+
+   /**
+    * @brief Set a ring buffer owned by the caller, which is read by addRingData().
+    * 
+    * The bytes of the packet in progress must not be overwritten until the packet is reported. This is the case,
+    * if the ring buffer is at least maxPacketSize bytes larger than the largest block of data written at once.
+    * @param pRing Ring buffer
+    * @param ringSize Size of the ring buffer in bytes
+    */
+   void setRingBuffer(const uint8_t *pRing, int ringSize) {
+      if (_inPlace) {
+         copyInPlacePacket();
+      }
+      _pRing = pRing;
+      _ringSize = ringSize;
+   }
+
+   /**
+    * @brief Process data, which was written to the ring buffer, and report every complete packet in it.
+    * 
+    * Packets which don't contain escaped 1b 1b 1b 1b sequences and don't wrap around the end of the ring buffer
+    * are reported directly from the ring buffer (SmlFrame::offset is the offset in the ring buffer).
+    * All other packets are copied to the buffer of the reader (SmlFrame::offset is -1).
+    * @param offset Offset of the new data in the ring buffer
+    * @param length Number of new bytes (may wrap around the end of the ring buffer)
+    * @param onFrame Function with the signature void(const SmlFrame &frame), which is called for every complete packet.
+    * @return The number of complete packets.
+    */
+   template <class FrameHandler>
+   int addRingData(int offset, int length, FrameHandler onFrame) {
+      int frames = 0;
+      while (length > 0) {
+         int segmentLength = (_ringSize - offset < length) ? _ringSize - offset : length;
+         frames += readFrames(_pRing + offset, segmentLength, _pRing, onFrame);
+         offset = (offset + segmentLength) % _ringSize;
+         length -= segmentLength;
+      }
+      return frames;
+   }
 private:
-   static const uint8_t STATE_READ_DATA = 0;
-   static const uint8_t STATE_READ_ESC = 1;
-   static const uint32_t SML_ESC = 0x1b1b1b1b;
-   static const uint32_t SML_BEGIN_VERSION1 = 0x01010101;
-   static const uint32_t SML_END = 0x1a000000;
-   static const uint32_t SML_END_MASK = 0xff000000;
+   static const int MIN_BULK_LENGTH = 8;
+   static const uint8_t SML_ESC_BYTE = 0x1b;
+   static const uint8_t SML_VERSION1_BYTE = 0x01;
+   static const int SML_START_LENGTH = 8;
    static const uint32_t SML_SPARE_MASK = 0x00ff0000;
    static const uint32_t SML_CRC_MASK = 0x0000ffff;
+   static const uint16_t SML_CRC_BEGIN_STATE = 0x91dc;
 
-   bool(SmlStreamReader::*_currentState)(uint8_t);
-   int _maxPacketSize;
-   bool _checkCrcErrors;
-   int _escLen;
+   uint8_t _state;
+   Policy _policy;
    uint32_t _escData;
    uint32_t _parseErrors;
    int _packetPos;
    int _packetLength;
+   uint32_t _packetNumber;
+   int _crcPos;
+   bool _packetOverflow;
+   uint8_t _packetPadding;
    uint16_t _crc16Expected;
-   uint8_t *_data;
+   Buffer _buffer;
    Crc16Ccitt _crc16;
 
-   void startPacket() {
-      _packetPos = 0;
-      _escLen = 0;
-      _crc16.init(0x91dc);
+   // Zero-copy handling: As long as _inPlace is set, the packet is not copied to the packet buffer,
+   // but byte n of the packet is located at _pPacketStart[n] in the caller's buffer.
+   bool _zeroCopy;
+   bool _inPlace;
+   const uint8_t *_pPacketStart;
+   const uint8_t *_pInput;
+   const uint8_t *_pInputEnd;
+   const uint8_t *_pRing;
+   int _ringSize;
+
+   // Resync mode: Number of bytes of the start sequence found so far and statistics
+   int _syncLen;
+   uint32_t _gapLength;
+   uint32_t _discardedBytes;
+   uint32_t _resyncCount;
+   uint32_t _longestGap;
+
+   /**
+    * @brief Adds data from the stream to the parser.
+    * @param pData Data to add
+    * @param length Number of bytes to add
+    * @return The number of bytes consumed up to the end of a complete packet or -1 if the packet is not ready.
+    */
+   int readData(const uint8_t *pData, int length) {
+      if (_inPlace && (pData != _pInputEnd)) {
+         // The new data doesn't continue the packet in place
+         copyInPlacePacket();
+      }
+      int i = 0;
+      while (i < length) {
+         if ((length - i >= MIN_BULK_LENGTH) && (pData[i] != SML_ESC_BYTE)) {
+            if (SmlTransportDfa::isData(_state)) {
+               i += copyPayload(pData + i, length - i);
+            }
+            else if ((_state == SmlTransportDfa::RESYNC) && (_syncLen == 0)) {
+               i += skipNoise(pData + i, length - i);
+            }
+            if (i >= length) {
+               break;
+            }
+         }
+         if (_policy.crcMode() == CRC_PER_BYTE) {
+            _crc16.calc(pData[i]);
+         }
+         _pInput = pData + i;
+         if (readByte(pData[i++])) {
+            _pInputEnd = pData + i;
+            return i;
+         }
+      }
+      _pInputEnd = pData + length;
+      return -1;
    }
 
-   bool stateReadData(uint8_t currentByte) {
-      if (_packetPos >= _maxPacketSize) {
+   /**
+    * @brief Adds data from the stream and reports every complete packet in it.
+    * @param pData Data to add
+    * @param length Number of bytes to add
+    * @param pBase Start of the caller's buffer, which is used to calculate SmlFrame::offset
+    * @param onFrame Function to call for every complete packet
+    * @return The number of complete packets.
+    */
+   template <class FrameHandler>
+   int readFrames(const uint8_t *pData, int length, const uint8_t *pBase, FrameHandler &onFrame) {
+      _zeroCopy = true;
+      int frames = 0;
+      while (length > 0) {
+         int consumed = readData(pData, length);
+         if (consumed < 0) {
+            break;
+         }
+         SmlFrame frame = { getPacketData(), _packetLength, _crc16Expected,
+                            _inPlace ? (int)(_pPacketStart - pBase) : -1, _packetPadding };
+         // Data following the packet is not part of it
+         _inPlace = false;
+         onFrame(frame);
+         ++frames;
+         pData += consumed;
+         length -= consumed;
+      }
+      return frames;
+   }
+
+   /**
+    * @brief Count a parse error (if statistics are enabled).
+    */
+   inline void countParseError() {
+      if (_policy.statistics()) {
          ++_parseErrors;
-         startPacket();
       }
-      _data[_packetPos++] = currentByte;
-      if (currentByte == 0x1b) {
-         if (++_escLen == 4) {
-            _packetPos -= 4;
-            _currentState = &SmlStreamReader::stateReadEsc;
-            _crc16Expected = _crc16.getCrcState();
+   }
+
+   /**
+    * @brief Returns the data of the current packet.
+    */
+   inline const uint8_t *getPacketData() const {
+      return _inPlace ? _pPacketStart : _buffer.data();
+   }
+
+   /**
+    * @brief Copy the part of the current packet, which is located in the caller's buffer, to the packet buffer.
+    * @param length Number of bytes to copy
+    */
+   void copyInPlacePacket(int length) {
+      memcpy(_buffer.data(), _pPacketStart, length);
+      _inPlace = false;
+   }
+
+   /**
+    * @brief Copy the current packet including a pending escape sequence to the packet buffer.
+    */
+   void copyInPlacePacket() {
+      copyInPlacePacket(_packetPos + (SmlTransportDfa::isEscape(_state) ? 4 : 0));
+   }
+
+   /**
+    * @brief Start a new packet
+    * @param pPacketStart Location of the first byte of the packet in the caller's buffer
+    */
+   void startPacket(const uint8_t *pPacketStart) {
+      _inPlace = _zeroCopy;
+      _pPacketStart = pPacketStart;
+      _packetPos = 0;
+      ++_packetNumber;
+      _state = SmlTransportDfa::DATA_0;
+      _crcPos = 0;
+      _packetOverflow = false;
+      _crc16.init(SML_CRC_BEGIN_STATE);
+   }
+
+   /**
+    * @brief Bring the CRC up to date with the payload received so far (CRC_PER_FRAME only).
+    * 
+    * The packet buffer contains escaped 1b 1b 1b 1b sequences only once, so every fourth
+    * escape byte of a run is followed by the escape sequence which was received on the wire.
+    */
+   void calcPayloadCrc() {
+      const uint8_t *pPos = getPacketData() + _crcPos;
+      const uint8_t *pEnd = getPacketData() + _packetPos;
+      while (pPos < pEnd) {
+         const uint8_t *pEsc = (const uint8_t *)memchr(pPos, SML_ESC_BYTE, pEnd - pPos);
+         if (pEsc == NULL) {
+            pEsc = pEnd;
+         }
+         _crc16.calc(pPos, (int)(pEsc - pPos));
+         int escBytes = 0;
+         for (pPos = pEsc; (pPos < pEnd) && (*pPos == SML_ESC_BYTE); ++pPos) {
+            ++escBytes;
+         }
+         escBytes += escBytes & ~3;
+         while (escBytes-- > 0) {
+            _crc16.calc(SML_ESC_BYTE);
+         }
+      }
+      _crcPos = _packetPos;
+   }
+
+   /**
+    * @brief Add the escape sequence and the given escape data to the CRC (CRC_PER_FRAME only).
+    */
+   void calcEscapeCrc(uint32_t escData) {
+      calcPayloadCrc();
+      for (int i = 0; i < 4; ++i) {
+         _crc16.calc(SML_ESC_BYTE);
+      }
+      for (int shift = 24; shift >= 0; shift -= 8) {
+         _crc16.calc((uint8_t)(escData >> shift));
+      }
+   }
+
+   /**
+    * @brief Copy plain payload up to the next escape candidate (0x1b) in one go.
+    * 
+    * Only used in the data states. The span is limited to the free space in the packet buffer,
+    * so a packet overflow is still handled byte by byte by readByte().
+    * @param pData Data to add
+    * @param length Number of bytes available
+    * @return Number of bytes consumed
+    */
+   int copyPayload(const uint8_t *pData, int length) {
+      int spanLength = _buffer.size() - _packetPos;
+      if (spanLength > length) {
+         spanLength = length;
+      }
+      const uint8_t *pEsc = (const uint8_t *)memchr(pData, SML_ESC_BYTE, spanLength);
+      if (pEsc != NULL) {
+         spanLength = (int)(pEsc - pData);
+      }
+      if (spanLength > 0) {
+         if (!_inPlace) {
+            memcpy(_buffer.data() + _packetPos, pData, spanLength);
+         }
+         if (_policy.crcMode() == CRC_PER_BYTE) {
+            _crc16.calc(pData, spanLength);
+         }
+         _packetPos += spanLength;
+         _state = SmlTransportDfa::DATA_0;
+      }
+      return spanLength;
+   }
+
+   /**
+    * @brief Skip all bytes up to the next candidate for a start sequence (0x1b) in one go.
+    * 
+    * Only used in resync mode while no part of the start sequence was found.
+    * @param pData Data to skip
+    * @param length Number of bytes available
+    * @return Number of bytes skipped
+    */
+   int skipNoise(const uint8_t *pData, int length) {
+      const uint8_t *pEsc = (const uint8_t *)memchr(pData, SML_ESC_BYTE, length);
+      int skipped = (pEsc != NULL) ? (int)(pEsc - pData) : length;
+      if (_policy.statistics()) {
+         _gapLength += skipped;
+      }
+      return skipped;
+   }
+
+   /**
+    * @brief Start searching for the next start sequence (resync mode only).
+    */
+   void startResync() {
+      _state = SmlTransportDfa::RESYNC;
+      _syncLen = 0;
+      _gapLength = 0U;
+   }
+
+   /**
+    * @brief Search for the start sequence 1b 1b 1b 1b 01 01 01 01 without buffering the data.
+    */
+   bool stateResync(uint8_t currentByte) {
+      if (_policy.statistics()) {
+         ++_gapLength;
+      }
+      if (currentByte == SML_ESC_BYTE) {
+         // Keep the last four escape bytes of a longer run
+         _syncLen = (_syncLen < 4) ? _syncLen + 1 : ((_syncLen == 4) ? 4 : 1);
+      }
+      else if ((currentByte == SML_VERSION1_BYTE) && (_syncLen >= 4)) {
+         if (++_syncLen == SML_START_LENGTH) {
+            uint32_t gap = _gapLength - SML_START_LENGTH;
+            if (_policy.statistics() && (gap > 0)) {
+               ++_resyncCount;
+               _discardedBytes += gap;
+               _longestGap = (gap > _longestGap) ? gap : _longestGap;
+            }
+            startPacket(_pInput + 1);
          }
       }
       else {
-         _escLen = 0;
+         _syncLen = 0;
       }
       return false;
    }
 
-   bool stateReadEsc(uint8_t currentByte) {
+   /**
+    * @brief Process a single byte with the transition table.
+    * 
+    * Payload bytes and escape data only need a table lookup and a store, everything else is handled by executeAction().
+    * @return True, if a complete packet was received.
+    */
+   inline bool readByte(uint8_t currentByte) {
+      uint8_t transition = SmlTransportDfa::next(_state, currentByte);
+      if (SmlTransportDfa::isStore(transition) && (_packetPos < _buffer.size())) {
+         if (!_inPlace) {
+            _buffer.data()[_packetPos] = currentByte;
+         }
+         ++_packetPos;
+         _state = transition;
+         return false;
+      }
+      if (SmlTransportDfa::getAction(transition) == SmlTransportDfa::ACTION_ESC_DATA) {
+         _escData = (_escData << 8) | currentByte;
+         _state = SmlTransportDfa::getState(transition);
+         return false;
+      }
+      return executeAction(transition, currentByte);
+   }
+
+   /**
+    * @brief Execute the action of a transition.
+    * @return True, if a complete packet was received.
+    */
+   bool executeAction(uint8_t transition, uint8_t currentByte) {
+      uint8_t action = SmlTransportDfa::getAction(transition);
+      if ((action <= SmlTransportDfa::ACTION_ESC_BEGIN) && (_packetPos >= _buffer.size())) {
+         countParseError();
+         if (_policy.resync()) {
+            _inPlace = false;
+            startResync();
+            return stateResync(currentByte);
+         }
+         startPacket(_pInput);
+         _packetOverflow = true;
+         transition = SmlTransportDfa::next(_state, currentByte);
+         action = SmlTransportDfa::getAction(transition);
+      }
+      _state = SmlTransportDfa::getState(transition);
+
+      switch (action) {
+      case SmlTransportDfa::ACTION_STORE:
+      case SmlTransportDfa::ACTION_ESC_BEGIN:
+         if (!_inPlace) {
+            _buffer.data()[_packetPos] = currentByte;
+         }
+         ++_packetPos;
+         if (action == SmlTransportDfa::ACTION_ESC_BEGIN) {
+            _packetPos -= 4;
+            _crc16Expected = _crc16.getCrcState();
+         }
+         return false;
+      case SmlTransportDfa::ACTION_RESYNC:
+         return stateResync(currentByte);
+      default:
+         break;
+      }
+
       _escData = (_escData << 8) | currentByte;
-      if (--_escLen <= 0) {
-         _currentState = &SmlStreamReader::stateReadData;
-         if (_escData == SML_BEGIN_VERSION1) {
-            startPacket();
-         }
-         if (_escData == SML_ESC) {
-            _packetPos += 4;
-         }
-         if ((_escData & SML_END_MASK) == SML_END) {
-            int spareBytes = ((_escData & SML_SPARE_MASK) >> 16);
-            _packetLength = _packetPos - spareBytes;
-            _crc16.init(_crc16Expected);
-            _crc16.calc(0x1a);
-            _crc16.calc(spareBytes);
-            _crc16Expected = _escData & SML_CRC_MASK;
-            if (_checkCrcErrors && (_crc16Expected != _crc16.getCrc())) {
-               //printf("Reader: Warning %04x != %04x\n", _crc16Expected, crc16.getCrc());
-               ++_parseErrors;
-               return false;
-            }
-            return true;
+      switch (action) {
+      case SmlTransportDfa::ACTION_START:
+         startPacket(_pInput + 1);
+         break;
+      case SmlTransportDfa::ACTION_ESCAPED:
+         if (_inPlace) {
+            // The escape sequence was received twice, so the packet can't be used in place
+            copyInPlacePacket(_packetPos + 4);
+         }
+         _packetPos += 4;
+         break;
+      case SmlTransportDfa::ACTION_END:
+         return endPacket();
+      case SmlTransportDfa::ACTION_UNKNOWN:
+         // Unknown escape sequences are dropped from the packet, but they are part of the CRC
+         if ((_policy.crcMode() == CRC_PER_FRAME) && _policy.checkCrcErrors()) {
+            calcEscapeCrc(_escData);
          }
+         if (_inPlace) {
+            copyInPlacePacket(_packetPos);
+         }
+         break;
+      default:
+         break;
       }
       return false;
    }
+
+   /**
+    * @brief Finish the current packet after the end sequence was received.
+    * @return True, if the packet is valid.
+    */
+   bool endPacket() {
+      if (_policy.resync()) {
+         // Skip everything up to the next packet, regardless whether this one is valid
+         startResync();
+      }
+      int spareBytes = ((_escData & SML_SPARE_MASK) >> 16);
+      _packetLength = _policy.stripPadding() ? _packetPos - spareBytes : _packetPos;
+      _packetPadding = (uint8_t)spareBytes;
+      if (_policy.crcMode() == CRC_PER_BYTE) {
+         _crc16.init(_crc16Expected);
+      }
+      else if (_policy.checkCrcErrors()) {
+         if (_packetOverflow) {
+            // The beginning of the packet is lost, so the CRC can't match
+            countParseError();
+            _inPlace = false;
+            return false;
+         }
+         calcPayloadCrc();
+         for (int i = 0; i < 4; ++i) {
+            _crc16.calc(SML_ESC_BYTE);
+         }
+      }
+      _crc16.calc(0x1a);
+      _crc16.calc(spareBytes);
+      _crc16Expected = _escData & SML_CRC_MASK;
+      if (_policy.checkCrcErrors() && (_crc16Expected != _crc16.getCrc())) {
+         //printf("Reader: Warning %04x != %04x\n", _crc16Expected, crc16.getCrc());
+         countParseError();
+         _inPlace = false;
+         return false;
+      }
+      return true;
+   }
+};
+
+/**
+ * @brief SML stream reader with a packet buffer on the heap and settings, which are set at runtime.
+ */
+class SmlStreamReader : public BasicSmlStreamReader<SmlHeapBuffer, SmlRuntimePolicy> {
+public:
+   /**
+    * @brief Contruct a new stream reader
+    * @param maxPacketSize Reserved memory for a packet in bytes.
+    * @param checkCrcErrors Enables CRC checking (on by default).
+    * @param crcMode Controls when the CRC is calculated (per byte by default).
+    * @param resync Enables the resync mode (off by default). In this mode, all data outside of packets
+    *               (e.g. line noise or the rest of a packet after an error) is skipped without buffering it
+    *               until the next start sequence is found.
+    */
+   SmlStreamReader(int maxPacketSize, bool checkCrcErrors = true, CrcMode crcMode = CRC_PER_BYTE, bool resync = false) :
+      BasicSmlStreamReader<SmlHeapBuffer, SmlRuntimePolicy>(SmlRuntimePolicy(checkCrcErrors, crcMode, resync), maxPacketSize)
+   {
+   }
+};
+
+/**
+ * @brief SML stream reader with an inline packet buffer and settings, which are set at compile time.
+ * 
+ * The reader doesn't use the heap and the code for disabled features is removed by the compiler.
+ * @tparam MAX_PACKET_SIZE Reserved memory for a packet in bytes.
+ * @tparam Policy Reader settings, see SmlStaticPolicy.
+ */
+template <int MAX_PACKET_SIZE, class Policy = SmlStaticPolicy<> >
+class StaticSmlStreamReader : public BasicSmlStreamReader<SmlArrayBuffer<MAX_PACKET_SIZE>, Policy> {
+public:
+   StaticSmlStreamReader() :
+      BasicSmlStreamReader<SmlArrayBuffer<MAX_PACKET_SIZE>, Policy>(Policy())
+   {
+   }
 };
 
 #endif // SML_STREAM_READER_H
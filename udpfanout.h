@@ -0,0 +1,320 @@
+#ifndef UDPFANOUT_H
+#define UDPFANOUT_H
+
+#include <stdint.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUDP.h>
+
+#if defined(__linux__)
+#  include <errno.h>
+#  include <string.h>
+#  include <unistd.h>
+#  include <sys/socket.h>
+#  include <netinet/in.h>
+#endif
+
+/**
+ * @brief Data, which is sent to a group of destinations.
+ */
+struct UdpPayload {
+   const uint8_t *pData;
+   int length;
+};
+
+/**
+ * @brief Entry of the destination table with its counters.
+ */
+struct UdpDestination {
+   IPAddress address;
+   uint16_t port;
+   /// Index of the payload, which is sent to this destination
+   uint8_t payload;
+   bool multicast;
+   /// Number of packets, which were sent successfully
+   uint32_t packets;
+   /// Number of packets, which couldn't be sent
+   uint32_t errors;
+   /// Number of attempts, which were rejected, because the send buffer was full (EAGAIN)
+   uint32_t wouldBlock;
+   /// Number of queued packets, which were replaced by a newer packet before they could be sent
+   uint32_t drops;
+   /// True, if a packet is queued for this destination
+   bool pending;
+   /// Time until the packet was handed over to the network stack in us (last packet and maximum)
+   uint32_t lastLatencyUs;
+   uint32_t maxLatencyUs;
+#if defined(__linux__)
+   /// Cached socket address
+   struct sockaddr_in socketAddress;
+#endif
+};
+
+/**
+ * @brief Send the same payloads to a table of destinations.
+ *
+ * On Linux, all packets are sent with a single sendmmsg() call. The socket addresses are cached in the
+ * destination table and the payloads are referenced, not copied. On all other platforms (e.g. ESP8266),
+ * the packets are sent one after the other with WiFiUDP.
+ *
+ * Sending never blocks. On Linux, a packet, which is rejected because the send buffer is full, is copied
+ * to a queue with one entry per destination and sent again by flush(). A newer packet for the same
+ * destination replaces the queued one (drop-oldest), so only the latest reading is sent late.
+ *
+ * Example:
+ *    udpFanout.add(address, 9522, PAYLOAD_EMETER);
+ *    UdpPayload payloads[] = { { emeterData, emeterLength }, { smlData, smlLength } };
+ *    udpFanout.send(udp, payloads, 2);
+ */
+class UdpFanout {
+public:
+   static const int MAX_DESTINATIONS = 32;
+
+   UdpFanout() : _count(0), _batches(0U), _pendingCount(0), _socket(-1) {}
+
+   ~UdpFanout() {
+#if defined(__linux__)
+      if (_socket >= 0) {
+         close(_socket);
+      }
+#endif
+   }
+
+   /**
+    * @brief Remove all destinations.
+    */
+   void clear() {
+      _count = 0;
+   }
+
+   /**
+    * @brief Add a destination.
+    * @param address    IP address
+    * @param port       UDP port (destinations with port 0 are ignored)
+    * @param payload    Index of the payload for this destination
+    * @param multicast  True, if the address is a multicast address
+    * @return false, if the table is full or the port is 0
+    */
+   bool add(const IPAddress &address, uint16_t port, uint8_t payload, bool multicast = false) {
+      if ((_count >= MAX_DESTINATIONS) || (port == 0)) {
+         return false;
+      }
+      UdpDestination &destination = _destinations[_count++];
+      destination.address = address;
+      destination.port = port;
+      destination.payload = payload;
+      destination.multicast = multicast;
+      destination.packets = 0U;
+      destination.errors = 0U;
+      destination.wouldBlock = 0U;
+      destination.drops = 0U;
+      destination.pending = false;
+      destination.lastLatencyUs = 0U;
+      destination.maxLatencyUs = 0U;
+#if defined(__linux__)
+      destination.socketAddress = IPAddress(address).getAddress();
+      destination.socketAddress.sin_family = AF_INET;
+      destination.socketAddress.sin_port = htons(port);
+#endif
+      return true;
+   }
+
+   /// Number of destinations
+   inline int getCount() const { return _count; }
+
+   /// Destination with its counters
+   inline const UdpDestination &getDestination(int i) const { return _destinations[i]; }
+
+   /// Number of calls of send()
+   inline uint32_t getBatches() const { return _batches; }
+
+   /// Number of queued packets
+   inline int getPendingCount() const { return _pendingCount; }
+
+   /**
+    * @brief Send the payloads to all destinations.
+    * @param udp           UDP instance (not used on Linux)
+    * @param pPayloads     Payloads, which are referenced by the destinations
+    * @param payloadCount  Number of payloads
+    * @return Number of packets, which were sent successfully
+    */
+   int send(WiFiUDP &udp, const UdpPayload *pPayloads, int payloadCount) {
+      ++_batches;
+#if defined(__linux__)
+      // The new packets replace all queued packets
+      for (int i = 0; i < _count; ++i) {
+         if (_destinations[i].pending) {
+            _destinations[i].pending = false;
+            ++_destinations[i].drops;
+         }
+      }
+      _pendingCount = 0;
+      int sent = sendBatch(pPayloads, payloadCount, false);
+      if (_pendingCount > 0) {
+         queuePayloads(pPayloads, payloadCount);
+      }
+      return sent;
+#else
+      int sent = 0;
+      for (int i = 0; i < _count; ++i) {
+         UdpDestination &destination = _destinations[i];
+         if ((destination.payload >= payloadCount) || (pPayloads[destination.payload].length <= 0)) {
+            continue;
+         }
+         const UdpPayload &payload = pPayloads[destination.payload];
+         unsigned long start = micros();
+         bool ok;
+         if (destination.multicast) {
+            ok = udp.beginPacketMulticast(destination.address, destination.port, WiFi.localIP(), 1) != 0;
+         }
+         else {
+            ok = udp.beginPacket(destination.address, destination.port) != 0;
+         }
+         ok = ok && (udp.write(payload.pData, payload.length) > 0);
+         ok = (udp.endPacket() != 0) && ok;
+         updateCounters(destination, ok, micros() - start);
+         sent += ok ? 1 : 0;
+      }
+      return sent;
+#endif
+   }
+
+   /**
+    * @brief Try to send the queued packets (call it regularly, e.g. while waiting for data).
+    * @return Number of packets, which were sent successfully
+    */
+   int flush() {
+#if defined(__linux__)
+      if (_pendingCount == 0) {
+         return 0;
+      }
+      UdpPayload payloads[MAX_PAYLOADS];
+      for (int i = 0; i < MAX_PAYLOADS; ++i) {
+         payloads[i].pData = _queued[i];
+         payloads[i].length = _queuedLengths[i];
+      }
+      _pendingCount = 0;
+      return sendBatch(payloads, MAX_PAYLOADS, true);
+#else
+      return 0;
+#endif
+   }
+
+private:
+   UdpDestination _destinations[MAX_DESTINATIONS];
+   int _count;
+   uint32_t _batches;
+   int _pendingCount;
+   int _socket;
+
+#if defined(__linux__)
+   static const int MAX_PAYLOADS = 4;
+   static const int MAX_PAYLOAD_LENGTH = 1500;
+
+   struct mmsghdr _messages[MAX_DESTINATIONS];
+   struct iovec _buffers[MAX_DESTINATIONS];
+   int _messageDestinations[MAX_DESTINATIONS];
+
+   // Copies of the payloads of the queued packets
+   uint8_t _queued[MAX_PAYLOADS][MAX_PAYLOAD_LENGTH];
+   int _queuedLengths[MAX_PAYLOADS];
+
+   /**
+    * @brief Send the packets to all destinations (or all destinations with a queued packet) with sendmmsg().
+    *
+    * Packets, which are rejected with EAGAIN, are marked as pending.
+    */
+   int sendBatch(const UdpPayload *pPayloads, int payloadCount, bool pendingOnly) {
+      if ((_socket < 0) && ((_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)) {
+         return 0;
+      }
+      int messageCount = 0;
+      for (int i = 0; i < _count; ++i) {
+         UdpDestination &destination = _destinations[i];
+         bool selected = !pendingOnly || destination.pending;
+         destination.pending = false;
+         if (!selected) {
+            continue;
+         }
+         if ((destination.payload >= payloadCount) || (pPayloads[destination.payload].length <= 0)) {
+            // A queued packet, whose payload couldn't be copied, is lost
+            destination.drops += pendingOnly ? 1U : 0U;
+            continue;
+         }
+         _buffers[messageCount].iov_base = (void *)pPayloads[destination.payload].pData;
+         _buffers[messageCount].iov_len = pPayloads[destination.payload].length;
+         struct msghdr &header = _messages[messageCount].msg_hdr;
+         memset(&header, 0, sizeof(header));
+         header.msg_name = &destination.socketAddress;
+         header.msg_namelen = sizeof(destination.socketAddress);
+         header.msg_iov = &_buffers[messageCount];
+         header.msg_iovlen = 1;
+         _messageDestinations[messageCount++] = i;
+      }
+
+      // A packet, which can't be sent, stops sendmmsg(): the next call returns its error
+      int sent = 0;
+      int pos = 0;
+      unsigned long start = micros();
+      while (pos < messageCount) {
+         int result = sendmmsg(_socket, _messages + pos, messageCount - pos, MSG_DONTWAIT);
+         unsigned long latency = micros() - start;
+         if (result > 0) {
+            for (int end = pos + result; pos < end; ++pos) {
+               updateCounters(_destinations[_messageDestinations[pos]], true, latency);
+            }
+            sent += result;
+            continue;
+         }
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            // The send buffer is full, so all remaining packets are queued
+            for (; pos < messageCount; ++pos) {
+               UdpDestination &destination = _destinations[_messageDestinations[pos]];
+               ++destination.wouldBlock;
+               destination.pending = true;
+               ++_pendingCount;
+            }
+            break;
+         }
+         updateCounters(_destinations[_messageDestinations[pos++]], false, latency);
+      }
+      return sent;
+   }
+
+   /**
+    * @brief Copy the payloads of the pending packets to the queue.
+    */
+   void queuePayloads(const UdpPayload *pPayloads, int payloadCount) {
+      bool needed[MAX_PAYLOADS] = {};
+      for (int i = 0; i < _count; ++i) {
+         if (_destinations[i].pending && (_destinations[i].payload < MAX_PAYLOADS)) {
+            needed[_destinations[i].payload] = true;
+         }
+      }
+      for (int i = 0; i < MAX_PAYLOADS; ++i) {
+         bool copied = needed[i] && (i < payloadCount) && (pPayloads[i].length <= MAX_PAYLOAD_LENGTH);
+         if (copied) {
+            memcpy(_queued[i], pPayloads[i].pData, pPayloads[i].length);
+         }
+         _queuedLengths[i] = copied ? pPayloads[i].length : 0;
+      }
+   }
+#endif
+
+   /**
+    * @brief Update the counters of a destination.
+    */
+   static void updateCounters(UdpDestination &destination, bool ok, unsigned long latencyUs) {
+      if (ok) {
+         ++destination.packets;
+      }
+      else {
+         ++destination.errors;
+      }
+      destination.lastLatencyUs = (uint32_t)latencyUs;
+      if (destination.lastLatencyUs > destination.maxLatencyUs) {
+         destination.maxLatencyUs = destination.lastLatencyUs;
+      }
+   }
+};
+
+#endif // UDPFANOUT_H
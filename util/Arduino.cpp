@@ -13,6 +13,8 @@
 #  include <sys/ioctl.h>
 #  include <sys/types.h>
 #  include <termios.h>
+#  include <poll.h>
+#  include <errno.h>
 #endif
 
 #ifdef __MACH__
@@ -45,6 +47,27 @@ unsigned long millis() {
 #endif
 }
 
+unsigned long micros() {
+#if _WIN32
+   LARGE_INTEGER counter;
+   LARGE_INTEGER frequency;
+   QueryPerformanceCounter(&counter);
+   QueryPerformanceFrequency(&frequency);
+   return (unsigned long)(counter.QuadPart * 1000000ULL / frequency.QuadPart);
+#elif __MACH__
+   clock_serv_t cclock;
+   mach_timespec_t mts;
+   host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
+   clock_get_time(cclock, &mts);
+   mach_port_deallocate(mach_task_self(), cclock);
+   return (mts.tv_sec * 1000000UL) + (mts.tv_nsec / 1000UL);
+#else
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return (tv.tv_sec * 1000000UL) + (tv.tv_nsec / 1000UL);
+#endif
+}
+
 void digitalWrite(byte gpio, byte value) {}
 
 byte digitalRead(byte gpio) {
@@ -74,28 +97,139 @@ SerialImpl::~SerialImpl()
 }
 
 bool SerialImpl::available() {
-   int bytesAvailable = 0;
    if (_fd < 0) {
       delay(1);
-      bytesAvailable = 1;
-      return (bytesAvailable > 0);
+      return true;
    }
+   return (_bufferedBytes > 0) || (fillBuffer() > 0);
+}
+
+bool SerialImpl::waitAvailable(unsigned long timeoutMs) {
+   if ((_fd < 0) || available()) {
+      // Test data is always available
+      return true;
+   }
+#ifdef _WIN32
+   delay(timeoutMs);
+   return available();
+#else
+   struct pollfd pollFd;
+   pollFd.fd = _fd;
+   pollFd.events = POLLIN;
+   pollFd.revents = 0;
+   unsigned long start = millis();
+   int result = poll(&pollFd, 1, (int)timeoutMs);
+   if ((result > 0) && ((pollFd.revents & POLLIN) != 0) && available()) {
+      return true;
+   }
+   // A hangup (e.g. a pipe without writer), an error or the end of a file are reported at once:
+   // wait for the rest of the timeout, so the caller doesn't spin
+   _endOfData = (result > 0);
+   unsigned long elapsed = millis() - start;
+   if ((result != 0) && (elapsed < timeoutMs)) {
+      delay(timeoutMs - elapsed);
+   }
+   return false;
+#endif
+}
+
+int openSerialDevice(const char *pFileName, int baud) {
 #ifndef _WIN32
-   ioctl(_fd, FIONREAD, &bytesAvailable);
+   int fd = open(pFileName, O_RDWR | O_NOCTTY | O_NONBLOCK);
+   if (fd < 0) {
+      return -1;
+   }
+   // Raw mode with the given baud rate (only for terminals, files and pipes are used as they are)
+   struct termios options;
+   if (tcgetattr(fd, &options) == 0) {
+      speed_t speed = B9600;
+      switch (baud) {
+      case 1200: speed = B1200; break;
+      case 2400: speed = B2400; break;
+      case 4800: speed = B4800; break;
+      case 19200: speed = B19200; break;
+      case 38400: speed = B38400; break;
+      case 57600: speed = B57600; break;
+      case 115200: speed = B115200; break;
+      default: break;
+      }
+      cfmakeraw(&options);
+      cfsetispeed(&options, speed);
+      cfsetospeed(&options, speed);
+      options.c_cflag |= CLOCAL | CREAD;
+      // Reads return immediately (the file descriptor is non-blocking, poll() is used to wait)
+      options.c_cc[VMIN] = 0;
+      options.c_cc[VTIME] = 0;
+      tcsetattr(fd, TCSANOW, &options);
+   }
+   return fd;
+#else
+   return -1;
 #endif
-   return (bytesAvailable > 0);
 }
 
 void SerialImpl::begin(int baud) {
 #ifndef _WIN32
    if (_pFileName != NULL) {
-      _fd = open(_pFileName, O_RDWR | O_NOCTTY | O_NDELAY);
-      // Set blocking mode
-      fcntl(_fd, F_SETFL, 0);
+      _fd = openSerialDevice(_pFileName, baud);
+      if (_fd < 0) {
+         printf("Opening %s failed with error code : %d\n", _pFileName, errno);
+         return;
+      }
+   }
+#endif
+}
+
+int SerialImpl::fillBuffer() {
+#ifndef _WIN32
+   // Read into the free space of the ring buffer with up to two non-blocking reads
+   int added = 0;
+   while (_bufferedBytes < BUFFER_SIZE) {
+      int writePos = (_readPos + _bufferedBytes) % BUFFER_SIZE;
+      int freeBytes = (writePos >= _readPos) ? BUFFER_SIZE - writePos : _readPos - writePos;
+      ssize_t bytesRead = ::read(_fd, (void*)(_buffer + writePos), freeBytes);
+      if (bytesRead <= 0) {
+         break;
+      }
+      _bufferedBytes += (int)bytesRead;
+      added += (int)bytesRead;
+      if (bytesRead < freeBytes) {
+         break;
+      }
    }
+   return added;
+#else
+   return 0;
 #endif
 }
 
+int SerialImpl::readAvailable(byte *pBuffer, int bufferSize) {
+   if (_fd < 0) {
+      int length = 0;
+      while (length < bufferSize) {
+         int chunkLength = SML_TEST_PACKET_LENGTH - _testDataPos;
+         chunkLength = (chunkLength < bufferSize - length) ? chunkLength : bufferSize - length;
+         memcpy(pBuffer + length, SML_TEST_PACKET + _testDataPos, chunkLength);
+         _testDataPos = (_testDataPos + chunkLength) % SML_TEST_PACKET_LENGTH;
+         length += chunkLength;
+      }
+      return length;
+   }
+   if (_bufferedBytes < bufferSize) {
+      fillBuffer();
+   }
+   int length = 0;
+   while ((_bufferedBytes > 0) && (length < bufferSize)) {
+      int chunkLength = (_readPos + _bufferedBytes <= BUFFER_SIZE) ? _bufferedBytes : BUFFER_SIZE - _readPos;
+      chunkLength = (chunkLength < bufferSize - length) ? chunkLength : bufferSize - length;
+      memcpy(pBuffer + length, _buffer + _readPos, chunkLength);
+      _readPos = (_readPos + chunkLength) % BUFFER_SIZE;
+      _bufferedBytes -= chunkLength;
+      length += chunkLength;
+   }
+   return length;
+}
+
 int SerialImpl::readBytes(byte *pBuffer, int bufferSize) {
    int length = 0;
    if (_fd < 0) {
@@ -104,21 +238,9 @@ int SerialImpl::readBytes(byte *pBuffer, int bufferSize) {
       memcpy(pBuffer, SML_TEST_PACKET, length);
       return length;
    }
-#ifndef _WIN32
-   int timeout = _timeout;
-   while ((timeout > 0) && (bufferSize > 0)) {
-      if (available()) {
-         int bytesRead = ::read(_fd, (void*)(pBuffer + length), bufferSize);
-         bufferSize -= bytesRead;
-         length += bytesRead;
-         timeout = _timeout;
-      }
-      else {
-         delay(100);
-         timeout -= 100;
-      }
+   while ((length < bufferSize) && waitAvailable(_timeout)) {
+      length += readAvailable(pBuffer + length, bufferSize - length);
    }
-#endif
    return length;
 }
 
@@ -129,16 +251,13 @@ int SerialImpl::read()
       _testDataPos = (_testDataPos + 1) % SML_TEST_PACKET_LENGTH;
       return data;
    }
-#ifndef _WIN32
-   if (available()) {
-      uint8_t data;
-      size_t bytesRead = ::read(_fd, (void*)&data, 1);
-      if (bytesRead == 1) {
-         return data;
-      }
+   if ((_bufferedBytes == 0) && (fillBuffer() == 0)) {
+      return -1;
    }
-#endif
-   return -1;
+   int data = _buffer[_readPos];
+   _readPos = (_readPos + 1) % BUFFER_SIZE;
+   --_bufferedBytes;
+   return data;
 }
 
 #ifndef _WIN32
@@ -83,6 +83,7 @@ char *itoa(int value, char * str, int base);
 // ----------------------------------------------------------------------------
 void delay(unsigned long duration);
 unsigned long millis();
+unsigned long micros();
 
 // ----------------------------------------------------------------------------
 // GPIOs
@@ -137,7 +138,12 @@ public:
    }
    operator const char*() const { return inet_ntoa(_address.sin_addr); }
    struct sockaddr_in getAddress() { return _address; }
-   bool fromString(const String &address) { return false; }
+   bool fromString(const String &address) {
+      memset((char *)&_address, 0, sizeof(_address));
+      _address.sin_family = AF_INET;
+      _address.sin_addr.s_addr = inet_addr(address.c_str());
+      return (_address.sin_addr.s_addr != INADDR_NONE) || (address == "255.255.255.255");
+   }
    String toString() const { return String("aaa.bbb.ccc.ddd"); }
 private:
    struct sockaddr_in _address;
@@ -153,6 +159,9 @@ public:
       _timeout = 1000;
       _fd = -1;
       _testDataPos = 0;
+      _readPos = 0;
+      _bufferedBytes = 0;
+      _endOfData = false;
    }
    ~SerialImpl();
    void print(const char* msg) {
@@ -174,19 +183,38 @@ public:
       _pFileName = pFileName;
    }
    bool available();
+   bool waitAvailable(unsigned long timeoutMs);
+   // Returns true, if waitAvailable() found the end of a file, a hangup or an error (no more data will arrive)
+   bool isEndOfData() const {
+      return _endOfData;
+   }
    void begin(int baud);
    int readBytes(byte *pBuffer, int bufferSize);
    int read();
+   // Read all data, which is available without waiting (up to bufferSize bytes)
+   int readAvailable(byte *pBuffer, int bufferSize);
    operator bool() const { return true; }
 private:
+   // Size of the receive buffer, which is filled with non-blocking reads
+   static const int BUFFER_SIZE = 4096;
+
    const char* _pFileName;
    int _timeout;
    int _fd;
    int _testDataPos;
+   byte _buffer[BUFFER_SIZE];
+   int _readPos;
+   int _bufferedBytes;
+   bool _endOfData;
+
+   int fillBuffer();
 };
 
 extern SerialImpl Serial;
 
+// Open a serial device (or a file or pipe) for non-blocking reads in raw mode, returns the file descriptor or -1
+int openSerialDevice(const char *pFileName, int baud);
+
 // ----------------------------------------------------------------------------
 // ESP implementation
 // ----------------------------------------------------------------------------
@@ -14,6 +14,7 @@ class SoftwareSerial {
 public:
    SoftwareSerial() {};
    size_t write(uint8_t byte) { return 0; };
+   size_t write(const uint8_t *pBuffer, size_t size) { return 0; };
    void begin(uint32_t baud, uint8_t serialConfig, uint8_t rxPin, int8_t txPing, bool invert) {};
 };
 
@@ -6,6 +6,12 @@
 #include "WiFiUDP.h"
 #include "Arduino.h"
 
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/socket.h>
+#  include <sys/uio.h>
+#endif
+
 #ifndef WSAGetLastError
 #  include <errno.h>
 #  define WSAGetLastError() (errno)
@@ -15,7 +21,7 @@
 #  define SOCKET_ERROR (-1)
 #endif
 
-WiFiUDP::WiFiUDP() : _pos(0), _length(0) {
+WiFiUDP::WiFiUDP() : _segmentCount(0), _length(0) {
 #ifdef _WIN32
    WSADATA wsa;
 
@@ -31,12 +37,20 @@ WiFiUDP::WiFiUDP() : _pos(0), _length(0) {
       printf("socket() failed with error code : %d", WSAGetLastError());
       exit(EXIT_FAILURE);
    }
+
+   // Sending must never block the main loop
+#ifdef _WIN32
+   u_long nonBlocking = 1;
+   ioctlsocket(_socket, FIONBIO, &nonBlocking);
+#else
+   fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
 }
 
 int WiFiUDP::beginPacket(IPAddress ipAddress, uint16_t port) {
    _address = ipAddress.getAddress();
    _address.sin_port = htons(port);
-   _pos = 0;
+   _segmentCount = 0;
    _length = 0;
    return 1;
 }
@@ -46,18 +60,43 @@ int WiFiUDP::beginPacketMulticast(IPAddress multicastAddress, uint16_t port, IPA
 }
 
 int WiFiUDP::write(const byte *pBuffer, int length) {
-   if (_pos + length < MAX_LENGTH) {
-      memcpy(_buffer + _pos, pBuffer, length);
-      _pos += length;
-      this->_length += length;
+   if ((_segmentCount < MAX_SEGMENTS) && (_length + length < MAX_LENGTH)) {
+      _pSegments[_segmentCount] = pBuffer;
+      _segmentLengths[_segmentCount] = length;
+      ++_segmentCount;
+      _length += length;
       return 1;
    }
    return 0;
 }
 
 int WiFiUDP::endPacket() {
-   if (sendto(_socket, (char*)_buffer, _length, 0, (struct sockaddr *) &_address, sizeof(_address)) == SOCKET_ERROR) {
-      printf("sendto() failed with error code : %d", WSAGetLastError());
+#ifdef _WIN32
+   WSABUF buffers[MAX_SEGMENTS];
+   for (int i = 0; i < _segmentCount; ++i) {
+      buffers[i].buf = (char*)_pSegments[i];
+      buffers[i].len = _segmentLengths[i];
+   }
+   DWORD sent = 0;
+   int result = WSASendTo(_socket, buffers, _segmentCount, &sent, 0, (struct sockaddr *) &_address, sizeof(_address), NULL, NULL);
+#else
+   struct iovec buffers[MAX_SEGMENTS];
+   for (int i = 0; i < _segmentCount; ++i) {
+      buffers[i].iov_base = (void*)_pSegments[i];
+      buffers[i].iov_len = _segmentLengths[i];
+   }
+   struct msghdr message;
+   memset(&message, 0, sizeof(message));
+   message.msg_name = &_address;
+   message.msg_namelen = sizeof(_address);
+   message.msg_iov = buffers;
+   message.msg_iovlen = _segmentCount;
+   int result = (int)sendmsg(_socket, &message, 0);
+#endif
+   _segmentCount = 0;
+   if (result == SOCKET_ERROR) {
+      printf("sendmsg() failed with error code : %d", WSAGetLastError());
+      return 0;
    }
    return 1;
 }
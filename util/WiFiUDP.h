@@ -16,15 +16,19 @@ public:
       uint16_t port,
       IPAddress interfaceAddress,
       int ttl = 1);
+   // Note: The data isn't copied, it's sent directly from the buffer of the caller (scatter-gather).
+   //       The buffer must stay unchanged until endPacket() is called.
    int write(const byte *pBuffer, int length);
    int endPacket();
 private:
    static const int MAX_LENGTH = 1500;
+   static const int MAX_SEGMENTS = 4;
    struct sockaddr_in _address;
    int _socket;
-   int _pos;
+   int _segmentCount;
    int _length;
-   byte _buffer[MAX_LENGTH];
+   const byte *_pSegments[MAX_SEGMENTS];
+   int _segmentLengths[MAX_SEGMENTS];
 };
 
 #endif
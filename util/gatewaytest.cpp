@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include "sml_gateway.h"
+#include "sml_demodata.h"
+
+// Address of the test receiver (a loopback address, so the energy meter port is usually free)
+const char *RECEIVER_ADDRESS = "127.0.0.77";
+
+/**
+ * @brief Receive all packets of the socket and count them per serial number.
+ */
+int receivePackets(int receiver, std::vector<int> &packetsPerMeter, uint32_t firstSerialNumber) {
+   uint8_t buffer[1500];
+   int errors = 0;
+   ssize_t length;
+   while ((length = recv(receiver, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+      uint32_t serialNumber = (uint32_t)buffer[20] << 24 | (uint32_t)buffer[21] << 16 | (uint32_t)buffer[22] << 8 | buffer[23];
+      uint32_t index = serialNumber - firstSerialNumber;
+      if ((length < 28) || (memcmp(buffer, "SMA", 4) != 0) || (index >= packetsPerMeter.size())) {
+         ++errors;
+         continue;
+      }
+      ++packetsPerMeter[index];
+   }
+   return errors;
+}
+
+int testGateway(int meterCount, bool withAggregate) {
+   const uint32_t FIRST_SERIAL_NUMBER = 1900000001U;
+   char directory[] = "/tmp/gatewaytestXXXXXX";
+   if (mkdtemp(directory) == NULL) {
+      printf("ERROR: Gateway, temporary directory can't be created\n");
+      return 1;
+   }
+
+   int receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   int bufferSize = 4 * 1024 * 1024;
+   setsockopt(receiver, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+   struct sockaddr_in address;
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_port = htons(SmlGatewayMeter::SMA_ENERGYMETER_PORT);
+   address.sin_addr.s_addr = inet_addr(RECEIVER_ADDRESS);
+   if (bind(receiver, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      printf("ERROR: Gateway, receiver can't be bound to %s\n", RECEIVER_ADDRESS);
+      close(receiver);
+      return 1;
+   }
+
+   // One FIFO per meter, which replaces the serial port
+   std::string configFile = std::string(directory) + "/gateway.conf";
+   FILE *pConfig = fopen(configFile.c_str(), "w");
+   fprintf(pConfig, "# Test configuration\n\n");
+   std::vector<std::string> fifos;
+   for (int i = 0; i < meterCount; ++i) {
+      fifos.push_back(std::string(directory) + "/meter" + std::to_string(i));
+      mkfifo(fifos[i].c_str(), 0600);
+      fprintf(pConfig, "%s 9600 %u %s\n", fifos[i].c_str(), FIRST_SERIAL_NUMBER + i, RECEIVER_ADDRESS);
+   }
+   // Virtual meter: first meter minus second meter
+   if (withAggregate) {
+      fprintf(pConfig, "aggregate %u +%s -%s %s\n", FIRST_SERIAL_NUMBER + meterCount, fifos[0].c_str(), fifos[1].c_str(),
+              RECEIVER_ADDRESS);
+   }
+   fclose(pConfig);
+
+   SmlGateway gateway;
+   int loaded = gateway.loadConfig(configFile.c_str());
+   std::vector<int> writers;
+   for (int i = 0; i < meterCount; ++i) {
+      writers.push_back(open(fifos[i].c_str(), O_WRONLY | O_NONBLOCK));
+   }
+
+   // Every meter gets the complete demo data, the blocks are interleaved
+   std::vector<int> packetsPerMeter(meterCount + 1, 0);
+   int errors = 0;
+   clock_t start = clock();
+   for (int block = 0; block < SML_DATA_LENGTH; ++block) {
+      for (int i = 0; i < meterCount; ++i) {
+         if (write(writers[i], SML_DATA[block].data, SML_DATA[block].length) != SML_DATA[block].length) {
+            ++errors;
+         }
+      }
+      while (gateway.poll(0) > 0) {
+      }
+      errors += receivePackets(receiver, packetsPerMeter, FIRST_SERIAL_NUMBER);
+   }
+   gateway.poll(10);
+   errors += receivePackets(receiver, packetsPerMeter, FIRST_SERIAL_NUMBER);
+   double cpuMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+   // Every meter must have parsed and sent all packets of the demo data (117 packets)
+   uint32_t packets = gateway.getMeter(0).getPackets();
+   for (int i = 0; i < meterCount; ++i) {
+      const SmlGatewayMeter &meter = gateway.getMeter(i);
+      if ((meter.getPackets() != packets) || (meter.getParsedOk() != packets) || (packetsPerMeter[i] != (int)packets) ||
+          (meter.getFanout().getDestination(0).packets != packets) || (meter.getSerialNumber() != FIRST_SERIAL_NUMBER + i)) {
+         printf("ERROR: Gateway, meter %d: %u packets, %u parsed, %d received\n", i, meter.getPackets(),
+                meter.getParsedOk(), packetsPerMeter[i]);
+         ++errors;
+      }
+   }
+   // The aggregate is sent for every packet of its meters, except the first one (the second meter is missing)
+   int aggregatePackets = withAggregate ? 2 * (int)packets - 1 : 0;
+   if (withAggregate) {
+      const SmlAggregateMeter &aggregate = gateway.getAggregate(0).meter;
+      int64_t expectedPower = gateway.getMeter(0).getParser().getValue(SML_POWER_SUM) -
+                              gateway.getMeter(1).getParser().getValue(SML_POWER_SUM);
+      if ((packetsPerMeter[meterCount] != aggregatePackets) || (aggregate.getUpdates() != (uint32_t)aggregatePackets) ||
+          (aggregate.getStaleUpdates() != 1U) || (aggregate.getValue(SML_POWER_SUM) != expectedPower)) {
+         printf("ERROR: Gateway, aggregate: %u updates, %u stale, %d received\n", aggregate.getUpdates(),
+                aggregate.getStaleUpdates(), packetsPerMeter[meterCount]);
+         ++errors;
+      }
+   }
+   bool testOk = (errors == 0) && (loaded == meterCount) && (packets == 117U) &&
+                 (gateway.getAggregateCount() == (withAggregate ? 1 : 0));
+   printf("%s: Gateway, %d meters, %u packets per meter, %d aggregate packets, %d errors, %.1f ms CPU time\n",
+          testOk ? "OK" : "ERROR", meterCount, packets, packetsPerMeter[meterCount], errors, cpuMs);
+
+   for (int i = 0; i < meterCount; ++i) {
+      close(writers[i]);
+      unlink(fifos[i].c_str());
+   }
+   unlink(configFile.c_str());
+   rmdir(directory);
+   close(receiver);
+   return testOk ? 0 : 1;
+}
+
+int testInvalidConfig() {
+   char fileName[] = "/tmp/gatewaytestXXXXXX";
+   int fd = mkstemp(fileName);
+   const char CONFIG[] = "/dev/null 9600\n";
+   bool written = write(fd, CONFIG, sizeof(CONFIG) - 1) == (ssize_t)sizeof(CONFIG) - 1;
+   close(fd);
+   SmlGateway gateway;
+   bool testOk = written && (gateway.loadConfig(fileName) < 0) && (gateway.loadConfig("/nonexistent/gateway.conf") < 0);
+   unlink(fileName);
+   printf("%s: Gateway, invalid configuration\n", testOk ? "OK" : "ERROR");
+   return testOk ? 0 : 1;
+}
+
+int testPseudoTerminal() {
+   // A drained serial port in raw mode returns 0 bytes, which must not be taken as a hang-up
+   int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+   if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0)) {
+      printf("ERROR: Gateway, pseudo terminal can't be created\n");
+      return 1;
+   }
+   std::string device = ptsname(master);
+
+   SmlGateway gateway;
+   gateway.add(device.c_str(), 9600, 1900000001U);
+   int errors = 0;
+   for (int block = 0; block < SML_DATA_LENGTH; ++block) {
+      if (write(master, SML_DATA[block].data, SML_DATA[block].length) != SML_DATA[block].length) {
+         ++errors;
+      }
+      // The data of a pseudo terminal arrives asynchronously, so wait for it
+      gateway.poll(5);
+      while (gateway.poll(0) > 0) {
+      }
+   }
+   unsigned long start = millis();
+   while ((gateway.getMeter(0).getPackets() < 117U) && (millis() - start < 1000UL)) {
+      gateway.poll(10);
+   }
+   const SmlGatewayMeter &meter = gateway.getMeter(0);
+   bool testOk = (errors == 0) && meter.isOpen() && (meter.getReconnects() == 0U) && (meter.getReadErrors() == 0U) &&
+                 (meter.getPackets() == 117U) && (meter.getParsedOk() == 117U);
+   printf("%s: Gateway, pseudo terminal, %u packets, %u parsed, %s\n", testOk ? "OK" : "ERROR", meter.getPackets(),
+          meter.getParsedOk(), meter.isOpen() ? "open" : "closed");
+   close(master);
+   return testOk ? 0 : 1;
+}
+
+int testSerialEndOfFile() {
+   char fileName[] = "/tmp/gatewaytestXXXXXX";
+   int fd = mkstemp(fileName);
+   bool written = write(fd, SML_DATA[0].data, SML_DATA[0].length) == SML_DATA[0].length;
+   close(fd);
+
+   SerialImpl serial;
+   serial.setFile(fileName);
+   serial.begin(9600);
+   uint8_t buffer[1024];
+   int length = serial.waitAvailable(100) ? serial.readAvailable(buffer, sizeof(buffer)) : 0;
+   bool endAfterData = serial.isEndOfData();
+   // At the end of the file, the timeout must be used instead of returning at once
+   unsigned long start = millis();
+   int calls = 0;
+   while (millis() - start < 200UL) {
+      length += serial.waitAvailable(50) ? serial.readAvailable(buffer, sizeof(buffer)) : 0;
+      ++calls;
+   }
+   unlink(fileName);
+   bool testOk = written && (length == SML_DATA[0].length) && (calls <= 5) && !endAfterData && serial.isEndOfData();
+   printf("%s: Serial, end of file, %d bytes, %d waits in 200 ms\n", testOk ? "OK" : "ERROR", length, calls);
+   return testOk ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+   int failed = 0;
+
+   failed += testGateway(1, false);
+   failed += testGateway(3, false);
+   failed += testGateway(200, false);
+   failed += testGateway(2, true);
+   failed += testInvalidConfig();
+   failed += testPseudoTerminal();
+   failed += testSerialEndOfFile();
+
+   if (failed == 0) {
+      printf("ALL TESTS PASSED.\n");
+   }
+   else {
+      printf("%d TEST(S) FAILED.\n", failed);
+   }
+
+   return (failed == 0) ? 0 : 1;
+}
@@ -5,13 +5,159 @@
 // Change serial number if running on a PC
 #define EMETER_SERNO 994420617
 
+#include <mutex>
 #include "Arduino.h"
 
 #include "../sml2emeter.ino"
+#include "sml_pipeline.h"
+#if defined(__linux__)
+#  include "sml_gateway.h"
+#endif
+
+// Interval for printing the statistics of the pipeline and the gateway
+const unsigned long STATS_INTERVAL_MS = 10000;
+
+/**
+ * @brief Print the statistics of a stage of the pipeline.
+ */
+void printStats(const char *pName, const SmlPipelineStats &stats) {
+   printf("\n%-10s %6u frames, %4u drops, queue %d (max %d), latency %u us (max %u, avg %u)", pName,
+          stats.frames, stats.drops, stats.queueDepth, stats.maxQueueDepth, stats.lastLatencyUs,
+          stats.maxLatencyUs, stats.averageLatencyUs);
+}
+
+/**
+ * @brief Print the statistics of all stages of the pipeline.
+ */
+void printPipelineStats(const SmlPipeline &pipeline) {
+   printStats("ingest", pipeline.getIngestStats());
+   printStats("decode", pipeline.getDecodeStats());
+   printStats("udp", pipeline.getPublisherStats(0));
+   printStats("mqtt", pipeline.getPublisherStats(1));
+   printf("\n");
+}
+
+/**
+ * @brief Run reading, decoding and publishing in separate threads.
+ */
+void runPipeline() {
+   // The pipeline ends at the end of a file or when the device is gone
+   SmlPipeline pipeline([](uint8_t *pBuffer, int size) {
+      if (Serial.waitAvailable(100)) {
+         return Serial.readAvailable(pBuffer, size);
+      }
+      return Serial.isEndOfData() ? -1 : 0;
+   }, SML_PACKET_SIZE, SML_CRC_POLICY);
+   // The fan-out, the energy meter packet and the MQTT client are used by the publishers, by the web server
+   // and by configuration changes, so every publisher has a mutex for its state
+   std::mutex udpMutex;
+   std::mutex mqttMutex;
+   pipeline.addPublisher([&udpMutex](const SmlPipelineFrame &frame) {
+      if (frame.parsedOk) {
+         std::lock_guard<std::mutex> lock(udpMutex);
+         publishEmeter(frame.parser, frame.data.data(), frame.length);
+      }
+   });
+   pipeline.addPublisher([&mqttMutex](const SmlPipelineFrame &frame) {
+      if (frame.parsedOk) {
+         std::lock_guard<std::mutex> lock(mqttMutex);
+         publishMqtt(frame.parser);
+      }
+   });
+   // The global parser and stream reader aren't used in this mode
+   server.on("/data", [&]() {
+      SmlParser parser(true, SML_CRC_POLICY);
+      pipeline.getParserSnapshot(parser);
+      std::lock_guard<std::mutex> udpLock(udpMutex);
+      std::lock_guard<std::mutex> mqttLock(mqttMutex);
+      server.send(200, "application/json", getCurrentDataAsJson(parser, pipeline.getReaderStats()));
+   });
+   iotWebConf.setConfigSavedCallback([&udpMutex, &mqttMutex]() {
+      std::lock_guard<std::mutex> udpLock(udpMutex);
+      std::lock_guard<std::mutex> mqttLock(mqttMutex);
+      configSaved();
+   });
+   pipeline.start();
+
+   // The main thread handles the web server, the led and the UDP packets, which couldn't be sent at once
+   unsigned long lastStats = millis();
+   while (pipeline.isRunning()) {
+      iotWebConf.doLoop();
+      signalConnectionState();
+      {
+         std::lock_guard<std::mutex> lock(udpMutex);
+         udpFanout.flush();
+      }
+      delay(EVENT_INTERVAL_MS);
+      if (millis() - lastStats >= STATS_INTERVAL_MS) {
+         lastStats = millis();
+         printPipelineStats(pipeline);
+      }
+   }
+   pipeline.join();
+   // The mutexes are gone after the pipeline
+   iotWebConf.setConfigSavedCallback(&configSaved);
+   printf("\nEnd of data.");
+   printPipelineStats(pipeline);
+}
+
+#if defined(__linux__)
+/**
+ * @brief Read all meters of a configuration file in a single thread (see SmlGateway).
+ */
+int runGateway(const char *pConfigFile) {
+   SmlGateway gateway;
+   if (gateway.loadConfig(pConfigFile) <= 0) {
+      printf("No meters configured in %s\n", pConfigFile);
+      return -1;
+   }
+   printf("Gateway with %d meters started.\n", gateway.getMeterCount());
+
+   unsigned long lastStats = millis();
+   while (true) {
+      gateway.poll(100);
+      if (millis() - lastStats >= STATS_INTERVAL_MS) {
+         lastStats = millis();
+         for (int i = 0; i < gateway.getMeterCount(); ++i) {
+            const SmlGatewayMeter &meter = gateway.getMeter(i);
+            uint32_t sent = 0U;
+            uint32_t errors = 0U;
+            for (int j = 0; j < meter.getFanout().getCount(); ++j) {
+               sent += meter.getFanout().getDestination(j).packets;
+               errors += meter.getFanout().getDestination(j).errors;
+            }
+            printf("%-20s %s %8u bytes, %6u packets, %6u parsed, %4u parse errors, %4u read errors, %6u sent, %4u send errors\n",
+                   meter.getDevice(), meter.isOpen() ? "open  " : "closed", meter.getBytes(), meter.getPackets(),
+                   meter.getParsedOk(), meter.getParseErrors(), meter.getReadErrors(), sent, errors);
+         }
+         for (int i = 0; i < gateway.getAggregateCount(); ++i) {
+            const SmlGatewayAggregate &aggregate = gateway.getAggregate(i);
+            printf("aggregate %-10u %d meters, %6u updates, %4u stale, power %.2fW\n", aggregate.meter.getSerialNumber(),
+                   aggregate.meter.getInputCount(), aggregate.meter.getUpdates(),
+                   aggregate.meter.getStaleUpdates(), aggregate.meter.getValue(SML_POWER_SUM) / 100.0);
+         }
+      }
+   }
+   return 0;
+}
+#endif
 
 int main(int argc, char** argv) {
+#if defined(__linux__)
+   if ((argc == 3) && (strcmp(argv[1], "--gateway") == 0)) {
+      return runGateway(argv[2]);
+   }
+#endif
+   bool usePipeline = (argc > 1) && (strcmp(argv[1], "--pipeline") == 0);
+   if (usePipeline) {
+      --argc;
+      ++argv;
+   }
    if (argc == 1) {
-      printf("Usage: %s [COM-port]\n", argv[0]);
+      printf("Usage: %s [--pipeline] [COM-port]\n", argv[0]);
+#if defined(__linux__)
+      printf("       %s --gateway config-file\n", argv[0]);
+#endif
       return -1;
    }
    if (argc > 1) {
@@ -21,6 +167,11 @@ int main(int argc, char** argv) {
 
    setup();
 
+   if (usePipeline) {
+      runPipeline();
+      return 0;
+   }
+
    while (true) {
       loop();
    }
@@ -0,0 +1,192 @@
+// ----------------------------------------------------------------------------
+// Batch parser for archived SML frames (host only, uses threads).
+// ----------------------------------------------------------------------------
+
+#ifndef SML_BATCH_PARSER_H
+#define SML_BATCH_PARSER_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../smlparser.h"
+#include "../smlstreamreader.h"
+
+/**
+ * @brief Caller-provided result arrays of a batch, one element per frame.
+ *
+ * Columns, which are NULL, are not written.
+ */
+struct SmlBatchColumns {
+   /// Status of every frame: SML_BATCH_PARSED, SML_BATCH_CRC_ERROR and the received slots (bit n for slot n)
+   uint32_t *pStatus;
+   /// Value of every slot in the unit of the slot (see SmlValueSlot) or 0, if the frame doesn't contain the value
+   int64_t *pValues[SML_VALUE_SLOTS];
+};
+
+/// The frame contains at least one GET_LIST_RES message with a correct CRC
+const uint32_t SML_BATCH_PARSED = 0x80000000U;
+/// At least one message of the frame has a wrong CRC
+const uint32_t SML_BATCH_CRC_ERROR = 0x40000000U;
+/// Received slots
+const uint32_t SML_BATCH_SLOT_MASK = (1U << SML_VALUE_SLOTS) - 1U;
+
+static_assert(SML_VALUE_SLOTS <= 30, "Too many slots for the status of a batch");
+
+/**
+ * @brief Parser for large numbers of frames, e.g. to reprocess archived meter data.
+ *
+ * Every frame is parsed independently with SmlParser::parseFrame(), the results are written to columnar arrays.
+ * A batch is split in contiguous ranges, which are parsed by a pool of worker threads. Every worker has its own
+ * parser, so the shape cache stays warm for consecutive frames of the same meter.
+ *
+ * Example:
+ *    SmlBatchParser batchParser;
+ *    SmlBatchColumns columns = {};
+ *    columns.pStatus = status;
+ *    columns.pValues[SML_POWER_SUM] = power;
+ *    batchParser.parse(pFrames, frameCount, columns);
+ */
+class SmlBatchParser {
+public:
+   /**
+    * @brief Constructor
+    * @param threads    Number of worker threads (0: one per core)
+    * @param crcPolicy  CRC verification policy of the parsers
+    */
+   explicit SmlBatchParser(int threads = 0, SmlParser::CrcPolicy crcPolicy = SmlParser::CRC_FULL) :
+      _pFrames(NULL), _columns(), _generation(0U), _pending(0), _stop(false)
+   {
+      if (threads <= 0) {
+         threads = (int)std::thread::hardware_concurrency();
+      }
+      if (threads <= 0) {
+         threads = 1;
+      }
+      for (int i = 0; i < threads; ++i) {
+         _workers.push_back(std::unique_ptr<Worker>(new Worker(crcPolicy)));
+      }
+      for (int i = 0; i < threads; ++i) {
+         _workers[i]->thread = std::thread(&SmlBatchParser::run, this, i);
+      }
+   }
+
+   ~SmlBatchParser() {
+      {
+         std::lock_guard<std::mutex> lock(_mutex);
+         _stop = true;
+      }
+      _startCondition.notify_all();
+      for (size_t i = 0; i < _workers.size(); ++i) {
+         _workers[i]->thread.join();
+      }
+   }
+
+   SmlBatchParser(const SmlBatchParser &) = delete;
+   SmlBatchParser &operator=(const SmlBatchParser &) = delete;
+
+   /// Number of worker threads
+   inline int getThreadCount() const { return (int)_workers.size(); }
+
+   /**
+    * @brief Parse a batch of frames.
+    * @param pFrames  Frames (payload without escape sequences and padding)
+    * @param count    Number of frames
+    * @param columns  Result arrays with at least count elements
+    * @return Number of frames, which could be parsed
+    */
+   int parse(const SmlFrame *pFrames, int count, const SmlBatchColumns &columns) {
+      int threads = getThreadCount();
+      int rangeLength = (count + threads - 1) / threads;
+      std::unique_lock<std::mutex> lock(_mutex);
+      _pFrames = pFrames;
+      _columns = columns;
+      for (int i = 0; i < threads; ++i) {
+         int first = i * rangeLength;
+         _workers[i]->first = (first < count) ? first : count;
+         _workers[i]->count = (first + rangeLength < count) ? rangeLength : count - _workers[i]->first;
+      }
+      _pending = threads;
+      ++_generation;
+      _startCondition.notify_all();
+      _doneCondition.wait(lock, [this]() { return _pending == 0; });
+
+      int parsedOk = 0;
+      for (int i = 0; i < threads; ++i) {
+         parsedOk += _workers[i]->parsedOk;
+      }
+      return parsedOk;
+   }
+
+private:
+   /**
+    * @brief Worker thread with its own parser.
+    */
+   struct Worker {
+      explicit Worker(SmlParser::CrcPolicy crcPolicy) : parser(true, crcPolicy), first(0), count(0), parsedOk(0) {}
+
+      std::thread thread;
+      SmlParser parser;
+      int first;
+      int count;
+      int parsedOk;
+   };
+
+   std::vector<std::unique_ptr<Worker> > _workers;
+   std::mutex _mutex;
+   std::condition_variable _startCondition;
+   std::condition_variable _doneCondition;
+   const SmlFrame *_pFrames;
+   SmlBatchColumns _columns;
+   uint32_t _generation;
+   int _pending;
+   bool _stop;
+
+   /**
+    * @brief Main loop of a worker thread.
+    */
+   void run(int index) {
+      Worker &worker = *_workers[index];
+      uint32_t generation = 0U;
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (true) {
+         _startCondition.wait(lock, [&]() { return _stop || (_generation != generation); });
+         if (_stop) {
+            return;
+         }
+         generation = _generation;
+         lock.unlock();
+         worker.parsedOk = parseRange(worker.parser, worker.first, worker.count);
+         lock.lock();
+         if (--_pending == 0) {
+            _doneCondition.notify_one();
+         }
+      }
+   }
+
+   /**
+    * @brief Parse a range of frames of the current batch and write the results.
+    */
+   int parseRange(SmlParser &parser, int first, int count) {
+      int parsedOk = 0;
+      for (int i = first; i < first + count; ++i) {
+         bool ok = parser.parseFrame(_pFrames[i].pData, _pFrames[i].length);
+         uint32_t slots = ok ? parser.getPacketSlots() : 0U;
+         if (_columns.pStatus != NULL) {
+            _columns.pStatus[i] = (ok ? SML_BATCH_PARSED : 0U) |
+                                  ((parser.getFrameInfo().crcErrors > 0) ? SML_BATCH_CRC_ERROR : 0U) | slots;
+         }
+         for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+            if (_columns.pValues[slot] != NULL) {
+               _columns.pValues[slot][i] = (slots & (1U << slot)) ? parser.getValue((SmlValueSlot)slot) : 0;
+            }
+         }
+         parsedOk += ok ? 1 : 0;
+      }
+      return parsedOk;
+   }
+};
+
+#endif // SML_BATCH_PARSER_H
@@ -0,0 +1,50 @@
+// ----------------------------------------------------------------------------
+// Helper to create SML packets for tests and benchmarks.
+// ----------------------------------------------------------------------------
+
+#ifndef SML_ENCODER_H
+#define SML_ENCODER_H
+
+#include <stdint.h>
+#include "../crc16ccitt.h"
+
+/**
+ * @brief Create a SML packet with the given payload (escape sequences, padding and CRC are added).
+ * @param pPayload Payload of the packet
+ * @param length Length of the payload in bytes
+ * @param pPacket Buffer for the packet, which must be large enough for the escaped payload and 19 bytes
+ * @return Length of the packet in bytes
+ */
+inline int encodeSmlPacket(const uint8_t *pPayload, int length, uint8_t *pPacket) {
+   int pos = 0;
+   int escLen = 0;
+   for (int i = 0; i < 8; ++i) {
+      pPacket[pos++] = (i < 4) ? 0x1b : 0x01;
+   }
+   for (int i = 0; i < length; ++i) {
+      pPacket[pos++] = pPayload[i];
+      escLen = (pPayload[i] == 0x1b) ? escLen + 1 : 0;
+      if (escLen == 4) {
+         for (int j = 0; j < 4; ++j) {
+            pPacket[pos++] = 0x1b;
+         }
+         escLen = 0;
+      }
+   }
+   int padding = (4 - (length % 4)) % 4;
+   for (int i = 0; i < padding; ++i) {
+      pPacket[pos++] = 0x00;
+   }
+   for (int i = 0; i < 4; ++i) {
+      pPacket[pos++] = 0x1b;
+   }
+   pPacket[pos++] = 0x1a;
+   pPacket[pos++] = (uint8_t)padding;
+   Crc16Ccitt crc16;
+   crc16.calc(pPacket, pos);
+   pPacket[pos++] = crc16.getCrc() >> 8;
+   pPacket[pos++] = crc16.getCrc() & 0xff;
+   return pos;
+}
+
+#endif // SML_ENCODER_H
@@ -0,0 +1,524 @@
+// ----------------------------------------------------------------------------
+// Gateway for many meters (Linux only): a single epoll loop reads all serial
+// ports and sends an energy meter packet per meter.
+// ----------------------------------------------------------------------------
+
+#ifndef SML_GATEWAY_H
+#define SML_GATEWAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "WiFiUDP.h"
+#include "../smlstreamreader.h"
+#include "../smlstreamparser.h"
+#include "../emeterpacket.h"
+#include "../smlemetermapping.h"
+#include "../smlaggregatemeter.h"
+#include "../udpfanout.h"
+
+/// Separators of the fields of the configuration file
+const char SML_GATEWAY_SEPARATORS[] = ",; \t\r\n";
+
+/**
+ * @brief Meter of the gateway: serial port, reader, parser, energy meter packet and destinations.
+ */
+class SmlGatewayMeter {
+public:
+   static const int MAX_PACKET_SIZE = 1000;
+   /// Port of the SMA energy meter protocol, all other ports get the raw SML packets
+   static const uint16_t SMA_ENERGYMETER_PORT = 9522;
+   /// Time without data after the start of a packet, which is counted as read error
+   static const unsigned long SERIAL_TIMEOUT_MS = 2000;
+
+   /// Payloads of the destinations
+   enum PayloadIndex { PAYLOAD_EMETER, PAYLOAD_SML, PAYLOAD_COUNT };
+
+   /**
+    * @brief Constructor
+    * @param pDevice       Serial device (e.g. /dev/ttyUSB0)
+    * @param baud          Baud rate
+    * @param serialNumber  Serial number of the energy meter packets
+    * @param crcPolicy     CRC verification policy
+    */
+   SmlGatewayMeter(const char *pDevice, int baud, uint32_t serialNumber, SmlParser::CrcPolicy crcPolicy = SmlParser::CRC_FULL) :
+      _device(pDevice), _baud(baud), _serialNumber(serialNumber), _fd(-1),
+      _reader(MAX_PACKET_SIZE, SmlParser::checksTransportCrc(crcPolicy), SmlStreamReaderBase::CRC_PER_FRAME, true),
+      _parser(crcPolicy), _packet(serialNumber), _receiving(false), _lastDataMs(0UL),
+      _bytes(0U), _packets(0U), _readErrors(0U), _reconnects(0U) {}
+
+   ~SmlGatewayMeter() {
+      close();
+   }
+
+   SmlGatewayMeter(const SmlGatewayMeter &) = delete;
+   SmlGatewayMeter &operator=(const SmlGatewayMeter &) = delete;
+
+   /**
+    * @brief Add a destination.
+    * @param pAddress  IP address with optional port (e.g. "192.168.1.10" or "192.168.1.10:9523")
+    * @return false, if the address is invalid or the table is full
+    */
+   bool addDestination(const char *pAddress) {
+      return addDestination(_fanout, pAddress);
+   }
+
+   /**
+    * @brief Add a destination to a destination table (see addDestination()).
+    */
+   static bool addDestination(UdpFanout &fanout, const char *pAddress) {
+      char address[32] = { 0 };
+      strncpy(address, pAddress, sizeof(address) - 1);
+      uint16_t port = SMA_ENERGYMETER_PORT;
+      char *pPortPos = strchr(address, ':');
+      if (pPortPos != NULL) {
+         *pPortPos = 0;
+         port = (uint16_t)atoi(pPortPos + 1);
+      }
+      IPAddress ipAddress;
+      if (!ipAddress.fromString(address)) {
+         return false;
+      }
+      bool multicast = (ntohl(ipAddress.getAddress().sin_addr.s_addr) >> 28) == 0xe;
+      return fanout.add(ipAddress, port, (port == SMA_ENERGYMETER_PORT) ? PAYLOAD_EMETER : PAYLOAD_SML, multicast);
+   }
+
+   /**
+    * @brief Open the serial port.
+    * @return false, if the port can't be opened
+    */
+   bool open() {
+      close();
+      _fd = openSerialDevice(_device.c_str(), _baud);
+      return _fd >= 0;
+   }
+
+   /**
+    * @brief Close the serial port (the packet in progress is discarded).
+    */
+   void close() {
+      if (_fd >= 0) {
+         ::close(_fd);
+         _fd = -1;
+      }
+      if (_receiving) {
+         _receiving = false;
+         ++_readErrors;
+      }
+   }
+
+   /**
+    * @brief Read the available data, parse it and publish every complete packet.
+    *
+    * A read of 0 bytes only means, that no more data is available: A serial port in raw mode (VMIN = 0,
+    * VTIME = 0) returns 0 instead of EAGAIN, when it's drained. Hang-ups are detected with EPOLLHUP by the gateway.
+    * @param udp       UDP instance (only used, if sendmmsg() isn't available)
+    * @param maxReads  Maximum number of reads (limits the time spent on one meter)
+    * @return Number of packets or -1, if reading the port failed
+    */
+   int handleInput(WiFiUDP &udp, int maxReads) {
+      uint8_t buffer[512];
+      int packets = 0;
+      for (int i = 0; i < maxReads; ++i) {
+         ssize_t length = ::read(_fd, buffer, sizeof(buffer));
+         if (length == 0) {
+            return packets;
+         }
+         if (length < 0) {
+            bool failed = (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR);
+            return failed ? -1 : packets;
+         }
+         _bytes += (uint32_t)length;
+         _lastDataMs = millis();
+         const uint8_t *pData = buffer;
+         while (length > 0) {
+            int result = _reader.addData(pData, (int)length);
+            if (result < 0) {
+               break;
+            }
+            pData += result;
+            length -= result;
+            publish(udp);
+            ++packets;
+         }
+         // The rest of the data belongs to the next packet
+         _receiving = (length > 0);
+         // Parse the packet in progress, so only the rest is left, when it's complete
+         _parser.update(_reader);
+      }
+      return packets;
+   }
+
+   /**
+    * @brief Count a read error, if a packet wasn't completed in time.
+    */
+   void checkTimeout(unsigned long nowMs) {
+      if (_receiving && (nowMs - _lastDataMs >= SERIAL_TIMEOUT_MS)) {
+         _receiving = false;
+         ++_readErrors;
+      }
+   }
+
+   /// Serial device
+   inline const char *getDevice() const { return _device.c_str(); }
+   /// File descriptor of the serial port or -1, if it's closed
+   inline int getFd() const { return _fd; }
+   /// Returns true, if the serial port is open
+   inline bool isOpen() const { return _fd >= 0; }
+   /// Serial number of the energy meter packets
+   inline uint32_t getSerialNumber() const { return _serialNumber; }
+   /// Number of received bytes
+   inline uint32_t getBytes() const { return _bytes; }
+   /// Number of complete packets
+   inline uint32_t getPackets() const { return _packets; }
+   /// Number of packets, which could be parsed
+   inline uint32_t getParsedOk() const { return _parser.getParsedOk(); }
+   /// Number of errors of the reader and the parser
+   inline uint32_t getParseErrors() const { return _parser.getParseErrors() + _reader.getParseErrors(); }
+   /// Number of incomplete packets (timeouts and closed ports)
+   inline uint32_t getReadErrors() const { return _readErrors; }
+   /// Number of times the port was opened again
+   inline uint32_t getReconnects() const { return _reconnects; }
+   /// Parser with the values of the last packet
+   inline const SmlParser &getParser() const { return _parser; }
+   /// Destinations with their counters
+   inline UdpFanout &getFanout() { return _fanout; }
+   inline const UdpFanout &getFanout() const { return _fanout; }
+
+   /// Count a reconnect (called by the gateway)
+   inline void addReconnect() { ++_reconnects; }
+
+private:
+   std::string _device;
+   int _baud;
+   uint32_t _serialNumber;
+   int _fd;
+   SmlStreamReader _reader;
+   SmlStreamParser _parser;
+   EmeterPacket _packet;
+   SmlEmeterMapping _mapping;
+   UdpFanout _fanout;
+   bool _receiving;
+   unsigned long _lastDataMs;
+   uint32_t _bytes;
+   uint32_t _packets;
+   uint32_t _readErrors;
+   uint32_t _reconnects;
+
+   /**
+    * @brief Parse the rest of the current packet and send it to all destinations.
+    */
+   void publish(WiFiUDP &udp) {
+      ++_packets;
+      if (!_parser.finish(_reader) || (_fanout.getCount() == 0)) {
+         return;
+      }
+      _packet.setTimeStamp(millis());
+      _mapping.update(_packet, _parser);
+      UdpPayload payloads[PAYLOAD_COUNT] = {
+         { _packet.getData(), _packet.getLength() },
+         { _reader.getData(), _reader.getLength() }
+      };
+      _fanout.send(udp, payloads, PAYLOAD_COUNT);
+   }
+};
+
+/**
+ * @brief Virtual meter of the gateway, which combines several meters (see SmlAggregateMeter).
+ */
+struct SmlGatewayAggregate {
+   explicit SmlGatewayAggregate(uint32_t serialNumber) : meter(serialNumber) {}
+
+   SmlAggregateMeter meter;
+   /// Destinations of the energy meter packet
+   UdpFanout fanout;
+   /// Index of the gateway meter of every input
+   int meters[SmlAggregateMeter::MAX_INPUTS];
+};
+
+/**
+ * @brief Gateway for many meters, which are served by a single thread.
+ *
+ * All serial ports are registered with one epoll instance, so a meter only costs CPU time, when it sends data.
+ * Every meter has its own reader, parser, energy meter packet (with its own serial number) and destinations.
+ * Ports, which are closed by the other side (e.g. an unplugged USB IR head), are opened again periodically.
+ * Aggregates add or subtract meters and send their own energy meter packet, whenever one of the meters was updated.
+ *
+ * Configuration file (one meter per line, destinations separated by ',', ';' or blanks, '#' starts a comment):
+ *    /dev/ttyUSB0 9600 1900000001 192.168.1.10 192.168.1.11:9523
+ *    /dev/ttyUSB1 9600 1900000002 239.12.255.254
+ *    aggregate 1900000100 +/dev/ttyUSB0 -/dev/ttyUSB1 192.168.1.10
+ *
+ * Example:
+ *    SmlGateway gateway;
+ *    gateway.loadConfig("gateway.conf");
+ *    while (true) {
+ *       gateway.poll(100);
+ *    }
+ */
+class SmlGateway {
+public:
+   static const int MAX_EVENTS = 64;
+   /// Maximum number of reads per meter and event, so a fast meter can't delay the others
+   static const int MAX_READS_PER_EVENT = 4;
+   /// Interval for timeouts, reconnects and queued UDP packets
+   static const unsigned long MAINTENANCE_INTERVAL_MS = 100;
+   static const unsigned long RECONNECT_INTERVAL_MS = 5000;
+
+   SmlGateway() : _epollFd(epoll_create1(EPOLL_CLOEXEC)), _lastMaintenanceMs(0UL), _lastReconnectMs(0UL) {}
+
+   ~SmlGateway() {
+      _aggregates.clear();
+      _meters.clear();
+      if (_epollFd >= 0) {
+         ::close(_epollFd);
+      }
+   }
+
+   SmlGateway(const SmlGateway &) = delete;
+   SmlGateway &operator=(const SmlGateway &) = delete;
+
+   /**
+    * @brief Add a meter and open its serial port (if it can't be opened, it's tried again later).
+    */
+   SmlGatewayMeter &add(const char *pDevice, int baud, uint32_t serialNumber,
+                        SmlParser::CrcPolicy crcPolicy = SmlParser::CRC_FULL) {
+      _meters.push_back(std::unique_ptr<SmlGatewayMeter>(new SmlGatewayMeter(pDevice, baud, serialNumber, crcPolicy)));
+      open((int)_meters.size() - 1);
+      return *_meters.back();
+   }
+
+   /**
+    * @brief Add an aggregate of meters (the meters are added with addAggregateInput()).
+    */
+   SmlGatewayAggregate &addAggregate(uint32_t serialNumber) {
+      _aggregates.push_back(std::unique_ptr<SmlGatewayAggregate>(new SmlGatewayAggregate(serialNumber)));
+      return *_aggregates.back();
+   }
+
+   /**
+    * @brief Add a meter to an aggregate.
+    * @param aggregate  Aggregate
+    * @param pDevice    Serial device of the meter
+    * @param sign       1 to add the values of the meter, -1 to subtract them
+    * @return false, if there is no meter with this device or the aggregate has too many inputs
+    */
+   bool addAggregateInput(SmlGatewayAggregate &aggregate, const char *pDevice, int sign) {
+      for (size_t i = 0; i < _meters.size(); ++i) {
+         if (strcmp(_meters[i]->getDevice(), pDevice) == 0) {
+            int input = aggregate.meter.addInput(sign);
+            if (input < 0) {
+               return false;
+            }
+            aggregate.meters[input] = (int)i;
+            return true;
+         }
+      }
+      return false;
+   }
+
+   /**
+    * @brief Add the meters of a configuration file.
+    * @return Number of meters or -1, if the file can't be read or contains an invalid line
+    */
+   int loadConfig(const char *pFileName) {
+      FILE *pFile = fopen(pFileName, "r");
+      if (pFile == NULL) {
+         return -1;
+      }
+      char line[512];
+      int count = 0;
+      int lineNumber = 0;
+      while (fgets(line, sizeof(line), pFile) != NULL) {
+         ++lineNumber;
+         char *pComment = strchr(line, '#');
+         if (pComment != NULL) {
+            *pComment = 0;
+         }
+         char *pSavePos = NULL;
+         char *pDevice = strtok_r(line, SML_GATEWAY_SEPARATORS, &pSavePos);
+         if (pDevice == NULL) {
+            continue;
+         }
+         if (strcmp(pDevice, "aggregate") == 0) {
+            if (!loadAggregate(pFileName, lineNumber, pSavePos)) {
+               count = -1;
+               break;
+            }
+            continue;
+         }
+         char *pBaud = strtok_r(NULL, SML_GATEWAY_SEPARATORS, &pSavePos);
+         char *pSerialNumber = strtok_r(NULL, SML_GATEWAY_SEPARATORS, &pSavePos);
+         if ((pBaud == NULL) || (pSerialNumber == NULL)) {
+            printf("%s:%d: Baud rate or serial number missing\n", pFileName, lineNumber);
+            count = -1;
+            break;
+         }
+         SmlGatewayMeter &meter = add(pDevice, atoi(pBaud), (uint32_t)strtoul(pSerialNumber, NULL, 10));
+         for (char *pAddress = strtok_r(NULL, SML_GATEWAY_SEPARATORS, &pSavePos); pAddress != NULL;
+              pAddress = strtok_r(NULL, SML_GATEWAY_SEPARATORS, &pSavePos)) {
+            if (!meter.addDestination(pAddress)) {
+               printf("%s:%d: Invalid destination %s\n", pFileName, lineNumber, pAddress);
+            }
+         }
+         ++count;
+      }
+      fclose(pFile);
+      return count;
+   }
+
+   /**
+    * @brief Wait for data and process it.
+    * @param timeoutMs  Maximum time to wait for data
+    * @return Number of complete packets
+    */
+   int poll(int timeoutMs) {
+      struct epoll_event events[MAX_EVENTS];
+      int eventCount = epoll_wait(_epollFd, events, MAX_EVENTS, timeoutMs);
+      int packets = 0;
+      for (int i = 0; i < eventCount; ++i) {
+         int index = (int)events[i].data.u32;
+         SmlGatewayMeter &meter = *_meters[index];
+         uint32_t parsedOk = meter.getParsedOk();
+         int result = meter.handleInput(_udp, MAX_READS_PER_EVENT);
+         if (result > 0) {
+            packets += result;
+         }
+         if (meter.getParsedOk() != parsedOk) {
+            updateAggregates(index);
+         }
+         // Hang-ups are reported after the last data was read
+         if ((result < 0) || ((result == 0) && (events[i].events & (EPOLLHUP | EPOLLERR)))) {
+            close(index);
+         }
+      }
+
+      unsigned long now = millis();
+      if (now - _lastMaintenanceMs >= MAINTENANCE_INTERVAL_MS) {
+         _lastMaintenanceMs = now;
+         bool reconnect = (now - _lastReconnectMs >= RECONNECT_INTERVAL_MS);
+         if (reconnect) {
+            _lastReconnectMs = now;
+         }
+         for (size_t i = 0; i < _meters.size(); ++i) {
+            SmlGatewayMeter &meter = *_meters[i];
+            meter.checkTimeout(now);
+            meter.getFanout().flush();
+            if (reconnect && !meter.isOpen() && open((int)i)) {
+               meter.addReconnect();
+            }
+         }
+         for (size_t i = 0; i < _aggregates.size(); ++i) {
+            _aggregates[i]->fanout.flush();
+         }
+      }
+      return packets;
+   }
+
+   /// Number of meters
+   inline int getMeterCount() const { return (int)_meters.size(); }
+
+   /// Meter with its counters
+   inline SmlGatewayMeter &getMeter(int i) { return *_meters[i]; }
+   inline const SmlGatewayMeter &getMeter(int i) const { return *_meters[i]; }
+
+   /// Number of aggregates
+   inline int getAggregateCount() const { return (int)_aggregates.size(); }
+
+   /// Aggregate with its destinations
+   inline SmlGatewayAggregate &getAggregate(int i) { return *_aggregates[i]; }
+   inline const SmlGatewayAggregate &getAggregate(int i) const { return *_aggregates[i]; }
+
+private:
+   int _epollFd;
+   std::vector<std::unique_ptr<SmlGatewayMeter> > _meters;
+   std::vector<std::unique_ptr<SmlGatewayAggregate> > _aggregates;
+   WiFiUDP _udp;
+   unsigned long _lastMaintenanceMs;
+   unsigned long _lastReconnectMs;
+
+   /**
+    * @brief Add an aggregate of a configuration file: serial number, meters (with sign) and destinations.
+    */
+   bool loadAggregate(const char *pFileName, int lineNumber, char *pSavePos) {
+      char *pSerialNumber = strtok_r(NULL, SML_GATEWAY_SEPARATORS, &pSavePos);
+      if (pSerialNumber == NULL) {
+         printf("%s:%d: Serial number missing\n", pFileName, lineNumber);
+         return false;
+      }
+      SmlGatewayAggregate &aggregate = addAggregate((uint32_t)strtoul(pSerialNumber, NULL, 10));
+      for (char *pToken = strtok_r(NULL, SML_GATEWAY_SEPARATORS, &pSavePos); pToken != NULL;
+           pToken = strtok_r(NULL, SML_GATEWAY_SEPARATORS, &pSavePos)) {
+         if ((pToken[0] == '+') || (pToken[0] == '-')) {
+            if (!addAggregateInput(aggregate, pToken + 1, (pToken[0] == '-') ? -1 : 1)) {
+               printf("%s:%d: Unknown meter %s\n", pFileName, lineNumber, pToken + 1);
+               return false;
+            }
+         }
+         else if (!SmlGatewayMeter::addDestination(aggregate.fanout, pToken)) {
+            printf("%s:%d: Invalid destination %s\n", pFileName, lineNumber, pToken);
+         }
+      }
+      return true;
+   }
+
+   /**
+    * @brief Pass the values of a meter to all aggregates, which use it, and send the updated packets.
+    */
+   void updateAggregates(int meterIndex) {
+      unsigned long now = millis();
+      for (size_t i = 0; i < _aggregates.size(); ++i) {
+         SmlGatewayAggregate &aggregate = *_aggregates[i];
+         for (int input = 0; input < aggregate.meter.getInputCount(); ++input) {
+            if ((aggregate.meters[input] != meterIndex) ||
+                !aggregate.meter.update(input, _meters[meterIndex]->getParser(), now) ||
+                (aggregate.fanout.getCount() == 0)) {
+               continue;
+            }
+            const EmeterPacket &packet = aggregate.meter.getPacket();
+            UdpPayload payloads[SmlGatewayMeter::PAYLOAD_COUNT] = { { packet.getData(), packet.getLength() }, { NULL, 0 } };
+            aggregate.fanout.send(_udp, payloads, SmlGatewayMeter::PAYLOAD_COUNT);
+         }
+      }
+   }
+
+   /**
+    * @brief Open the serial port of a meter and register it with epoll.
+    */
+   bool open(int index) {
+      SmlGatewayMeter &meter = *_meters[index];
+      if (!meter.open()) {
+         return false;
+      }
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = EPOLLIN;
+      event.data.u32 = (uint32_t)index;
+      if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, meter.getFd(), &event) != 0) {
+         // e.g. a regular file, which can't be polled
+         meter.close();
+         return false;
+      }
+      return true;
+   }
+
+   /**
+    * @brief Unregister the serial port of a meter and close it.
+    */
+   void close(int index) {
+      SmlGatewayMeter &meter = *_meters[index];
+      if (meter.isOpen()) {
+         epoll_ctl(_epollFd, EPOLL_CTL_DEL, meter.getFd(), NULL);
+         meter.close();
+      }
+   }
+};
+
+#endif // SML_GATEWAY_H
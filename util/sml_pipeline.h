@@ -0,0 +1,500 @@
+// ----------------------------------------------------------------------------
+// Pipelined runtime for the host build: ingest, decode and publisher threads,
+// which are connected by lock-free single-producer/single-consumer queues.
+// ----------------------------------------------------------------------------
+
+#ifndef SML_PIPELINE_H
+#define SML_PIPELINE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../smlparser.h"
+#include "../smlstreamreader.h"
+
+/**
+ * @brief Bounded lock-free queue for exactly one producer and one consumer thread.
+ *
+ * SIZE must be a power of two. The queue holds up to SIZE elements.
+ */
+template<typename T, int SIZE>
+class SmlSpscQueue {
+public:
+   static_assert((SIZE > 0) && ((SIZE & (SIZE - 1)) == 0), "SIZE must be a power of two");
+
+   /// Maximum number of elements
+   static const int CAPACITY = SIZE;
+
+   SmlSpscQueue() : _head(0U), _tail(0U), _maxDepth(0) {}
+
+   /**
+    * @brief Add an element (producer only).
+    * @return false, if the queue is full
+    */
+   bool push(const T &item) {
+      uint32_t tail = _tail.load(std::memory_order_relaxed);
+      uint32_t depth = tail - _head.load(std::memory_order_acquire);
+      if (depth >= (uint32_t)SIZE) {
+         return false;
+      }
+      _items[tail & (SIZE - 1)] = item;
+      _tail.store(tail + 1U, std::memory_order_release);
+      if ((int)depth + 1 > _maxDepth.load(std::memory_order_relaxed)) {
+         _maxDepth.store((int)depth + 1, std::memory_order_relaxed);
+      }
+      return true;
+   }
+
+   /**
+    * @brief Remove the oldest element (consumer only).
+    * @return false, if the queue is empty
+    */
+   bool pop(T &item) {
+      uint32_t head = _head.load(std::memory_order_relaxed);
+      if (head == _tail.load(std::memory_order_acquire)) {
+         return false;
+      }
+      item = _items[head & (SIZE - 1)];
+      _head.store(head + 1U, std::memory_order_release);
+      return true;
+   }
+
+   /// Number of elements in the queue (a snapshot, if called by another thread)
+   inline int size() const {
+      return (int)(_tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire));
+   }
+
+   /// Maximum number of elements, which were in the queue
+   inline int getMaxDepth() const { return _maxDepth.load(std::memory_order_relaxed); }
+
+private:
+   T _items[SIZE];
+   std::atomic<uint32_t> _head;
+   std::atomic<uint32_t> _tail;
+   std::atomic<int> _maxDepth;
+};
+
+/**
+ * @brief Event to wake up a consumer thread, which has nothing to do.
+ *
+ * The producers call notify() after a push, the consumer calls wait(), when all its queues were empty.
+ * A notification, which arrives before wait(), isn't lost: wait() returns at once.
+ */
+class SmlPipelineEvent {
+public:
+   SmlPipelineEvent() : _signaled(false) {}
+
+   /// Wake up the consumer
+   void notify() {
+      {
+         std::lock_guard<std::mutex> lock(_mutex);
+         _signaled = true;
+      }
+      _condition.notify_one();
+   }
+
+   /// Wait for the next notification
+   void wait() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _condition.wait(lock, [this]() { return _signaled; });
+      _signaled = false;
+   }
+
+private:
+   std::mutex _mutex;
+   std::condition_variable _condition;
+   bool _signaled;
+};
+
+/**
+ * @brief Frame of the pipeline: the received packet and the parser state after decoding it.
+ */
+struct SmlPipelineFrame {
+   /// Payload of the packet (see SmlStreamReader::getData())
+   std::vector<uint8_t> data;
+   int length;
+   /// Result of SmlParser::parseFrame()
+   bool parsedOk;
+   /// Snapshot of the parser after decoding the frame (values and counters)
+   SmlParser parser;
+   /// Time, when the last byte of the packet was received
+   std::chrono::steady_clock::time_point received;
+};
+
+/**
+ * @brief Statistics of a stage of the pipeline.
+ */
+struct SmlPipelineStats {
+   /// Frames processed by the stage
+   uint32_t frames;
+   /// Frames, which were dropped, because the input queue of the stage was full
+   uint32_t drops;
+   /// Current and maximum number of frames in the input queue
+   int queueDepth;
+   int maxQueueDepth;
+   /// Time from the reception of the frame until the stage is done in us (last, maximum and average)
+   uint32_t lastLatencyUs;
+   uint32_t maxLatencyUs;
+   uint32_t averageLatencyUs;
+};
+
+/**
+ * @brief Pipelined runtime: a reader thread, a decoder thread and a thread per publisher.
+ *
+ * The ingest thread owns the data source and the SmlStreamReader and copies every packet to a free frame
+ * of a pool. The decode thread parses the frame with SmlParser and hands it to all publishers. Every
+ * publisher runs in its own thread, so a slow publisher (e.g. MQTT) doesn't delay reading or the other
+ * publishers. The stages only exchange frame numbers through lock-free SPSC queues. If a queue is full,
+ * the frame is dropped for this stage and counted. A stage without frames blocks on an event, which is
+ * notified by its producers, so an idle pipeline doesn't use CPU time. Other threads (e.g. the web server)
+ * read the values of the last decoded frame with getParserSnapshot().
+ *
+ * Example:
+ *    SmlPipeline pipeline(readData);
+ *    pipeline.addPublisher([](const SmlPipelineFrame &frame) { ... });
+ *    pipeline.start();
+ *    ...
+ *    pipeline.stop();
+ */
+class SmlPipeline {
+public:
+   static const int MAX_PUBLISHERS = 4;
+   /// Frames, which can be queued for a publisher (a slow publisher can't use up the pool)
+   static const int PUBLISHER_QUEUE_SIZE = 4;
+   /// Number of frames
+   static const int POOL_SIZE = 32;
+
+   /**
+    * @brief Source of the data: reads up to size bytes, waits shortly, if no data is available.
+    * @return Number of bytes read, 0 if no data is available or -1 at the end of the data
+    */
+   typedef std::function<int(uint8_t *pBuffer, int size)> Source;
+
+   /// Publisher, which is called for every decoded frame
+   typedef std::function<void(const SmlPipelineFrame &frame)> Publisher;
+
+   /**
+    * @brief Constructor
+    * @param source         Source of the data
+    * @param maxPacketSize  Maximum size of a packet
+    * @param crcPolicy      CRC verification policy of the parser (the reader checks the transport CRC, if the
+    *                       policy requires it)
+    */
+   explicit SmlPipeline(const Source &source, int maxPacketSize = 1000, SmlParser::CrcPolicy crcPolicy = SmlParser::CRC_FULL) :
+      _source(source),
+      _reader(maxPacketSize, SmlParser::checksTransportCrc(crcPolicy), SmlStreamReaderBase::CRC_PER_FRAME, true),
+      _parser(true, crcPolicy), _publisherCount(0), _snapshotParser(true, crcPolicy),
+      _stop(false), _ingestDone(false), _decodeDone(false), _runningThreads(0)
+   {
+      for (int i = 0; i < POOL_SIZE; ++i) {
+         _frames[i].data.resize(maxPacketSize);
+         _frames[i].length = 0;
+         _frames[i].parsedOk = false;
+         _references[i] = 0;
+      }
+      _readerStats = _reader.getStats();
+   }
+
+   ~SmlPipeline() {
+      stop();
+   }
+
+   SmlPipeline(const SmlPipeline &) = delete;
+   SmlPipeline &operator=(const SmlPipeline &) = delete;
+
+   /**
+    * @brief Add a publisher (before start() is called).
+    * @return false, if there are too many publishers
+    */
+   bool addPublisher(const Publisher &publisher) {
+      if (_publisherCount >= MAX_PUBLISHERS) {
+         return false;
+      }
+      _publishers[_publisherCount++].publish = publisher;
+      return true;
+   }
+
+   /**
+    * @brief Start all threads.
+    */
+   void start() {
+      for (int i = 0; i < POOL_SIZE; ++i) {
+         _freeQueue.push(i);
+      }
+      _runningThreads = 2 + _publisherCount;
+      _threads.push_back(std::thread(&SmlPipeline::runIngest, this));
+      _threads.push_back(std::thread(&SmlPipeline::runDecode, this));
+      for (int i = 0; i < _publisherCount; ++i) {
+         _threads.push_back(std::thread(&SmlPipeline::runPublisher, this, i));
+      }
+   }
+
+   /**
+    * @brief Wait until all data of the source was processed (the source has returned -1).
+    */
+   void join() {
+      for (size_t i = 0; i < _threads.size(); ++i) {
+         _threads[i].join();
+      }
+      _threads.clear();
+   }
+
+   /**
+    * @brief Stop all threads (frames in the queues are discarded).
+    */
+   void stop() {
+      _stop = true;
+      _decodeEvent.notify();
+      for (int i = 0; i < _publisherCount; ++i) {
+         _publishers[i].event.notify();
+      }
+      join();
+   }
+
+   /// Returns true, until all stages are finished
+   inline bool isRunning() const { return _runningThreads > 0; }
+
+   /// Number of publishers
+   inline int getPublisherCount() const { return _publisherCount; }
+
+   /// Statistics of the ingest stage (drops: no free frame)
+   SmlPipelineStats getIngestStats() const { return _ingestStats.get(0, 0); }
+
+   /// Statistics of the decode stage
+   SmlPipelineStats getDecodeStats() const { return _decodeStats.get(_decodeQueue.size(), _decodeQueue.getMaxDepth()); }
+
+   /// Statistics of a publisher stage
+   SmlPipelineStats getPublisherStats(int i) const {
+      return _publishers[i].stats.get(_publishers[i].queue.size(), _publishers[i].queue.getMaxDepth());
+   }
+
+   /**
+    * @brief Copy the parser state after the last decoded frame (can be called by any thread).
+    */
+   void getParserSnapshot(SmlParser &parser) const {
+      std::lock_guard<std::mutex> lock(_snapshotMutex);
+      parser = _snapshotParser;
+   }
+
+   /// Counters of the stream reader (can be called by any thread)
+   SmlStreamReaderStats getReaderStats() const {
+      std::lock_guard<std::mutex> lock(_snapshotMutex);
+      return _readerStats;
+   }
+
+private:
+   typedef SmlSpscQueue<int, PUBLISHER_QUEUE_SIZE> FrameQueue;
+   typedef SmlSpscQueue<int, POOL_SIZE> PoolQueue;
+   // The ingest thread can't return a frame to the pool (it's not the producer of the free queue)
+   static_assert(PoolQueue::CAPACITY >= POOL_SIZE, "the decode queue must hold all frames of the pool");
+
+   /**
+    * @brief Counters of a stage, which are updated by the stage and read by other threads.
+    */
+   struct StageCounters {
+      std::atomic<uint32_t> frames;
+      std::atomic<uint32_t> drops;
+      std::atomic<uint32_t> lastLatencyUs;
+      std::atomic<uint32_t> maxLatencyUs;
+      std::atomic<uint64_t> totalLatencyUs;
+
+      StageCounters() : frames(0U), drops(0U), lastLatencyUs(0U), maxLatencyUs(0U), totalLatencyUs(0U) {}
+
+      void add(const SmlPipelineFrame &frame) {
+         std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - frame.received;
+         uint32_t latencyUs = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+         lastLatencyUs.store(latencyUs, std::memory_order_relaxed);
+         if (latencyUs > maxLatencyUs.load(std::memory_order_relaxed)) {
+            maxLatencyUs.store(latencyUs, std::memory_order_relaxed);
+         }
+         totalLatencyUs.fetch_add(latencyUs, std::memory_order_relaxed);
+         frames.fetch_add(1U, std::memory_order_relaxed);
+      }
+
+      SmlPipelineStats get(int queueDepth, int maxQueueDepth) const {
+         SmlPipelineStats stats;
+         stats.frames = frames.load(std::memory_order_relaxed);
+         stats.drops = drops.load(std::memory_order_relaxed);
+         stats.queueDepth = queueDepth;
+         stats.maxQueueDepth = maxQueueDepth;
+         stats.lastLatencyUs = lastLatencyUs.load(std::memory_order_relaxed);
+         stats.maxLatencyUs = maxLatencyUs.load(std::memory_order_relaxed);
+         stats.averageLatencyUs = (stats.frames > 0) ? (uint32_t)(totalLatencyUs.load(std::memory_order_relaxed) / stats.frames) : 0U;
+         return stats;
+      }
+   };
+
+   /**
+    * @brief Publisher stage: input queue of frames and output queue of frames, which are done.
+    */
+   struct PublisherStage {
+      Publisher publish;
+      FrameQueue queue;
+      // Notified, when a frame was added to the queue or the decode stage is done
+      SmlPipelineEvent event;
+      PoolQueue releaseQueue;
+      StageCounters stats;
+   };
+
+   Source _source;
+   SmlStreamReader _reader;
+   SmlParser _parser;
+   SmlPipelineFrame _frames[POOL_SIZE];
+   // Number of publishers, which still use a frame (only used by the decode thread)
+   int _references[POOL_SIZE];
+   PublisherStage _publishers[MAX_PUBLISHERS];
+   int _publisherCount;
+   // Free frames (decode thread -> ingest thread)
+   PoolQueue _freeQueue;
+   // Received frames (ingest thread -> decode thread)
+   PoolQueue _decodeQueue;
+   // Notified, when a frame was received or released by a publisher or the ingest stage is done
+   SmlPipelineEvent _decodeEvent;
+   StageCounters _ingestStats;
+   StageCounters _decodeStats;
+   // Copies of the parser and the reader counters for other threads
+   mutable std::mutex _snapshotMutex;
+   SmlParser _snapshotParser;
+   SmlStreamReaderStats _readerStats;
+   std::vector<std::thread> _threads;
+   std::atomic<bool> _stop;
+   std::atomic<bool> _ingestDone;
+   std::atomic<bool> _decodeDone;
+   std::atomic<int> _runningThreads;
+
+   /**
+    * @brief Ingest thread: read data from the source and pass complete packets to the decoder.
+    */
+   void runIngest() {
+      uint8_t buffer[256];
+      while (!_stop) {
+         int length = _source(buffer, (int)sizeof(buffer));
+         if (length < 0) {
+            break;
+         }
+         const uint8_t *pData = buffer;
+         while (length > 0) {
+            int result = _reader.addData(pData, length);
+            if (result < 0) {
+               break;
+            }
+            pData += result;
+            length -= result;
+            int frame;
+            if (!_freeQueue.pop(frame)) {
+               _ingestStats.drops.fetch_add(1U, std::memory_order_relaxed);
+               continue;
+            }
+            SmlPipelineFrame &pipelineFrame = _frames[frame];
+            pipelineFrame.length = _reader.getLength();
+            memcpy(pipelineFrame.data.data(), _reader.getData(), pipelineFrame.length);
+            pipelineFrame.received = std::chrono::steady_clock::now();
+            _ingestStats.add(pipelineFrame);
+            // Never fails: the queue can hold all frames of the pool
+            _decodeQueue.push(frame);
+            _decodeEvent.notify();
+         }
+         std::lock_guard<std::mutex> lock(_snapshotMutex);
+         _readerStats = _reader.getStats();
+      }
+      _ingestDone = true;
+      _decodeEvent.notify();
+      --_runningThreads;
+   }
+
+   /**
+    * @brief Decode thread: parse the frames and pass them to all publishers.
+    */
+   void runDecode() {
+      while (!_stop) {
+         bool busy = releaseFrames();
+         int frame;
+         if (_decodeQueue.pop(frame)) {
+            SmlPipelineFrame &pipelineFrame = _frames[frame];
+            pipelineFrame.parsedOk = _parser.parseFrame(pipelineFrame.data.data(), pipelineFrame.length);
+            pipelineFrame.parser = _parser;
+            {
+               std::lock_guard<std::mutex> lock(_snapshotMutex);
+               _snapshotParser = _parser;
+            }
+            _decodeStats.add(pipelineFrame);
+            _references[frame] = 0;
+            for (int i = 0; i < _publisherCount; ++i) {
+               if (_publishers[i].queue.push(frame)) {
+                  ++_references[frame];
+                  _publishers[i].event.notify();
+               }
+               else {
+                  _publishers[i].stats.drops.fetch_add(1U, std::memory_order_relaxed);
+               }
+            }
+            if (_references[frame] == 0) {
+               _freeQueue.push(frame);
+            }
+            busy = true;
+         }
+         else if (_ingestDone && (_decodeQueue.size() == 0)) {
+            // The flag is read first: all frames, which were pushed before it was set, are visible
+            break;
+         }
+         if (!busy) {
+            _decodeEvent.wait();
+         }
+      }
+      _decodeDone = true;
+      for (int i = 0; i < _publisherCount; ++i) {
+         _publishers[i].event.notify();
+      }
+      --_runningThreads;
+   }
+
+   /**
+    * @brief Return the frames, which were published by all publishers, to the pool (decode thread).
+    * @return true, if a frame was released
+    */
+   bool releaseFrames() {
+      bool released = false;
+      for (int i = 0; i < _publisherCount; ++i) {
+         int frame;
+         while (_publishers[i].releaseQueue.pop(frame)) {
+            if (--_references[frame] == 0) {
+               _freeQueue.push(frame);
+            }
+            released = true;
+         }
+      }
+      return released;
+   }
+
+   /**
+    * @brief Publisher thread: call the publisher for every decoded frame.
+    */
+   void runPublisher(int index) {
+      PublisherStage &stage = _publishers[index];
+      while (!_stop) {
+         int frame;
+         if (stage.queue.pop(frame)) {
+            stage.publish(_frames[frame]);
+            stage.stats.add(_frames[frame]);
+            stage.releaseQueue.push(frame);
+            _decodeEvent.notify();
+         }
+         else if (_decodeDone && (stage.queue.size() == 0)) {
+            break;
+         }
+         else {
+            stage.event.wait();
+         }
+      }
+      --_runningThreads;
+   }
+};
+
+#endif // SML_PIPELINE_H
@@ -0,0 +1,591 @@
+// ----------------------------------------------------------------------------
+// Throughput benchmarks for the SML reader and parser
+//
+// All benchmarks replay the demo frames from sml_demodata.h.
+// ----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <initializer_list>
+#include "sml_demodata.h"
+#include "sml_encoder.h"
+#include "../smlstreamreader.h"
+#include "../smlparser.h"
+#include "../smlstreamparser.h"
+#include "../emeterpacket.h"
+#include "sml_batchparser.h"
+
+/**
+ * @brief Byte-by-byte stream reader as it was before the bulk ingestion path was added.
+ *
+ * Kept as reference for the "before" numbers and to cross-check the results of SmlStreamReader.
+ */
+class ReferenceSmlStreamReader {
+public:
+   ReferenceSmlStreamReader(int maxPacketSize) :
+      _currentState(&ReferenceSmlStreamReader::stateReadData),
+      _maxPacketSize(maxPacketSize),
+      _escLen(0),
+      _escData(0U),
+      _parseErrors(0U),
+      _packetPos(0),
+      _packetLength(0),
+      _crc16Expected(0)
+   {
+      _data = new uint8_t[_maxPacketSize];
+   }
+
+   ~ReferenceSmlStreamReader() {
+      delete[] _data;
+   }
+
+   inline const uint8_t *getData() { return _data; }
+
+   inline int getLength() { return _packetLength; }
+
+   inline uint32_t getParseErrors() const { return _parseErrors; }
+
+   int addData(const uint8_t *pData, int length) {
+      for (int i = 0; i < length; ++i) {
+         _crc16.calc(pData[i]);
+         if ((this->*_currentState)(pData[i])) {
+            return i + 1;
+         }
+      }
+      return -1;
+   }
+
+private:
+   bool(ReferenceSmlStreamReader::*_currentState)(uint8_t);
+   int _maxPacketSize;
+   int _escLen;
+   uint32_t _escData;
+   uint32_t _parseErrors;
+   int _packetPos;
+   int _packetLength;
+   uint16_t _crc16Expected;
+   uint8_t *_data;
+   Crc16Ccitt _crc16;
+
+   void startPacket() {
+      _packetPos = 0;
+      _escLen = 0;
+      _crc16.init(0x91dc);
+   }
+
+   bool stateReadData(uint8_t currentByte) {
+      if (_packetPos >= _maxPacketSize) {
+         ++_parseErrors;
+         startPacket();
+      }
+      _data[_packetPos++] = currentByte;
+      if (currentByte == 0x1b) {
+         if (++_escLen == 4) {
+            _packetPos -= 4;
+            _currentState = &ReferenceSmlStreamReader::stateReadEsc;
+            _crc16Expected = _crc16.getCrcState();
+         }
+      }
+      else {
+         _escLen = 0;
+      }
+      return false;
+   }
+
+   bool stateReadEsc(uint8_t currentByte) {
+      _escData = (_escData << 8) | currentByte;
+      if (--_escLen <= 0) {
+         _currentState = &ReferenceSmlStreamReader::stateReadData;
+         if (_escData == 0x01010101) {
+            startPacket();
+         }
+         if (_escData == 0x1b1b1b1b) {
+            _packetPos += 4;
+         }
+         if ((_escData & 0xff000000) == 0x1a000000) {
+            int spareBytes = ((_escData & 0x00ff0000) >> 16);
+            _packetLength = _packetPos - spareBytes;
+            _crc16.init(_crc16Expected);
+            _crc16.calc(0x1a);
+            _crc16.calc(spareBytes);
+            _crc16Expected = _escData & 0x0000ffff;
+            if (_crc16Expected != _crc16.getCrc()) {
+               ++_parseErrors;
+               return false;
+            }
+            return true;
+         }
+      }
+      return false;
+   }
+};
+
+// Maximum packet size used by all readers
+const int MAX_PACKET_SIZE = 1000;
+
+// Number of times the demo stream is replayed per measurement
+const int REPETITIONS = 2000;
+
+/**
+ * @brief Concatenate all demo frames to one continuous stream.
+ */
+std::vector<uint8_t> createStream() {
+   std::vector<uint8_t> stream;
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      stream.insert(stream.end(), SML_DATA[i].data, SML_DATA[i].data + SML_DATA[i].length);
+   }
+   return stream;
+}
+
+/**
+ * @brief Create a stream of packets with many escape bytes.
+ * 
+ * The payload consists of long runs of 1b (with escaped 1b 1b 1b 1b sequences) and the packets are
+ * separated by partial escape sequences.
+ */
+std::vector<uint8_t> createAdversarialStream(int length) {
+   std::vector<uint8_t> stream;
+   uint8_t payload[256];
+   uint8_t packet[600];
+   uint32_t random = 12345U;
+   while ((int)stream.size() < length) {
+      for (int i = 0; i < 255; ++i) {
+         random = random * 1103515245U + 12345U;
+         payload[i] = ((random >> 16) & 3) ? 0x1b : (uint8_t)(random >> 24);
+      }
+      payload[255] = 0x00;
+      int packetLength = encodeSmlPacket(payload, sizeof(payload), packet);
+      stream.insert(stream.end(), packet, packet + packetLength);
+      const uint8_t PARTIAL_ESCAPES[] = { 0x1b, 0x1b, 0x1b, 0x1a, 0x1b, 0x1b, 0x01, 0x01, 0x1b, 0x02 };
+      stream.insert(stream.end(), PARTIAL_ESCAPES, PARTIAL_ESCAPES + sizeof(PARTIAL_ESCAPES));
+   }
+   return stream;
+}
+
+/**
+ * @brief Replay the stream through a reader in chunks of the given size.
+ * @return Number of complete packets
+ */
+template <class Reader>
+int replay(Reader &reader, const std::vector<uint8_t> &stream, int chunkSize, uint32_t &checksum) {
+   int packets = 0;
+   for (size_t chunkStart = 0; chunkStart < stream.size(); chunkStart += chunkSize) {
+      int chunkLength = (int)(stream.size() - chunkStart) < chunkSize ? (int)(stream.size() - chunkStart) : chunkSize;
+      const uint8_t *pChunk = stream.data() + chunkStart;
+      int offset = 0;
+      do {
+         int consumed = reader.addData(pChunk + offset, chunkLength - offset);
+         if (consumed < 0) {
+            break;
+         }
+         offset += consumed;
+         checksum += reader.getLength() + reader.getData()[reader.getLength() - 1];
+         ++packets;
+      } while (offset < chunkLength);
+   }
+   return packets;
+}
+
+/**
+ * @brief Replay the stream through SmlStreamReader::addFrames in chunks of the given size.
+ * @return Number of complete packets
+ */
+int replayFrames(SmlStreamReader &reader, const std::vector<uint8_t> &stream, int chunkSize, uint32_t &checksum) {
+   int packets = 0;
+   for (size_t chunkStart = 0; chunkStart < stream.size(); chunkStart += chunkSize) {
+      int chunkLength = (int)(stream.size() - chunkStart) < chunkSize ? (int)(stream.size() - chunkStart) : chunkSize;
+      packets += reader.addFrames(stream.data() + chunkStart, chunkLength, [&checksum](const SmlFrame &frame) {
+         checksum += frame.length + frame.pData[frame.length - 1];
+      });
+   }
+   return packets;
+}
+
+/**
+ * @brief Measure the throughput of a reader in MB/s.
+ */
+template <class Reader>
+double measureReader(const char *pName, Reader &reader, const std::vector<uint8_t> &stream, int chunkSize,
+                     int (*pReplay)(Reader &, const std::vector<uint8_t> &, int, uint32_t &) = replay<Reader>) {
+   uint32_t checksum = 0U;
+   int packets = 0;
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   for (int i = 0; i < REPETITIONS; ++i) {
+      packets += pReplay(reader, stream, chunkSize, checksum);
+   }
+   std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+   double mbPerSecond = (double)stream.size() * REPETITIONS / elapsed.count() / 1e6;
+   printf("   %-14s chunk %6d: %8.1f MB/s (%d packets, %u errors, checksum %08x)\n",
+          pName, chunkSize, mbPerSecond, packets, (unsigned int)reader.getParseErrors(), checksum);
+   return mbPerSecond;
+}
+
+/**
+ * @brief Compare the bulk ingestion of SmlStreamReader against the byte-by-byte reference.
+ */
+void benchmarkReader(const std::vector<uint8_t> &stream) {
+   printf("SmlStreamReader::addData (%d bytes per replay)\n", (int)stream.size());
+   const int CHUNK_SIZES[] = { 1, 64, 1024, (int)stream.size() };
+   for (int chunkSize : CHUNK_SIZES) {
+      ReferenceSmlStreamReader referenceReader(MAX_PACKET_SIZE);
+      SmlStreamReader bulkReader(MAX_PACKET_SIZE);
+      SmlStreamReader perFrameReader(MAX_PACKET_SIZE, true, SmlStreamReader::CRC_PER_FRAME);
+      StaticSmlStreamReader<MAX_PACKET_SIZE, SmlStaticPolicy<true, SmlStreamReaderBase::CRC_PER_FRAME> > staticReader;
+      double before = measureReader("reference", referenceReader, stream, chunkSize);
+      double after = measureReader("bulk", bulkReader, stream, chunkSize);
+      double afterPerFrame = measureReader("bulk+crc/frame", perFrameReader, stream, chunkSize);
+      double afterStatic = measureReader("static", staticReader, stream, chunkSize);
+      double afterFrames = measureReader("addFrames", bulkReader, stream, chunkSize, replayFrames);
+      printf("   speedup: %.2fx, %.2fx, %.2fx, %.2fx\n", after / before, afterPerFrame / before,
+             afterStatic / before, afterFrames / before);
+   }
+}
+
+/**
+ * @brief Compare the transition table of SmlStreamReader against the two-state machine of the reference
+ *        on normal traffic and on input with long runs of escape bytes.
+ */
+void benchmarkTransport(const std::vector<uint8_t> &stream) {
+   std::vector<uint8_t> adversarialStream = createAdversarialStream((int)stream.size());
+   const std::vector<uint8_t> *pStreams[] = { &stream, &adversarialStream };
+   const char *pStreamNames[] = { "meter traffic", "escape runs" };
+   for (int s = 0; s < 2; ++s) {
+      printf("Escape handling, %s (%d bytes per replay)\n", pStreamNames[s], (int)pStreams[s]->size());
+      for (int chunkSize : { 1, 1024 }) {
+         ReferenceSmlStreamReader referenceReader(MAX_PACKET_SIZE);
+         SmlStreamReader reader(MAX_PACKET_SIZE);
+         double before = measureReader("two-state", referenceReader, *pStreams[s], chunkSize);
+         double after = measureReader("table", reader, *pStreams[s], chunkSize);
+         printf("   speedup: %.2fx\n", after / before);
+      }
+   }
+}
+
+/**
+ * @brief Compare the buffer CRC calculation against feeding the CRC byte by byte.
+ */
+void benchmarkCrc(const std::vector<uint8_t> &stream) {
+   printf("Crc16Ccitt::calc (%d slices)\n", CRC16_CCITT_SLICES);
+   Crc16Ccitt crc16;
+   double results[2];
+   for (int bulk = 0; bulk < 2; ++bulk) {
+      uint32_t checksum = 0U;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int i = 0; i < REPETITIONS; ++i) {
+         for (int j = 0; j < SML_DATA_LENGTH; ++j) {
+            crc16.init();
+            if (bulk) {
+               crc16.calc(SML_DATA[j].data, SML_DATA[j].length);
+            }
+            else {
+               for (int k = 0; k < SML_DATA[j].length; ++k) {
+                  crc16.calc(SML_DATA[j].data[k]);
+               }
+            }
+            checksum += crc16.getCrc();
+         }
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      results[bulk] = (double)stream.size() * REPETITIONS / elapsed.count() / 1e6;
+      printf("   %-10s %8.1f MB/s (checksum %08x)\n", bulk ? "buffer" : "bytewise", results[bulk], checksum);
+   }
+   printf("   speedup: %.2fx\n", results[1] / results[0]);
+}
+
+/**
+ * @brief Compare reading a stream with long bursts of line noise with and without resync mode.
+ */
+void benchmarkNoise(const std::vector<uint8_t> &stream) {
+   std::vector<uint8_t> noisyStream;
+   uint32_t random = 12345U;
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      for (int j = 0; j < 2000; ++j) {
+         random = random * 1103515245U + 12345U;
+         noisyStream.push_back((uint8_t)(random >> 16));
+      }
+      noisyStream.insert(noisyStream.end(), SML_DATA[i].data, SML_DATA[i].data + SML_DATA[i].length);
+   }
+   printf("SmlStreamReader with line noise (%d bytes per replay, %d bytes noise)\n", (int)noisyStream.size(), (int)(noisyStream.size() - stream.size()));
+   SmlStreamReader reader(MAX_PACKET_SIZE);
+   SmlStreamReader resyncReader(MAX_PACKET_SIZE, true, SmlStreamReader::CRC_PER_BYTE, true);
+   double before = measureReader("bulk", reader, noisyStream, 1024);
+   double after = measureReader("resync", resyncReader, noisyStream, 1024);
+   printf("   speedup: %.2fx, %u resyncs, %u bytes discarded\n", after / before,
+          (unsigned int)resyncReader.getResyncCount(), (unsigned int)resyncReader.getDiscardedBytes());
+}
+
+/**
+ * @brief Decoded packets of one meter type.
+ */
+struct MeterPackets {
+   std::string name;
+   std::vector<std::vector<uint8_t> > packets;
+};
+
+/**
+ * @brief Decode all demo frames and group the packets by meter type (name without the sequence number).
+ */
+std::vector<MeterPackets> createMeterPackets() {
+   std::vector<MeterPackets> meters;
+   SmlStreamReader reader(MAX_PACKET_SIZE);
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      std::string name(SML_DATA[i].name);
+      size_t separator = name.find_last_of('_');
+      if ((separator != std::string::npos) && (name.find_first_not_of("0123456789", separator + 1) == std::string::npos)) {
+         name.erase(separator);
+      }
+      if (meters.empty() || (meters.back().name != name)) {
+         meters.push_back(MeterPackets());
+         meters.back().name = name;
+      }
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      int result;
+      while ((length > 0) && ((result = reader.addData(pData, length)) >= 0)) {
+         meters.back().packets.push_back(std::vector<uint8_t>(reader.getData(), reader.getData() + reader.getLength()));
+         pData += result;
+         length -= result;
+      }
+   }
+   return meters;
+}
+
+/**
+ * @brief Measure the time to parse a packet in ns.
+ */
+double measureParser(SmlParser &parser, const std::vector<std::vector<uint8_t> > &packets, uint32_t &checksum) {
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   for (int i = 0; i < REPETITIONS; ++i) {
+      for (const std::vector<uint8_t> &packet : packets) {
+         parser.parsePacket(packet.data(), (int)packet.size());
+         checksum += parser.getPowerIn() + (uint32_t)parser.getEnergyIn();
+      }
+   }
+   std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+   return elapsed.count() * 1e9 / ((double)packets.size() * REPETITIONS);
+}
+
+/**
+ * @brief Compare the full parse of every packet against the shape cache.
+ */
+void benchmarkParser() {
+   printf("SmlParser::parsePacket (full parse vs. shape cache)\n");
+   std::vector<MeterPackets> meters = createMeterPackets();
+   for (const MeterPackets &meter : meters) {
+      SmlParser fullParser(false);
+      SmlParser cachedParser(true);
+      uint32_t fullChecksum = 0U;
+      uint32_t cachedChecksum = 0U;
+      double before = measureParser(fullParser, meter.packets, fullChecksum);
+      double after = measureParser(cachedParser, meter.packets, cachedChecksum);
+      printf("   %-32s %3d packets: %7.1f ns -> %7.1f ns, speedup %.2fx (%u hits, %u misses%s)\n",
+             meter.name.c_str(), (int)meter.packets.size(), before, after, before / after,
+             (unsigned int)cachedParser.getShapeHits(), (unsigned int)cachedParser.getShapeMisses(),
+             fullChecksum == cachedChecksum ? "" : ", CHECKSUM MISMATCH");
+   }
+}
+
+/**
+ * @brief Compare parsing all packets with and without checking the message CRCs.
+ */
+void benchmarkCrcPolicy() {
+   printf("SmlParser::parseFrame (CRC policy)\n");
+   std::vector<MeterPackets> meters = createMeterPackets();
+   std::vector<std::vector<uint8_t> > packets;
+   for (const MeterPackets &meter : meters) {
+      packets.insert(packets.end(), meter.packets.begin(), meter.packets.end());
+   }
+   const SmlParser::CrcPolicy POLICIES[] = { SmlParser::CRC_FULL, SmlParser::CRC_TRANSPORT_ONLY };
+   const char *pNames[] = { "full", "transport only" };
+   double ns[2];
+   for (int i = 0; i < 2; ++i) {
+      SmlParser parser(false, POLICIES[i]);
+      uint32_t checksum = 0U;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int j = 0; j < REPETITIONS; ++j) {
+         for (const std::vector<uint8_t> &packet : packets) {
+            parser.parseFrame(packet.data(), (int)packet.size());
+            checksum += parser.getPowerIn() + (uint32_t)parser.getEnergyIn();
+         }
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      ns[i] = elapsed.count() * 1e9 / ((double)packets.size() * REPETITIONS);
+      printf("   %-14s %7.1f ns per packet (%u checks, %u skipped, checksum %08x)\n", pNames[i], ns[i],
+             (unsigned int)parser.getMessageCrcChecks(), (unsigned int)parser.getMessageCrcSkipped(), checksum);
+   }
+   printf("   speedup: %.2fx\n", ns[0] / ns[1]);
+}
+
+/**
+ * @brief Compare the time from the last byte of a packet to the parsed values: parsing the complete packet
+ *        against finishing the stream parser, which was updated with every received byte.
+ */
+void benchmarkStreamParser(const std::vector<uint8_t> &stream) {
+   printf("SmlStreamParser::finish (time after the last byte, stream fed byte by byte)\n");
+   SmlStreamReader reader(MAX_PACKET_SIZE);
+   SmlStreamParser streamParser;
+   SmlParser frameParser(false);
+   SmlParser cachedParser(true);
+   std::chrono::steady_clock::duration durations[3] = {};
+   uint32_t checksums[3] = {};
+   int packets = 0;
+   for (int i = 0; i < REPETITIONS / 10; ++i) {
+      for (uint8_t dataByte : stream) {
+         if (reader.addData(&dataByte, 1) < 0) {
+            streamParser.update(reader);
+            continue;
+         }
+         ++packets;
+         std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+         frameParser.parseFrame(reader.getData(), reader.getLength());
+         std::chrono::steady_clock::time_point frameEnd = std::chrono::steady_clock::now();
+         cachedParser.parseFrame(reader.getData(), reader.getLength());
+         std::chrono::steady_clock::time_point cachedEnd = std::chrono::steady_clock::now();
+         streamParser.finish(reader);
+         std::chrono::steady_clock::time_point streamEnd = std::chrono::steady_clock::now();
+         durations[0] += frameEnd - start;
+         durations[1] += cachedEnd - frameEnd;
+         durations[2] += streamEnd - cachedEnd;
+         checksums[0] += frameParser.getPowerIn() + (uint32_t)frameParser.getEnergyIn();
+         checksums[1] += cachedParser.getPowerIn() + (uint32_t)cachedParser.getEnergyIn();
+         checksums[2] += streamParser.getPowerIn() + (uint32_t)streamParser.getEnergyIn();
+      }
+   }
+   const char *pNames[] = { "parseFrame", "shape cache", "stream" };
+   double ns[3];
+   for (int i = 0; i < 3; ++i) {
+      ns[i] = std::chrono::duration<double>(durations[i]).count() * 1e9 / packets;
+      printf("   %-14s %7.1f ns per packet (%d packets, checksum %08x)\n", pNames[i], ns[i], packets, checksums[i]);
+   }
+   printf("   speedup: %.2fx, %.2fx, %u full parses\n", ns[0] / ns[1], ns[0] / ns[2], (unsigned int)streamParser.getFullParses());
+}
+
+/**
+ * @brief Replay an archive of frames (all demo packets, repeated) with the batch parser.
+ */
+void benchmarkBatchParser() {
+   printf("SmlBatchParser::parse (archive of frames, columnar results)\n");
+   std::vector<MeterPackets> meters = createMeterPackets();
+   std::vector<SmlFrame> frames;
+   for (int i = 0; i < REPETITIONS / 10; ++i) {
+      for (const MeterPackets &meter : meters) {
+         for (const std::vector<uint8_t> &packet : meter.packets) {
+            SmlFrame frame = {};
+            frame.pData = packet.data();
+            frame.length = (int)packet.size();
+            frames.push_back(frame);
+         }
+      }
+   }
+   std::vector<uint32_t> status(frames.size());
+   std::vector<int64_t> power(frames.size());
+   std::vector<int64_t> energy(frames.size());
+   SmlBatchColumns columns = {};
+   columns.pStatus = status.data();
+   columns.pValues[SML_POWER_SUM] = power.data();
+   columns.pValues[SML_ENERGY_IN] = energy.data();
+   int cores = (int)std::thread::hardware_concurrency();
+   double ns1 = 0.0;
+   for (int threads : { 1, (cores > 1) ? cores : 2 }) {
+      SmlBatchParser batchParser(threads);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      int parsedOk = batchParser.parse(frames.data(), (int)frames.size(), columns);
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      double ns = elapsed.count() * 1e9 / frames.size();
+      uint32_t checksum = 0U;
+      for (size_t i = 0; i < frames.size(); ++i) {
+         checksum += (uint32_t)power[i] + (uint32_t)energy[i];
+      }
+      ns1 = (threads == 1) ? ns : ns1;
+      printf("   %2d threads %7.1f ns per frame (%d frames, %d parsed, checksum %08x), speedup %.2fx\n", threads, ns,
+             (int)frames.size(), parsedOk, checksum, ns1 / ns);
+   }
+   printf("   %d hardware threads\n", cores);
+}
+
+/**
+ * @brief Compare rebuilding the SMA packet for every frame against patching a frozen layout in place.
+ */
+void benchmarkEmeterPacket() {
+   printf("EmeterPacket (rebuild vs. frozen layout)\n");
+   std::vector<MeterPackets> meters = createMeterPackets();
+   std::vector<SmlParser> parsers;
+   for (const MeterPackets &meter : meters) {
+      for (const std::vector<uint8_t> &packet : meter.packets) {
+         parsers.push_back(SmlParser());
+         parsers.back().parseFrame(packet.data(), (int)packet.size());
+      }
+   }
+   EmeterPacket rebuilt(1234U);
+   EmeterPacket frozen(1234U);
+   frozen.beginLayout();
+   frozen.addMeasurementChannel(EmeterPacket::SMA_POSITIVE_ACTIVE_POWER);
+   frozen.addMeasurementChannel(EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER);
+   frozen.addMeasurementChannel(EmeterPacket::SMA_POSITIVE_REACTIVE_POWER);
+   frozen.addMeasurementChannel(EmeterPacket::SMA_NEGATIVE_REACTIVE_POWER);
+   frozen.addCounterChannel(EmeterPacket::SMA_POSITIVE_ENERGY);
+   frozen.addCounterChannel(EmeterPacket::SMA_NEGATIVE_ENERGY);
+   frozen.endLayout();
+
+   uint32_t checksums[2] = {};
+   int mismatches = 0;
+   double ns[2];
+   for (int variant = 0; variant < 2; ++variant) {
+      EmeterPacket &packet = (variant == 0) ? rebuilt : frozen;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int i = 0; i < REPETITIONS; ++i) {
+         for (size_t j = 0; j < parsers.size(); ++j) {
+            const SmlParser &parser = parsers[j];
+            unsigned long timeStampMs = (unsigned long)(i * parsers.size() + j);
+            if (variant == 0) {
+               packet.begin(timeStampMs);
+               packet.addMeasurementValue(EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, parser.getPowerIn() / 10);
+               packet.addMeasurementValue(EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER, parser.getPowerOut() / 10);
+               packet.addMeasurementValue(EmeterPacket::SMA_POSITIVE_REACTIVE_POWER, 0);
+               packet.addMeasurementValue(EmeterPacket::SMA_NEGATIVE_REACTIVE_POWER, 0);
+               packet.addCounterValue(EmeterPacket::SMA_POSITIVE_ENERGY, parser.getEnergyIn() * 36UL);
+               packet.addCounterValue(EmeterPacket::SMA_NEGATIVE_ENERGY, parser.getEnergyOut() * 36UL);
+               packet.end();
+            }
+            else {
+               packet.setTimeStamp(timeStampMs);
+               packet.setMeasurementValue(0, parser.getPowerIn() / 10);
+               packet.setMeasurementValue(1, parser.getPowerOut() / 10);
+               packet.setCounterValue(4, parser.getEnergyIn() * 36UL);
+               packet.setCounterValue(5, parser.getEnergyOut() * 36UL);
+            }
+            checksums[variant] += packet.getData()[packet.getLength() - 13] + packet.getData()[31];
+         }
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      ns[variant] = elapsed.count() * 1e9 / ((double)parsers.size() * REPETITIONS);
+   }
+   // Both variants must render the same packet
+   if ((rebuilt.getLength() != frozen.getLength()) || (memcmp(rebuilt.getData(), frozen.getData(), rebuilt.getLength()) != 0)) {
+      ++mismatches;
+   }
+   printf("   rebuild        %7.1f ns per packet (checksum %08x)\n", ns[0], checksums[0]);
+   printf("   frozen layout  %7.1f ns per packet (checksum %08x)\n", ns[1], checksums[1]);
+   printf("   speedup: %.2fx%s\n", ns[0] / ns[1], mismatches == 0 ? "" : ", PACKET MISMATCH");
+}
+
+int main(int argc, char **argv) {
+   std::vector<uint8_t> stream = createStream();
+
+   benchmarkCrc(stream);
+   benchmarkReader(stream);
+   benchmarkTransport(stream);
+   benchmarkNoise(stream);
+   benchmarkParser();
+   benchmarkCrcPolicy();
+   benchmarkStreamParser(stream);
+   benchmarkBatchParser();
+   benchmarkEmeterPacket();
+
+   return 0;
+}
@@ -1,16 +1,29 @@
 #include <stdio.h>
 #include <string.h>
 #include <initializer_list>
+#include <vector>
+#if defined(__linux__)
+#  include <sys/resource.h>
+#endif
 #include "crc16ccitt.h"
 #include "smlparser.h"
+#include "smlcursor.h"
+#include "smlstreamreader.h"
+#include "smlstreamparser.h"
+#include "sml_batchparser.h"
+#include "sml_pipeline.h"
+#include "emeterpacket.h"
+#include "smlemetermapping.h"
+#include "smlaggregatemeter.h"
 #include "sml_testpacket.h"
+#include "sml_demodata.h"
 
 SmlParser smlParser;
 uint8_t smlPacket[SML_TEST_PACKET_LENGTH];
 
-class BaseDecodeTests : public SmlParser {
+class BaseDecodeTests {
 public:
-   BaseDecodeTests() : SmlParser(), _buffer{ 0 } {}
+   BaseDecodeTests() : _buffer{ 0 } {}
 
    int run() {
       int failed = 0;
@@ -40,21 +53,28 @@ public:
       failed += testIntegerDecoding(init({ 0x69, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }), 9223372036854775807);
       failed += testIntegerDecoding(init({ 0x69, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }), -1);
 
+      // Values at the end of the packet are decoded without the 8 byte load
+      failed += testIntegerDecoding(init({ 0x53, 0xc8, 0x7a }), -14214, 3);
+      failed += testIntegerDecoding(init({ 0x64, 0xff, 0x79, 0xf8 }), 16742904, 4);
+      failed += testIntegerDecoding(init({ 0x64, 0xff, 0x79, 0xf8 }), 0, 3);
+
       failed += testLengthDecoding(init({ 0x10 }), 0x0, 1, true);
       failed += testLengthDecoding(init({ 0x15 }), 0x5, 1, true);
       failed += testLengthDecoding(init({ 0x15 }), 0x5, 1, true);
-      failed += testLengthDecoding(init({ 0x81, 0x82, 0x83, 0x04 }), 0x1234, 4, true);
-      failed += testLengthDecoding(init({ 0x81, 0x82, 0x83, 0x04 }), 0x1234, 0, false);
+      failed += testLengthDecoding(init({ 0x81, 0x82, 0x83, 0x04 }), 0x1234, 4, false);
+      failed += testLengthDecoding(init({ 0x81, 0x82, 0x83 }), 0x123, 0, false, 3);
+
+      // List with a nested list: 72 (73 (62 01, 01, 52 ff), 63 12 34) 52 05
+      failed += testListIteration(init({ 0x72, 0x73, 0x62, 0x01, 0x01, 0x52, 0xff, 0x63, 0x12, 0x34, 0x52, 0x05 }), 12, true);
+      failed += testListIteration(init({ 0x72, 0x73, 0x62, 0x01, 0x01, 0x52, 0xff, 0x63, 0x12, 0x34, 0x52, 0x05 }), 10, false);
 
       return failed;
    }
 
-   int testIntegerDecoding(const uint8_t *pBuffer, int64_t expected) {
-      SmlParser::_pPacket = pBuffer;
-      SmlParser::_packetLength = 100;
-      int pos = 0;
+   int testIntegerDecoding(const uint8_t *pBuffer, int64_t expected, int length = 100) {
+      SmlCursor cursor(pBuffer, length);
 
-      int64_t value = getNextIntValue(pos);
+      int64_t value = cursor.getInt();
 
       printf("%s: Value expected %ld, got %ld\n",
              expected == value ? "OK" : "ERROR",
@@ -63,18 +83,30 @@ public:
       return (value == expected) ? 0 : 1;
    }
 
-   int testLengthDecoding(const uint8_t *pBuffer, uint16_t expectedLength, int expectedPos, bool updatePos) {
-      SmlParser::_pPacket = pBuffer;
-      SmlParser::_packetLength = 100;
-      int pos = 0;
+   int testLengthDecoding(const uint8_t *pBuffer, int expectedLength, int expectedHeaderLength, bool expectedValid, int length = 100) {
+      SmlCursor cursor(pBuffer, length);
 
-      uint16_t length = getLength(pos, updatePos);
-
-      bool testOk = (length == expectedLength) && (pos == expectedPos);
-      printf("%s: Length expected %u, got %u, position expected %d, got %d)\n",
+      bool testOk = (cursor.getLength() == expectedLength) && (cursor.getHeaderLength() == expectedHeaderLength) &&
+                    (cursor.isValid() == expectedValid);
+      printf("%s: Length expected %d, got %d, header length expected %d, got %d, valid %d)\n",
              testOk ? "OK" : "ERROR",
-             expectedLength, length,
-             expectedPos, pos);
+             expectedLength, cursor.getLength(),
+             expectedHeaderLength, cursor.getHeaderLength(),
+             cursor.isValid());
+
+      return testOk ? 0 : 1;
+   }
+
+   int testListIteration(const uint8_t *pBuffer, int length, bool complete) {
+      SmlCursor cursor(pBuffer, length);
+      SmlCursor list = cursor.getChildren();
+      SmlCursor nested = list.getChildren();
+      bool testOk = (cursor.getType() == SmlCursor::SML_LIST_ID) && (cursor.getLength() == 2) &&
+                    (nested.getInt() == 1) && nested.next() && nested.isOptional() && nested.next() && (nested.getInt() == -1) &&
+                    !nested.next() && list.next() && (list.getInt() == 0x1234) && !list.next();
+      // The element after the list is only available if the data is complete
+      testOk = testOk && (cursor.next() == complete) && (!complete || (cursor.getInt() == 5));
+      printf("%s: List iteration, %d bytes\n", testOk ? "OK" : "ERROR", length);
 
       return testOk ? 0 : 1;
    }
@@ -91,6 +123,23 @@ private:
    }
 };
 
+int testCrc(int length, uint16_t initState) {
+   Crc16Ccitt bytewise(initState);
+   Crc16Ccitt bulk(initState);
+   for (int i = 0; i < length; ++i) {
+      bytewise.calc(SML_TEST_PACKET[i]);
+   }
+   // Calculate the bulk CRC in two parts to check that a calculation can be continued from a saved state
+   bulk.calc(SML_TEST_PACKET, length / 3);
+   Crc16Ccitt resumed(bulk.getCrcState());
+   resumed.calc(SML_TEST_PACKET + length / 3, length - length / 3);
+
+   bool testOk = (bytewise.getCrc() == resumed.getCrc());
+   printf("%s: CRC of %d bytes, expected %04x, got %04x\n", testOk ? "OK" : "ERROR", length, bytewise.getCrc(), resumed.getCrc());
+
+   return testOk ? 0 : 1;
+}
+
 int checkResult(uint32_t powerInW, uint32_t powerOutW, uint64_t energyWh, uint32_t ok, uint32_t errors) {
    smlParser.parsePacket(smlPacket + 8, SML_TEST_PACKET_LENGTH - 8);
 
@@ -110,12 +159,657 @@ int checkResult(uint32_t powerInW, uint32_t powerOutW, uint64_t energyWh, uint32
    return testOk ? 0 : 1;
 }
 
+int testCrcPolicy(SmlParser::CrcPolicy crcPolicy, const char *pName) {
+   SmlParser parser(false, crcPolicy);
+   SmlStreamParser streamParser(crcPolicy);
+   bool checked = SmlParser::checksMessageCrc(crcPolicy);
+
+   uint8_t packet[SML_TEST_PACKET_LENGTH];
+   memcpy(packet, SML_TEST_PACKET, SML_TEST_PACKET_LENGTH);
+   bool parsedOk = parser.parsePacket(packet + 8, SML_TEST_PACKET_LENGTH - 8);
+   packet[30] ^= 0xff;
+   bool corruptedOk = parser.parsePacket(packet + 8, SML_TEST_PACKET_LENGTH - 8);
+   // Without the escape sequences at the start and the end
+   bool streamOk = streamParser.finish(1U, packet + 8, SML_TEST_PACKET_LENGTH - 16);
+
+   // The stream parser only discards the corrupted message
+   bool testOk = parsedOk && (corruptedOk != checked) && streamOk &&
+                 (streamParser.getFrameInfo().crcErrors == (checked ? 1 : 0)) && (streamParser.getFullParses() == 0U) &&
+                 (parser.getMessageCrcErrors() == (checked ? 1U : 0U)) &&
+                 (streamParser.getMessageCrcErrors() == (checked ? 1U : 0U)) &&
+                 ((parser.getMessageCrcChecks() > 0U) == checked) && ((parser.getMessageCrcSkipped() > 0U) != checked);
+   printf("%s: CRC policy %s, corrupted message parsed %d/%d, %u checks, %u errors, %u skipped\n", testOk ? "OK" : "ERROR", pName,
+          corruptedOk, streamOk, parser.getMessageCrcChecks(), parser.getMessageCrcErrors(), parser.getMessageCrcSkipped());
+   return testOk ? 0 : 1;
+}
+
+int testObisTable() {
+   int errors = 0;
+   for (int i = 0; i < SmlObisTable::ENTRY_COUNT; ++i) {
+      if (SmlObisTable::find(SmlObisTable::ENTRIES[i].code) != &SmlObisTable::ENTRIES[i]) {
+         ++errors;
+      }
+   }
+   const uint8_t unknownCode[SmlObisTable::OBIS_LENGTH] = { 0x01, 0x00, 0x01, 0x07, 0x01, 0xff };
+   if (SmlObisTable::find(unknownCode) != NULL) {
+      ++errors;
+   }
+   const uint8_t otherMedium[SmlObisTable::OBIS_LENGTH] = { 0x07, 0x00, 0x01, 0x08, 0x00, 0xff };
+   if (SmlObisTable::find(otherMedium) != NULL) {
+      ++errors;
+   }
+   // The channel (B) and F are ignored like in the original parser
+   const uint8_t otherChannel[SmlObisTable::OBIS_LENGTH] = { 0x01, 0x01, 0x01, 0x08, 0x00, 0x00 };
+   if ((SmlObisTable::find(otherChannel) == NULL) || (SmlObisTable::find(otherChannel)->slot != SML_ENERGY_IN)) {
+      ++errors;
+   }
+   printf("%s: OBIS table, %d entries, multiplier %08x, %d errors\n", errors == 0 ? "OK" : "ERROR",
+          SmlObisTable::ENTRY_COUNT, SmlObisTable::HASH_MULTIPLIER, errors);
+   return errors;
+}
+
+int checkSlot(const SmlParser &parser, SmlValueSlot slot, const char *pName, int64_t expected) {
+   bool testOk = parser.hasValue(slot) && (parser.getValue(slot) == expected);
+   printf("%s: %s, expected %lld, got %lld\n", testOk ? "OK" : "ERROR", pName, (long long)expected, (long long)parser.getValue(slot));
+   return testOk ? 0 : 1;
+}
+
+int testValueSlots() {
+   SmlStreamReader reader(1000);
+   SmlParser parser;
+   int failed = 0;
+
+   if ((reader.addData(HOLLEY_DTZ541_ZDBA_1, HOLLEY_DTZ541_ZDBA_1_LENGTH) < 0) ||
+       !parser.parsePacket(reader.getData(), reader.getLength())) {
+      printf("ERROR: Parsing of HOLLEY_DTZ541_ZDBA_1 failed\n");
+      return 1;
+   }
+   failed += checkSlot(parser, SML_POWER_SUM, "Power (16.7.0)", 46000);
+   failed += checkSlot(parser, SML_ENERGY_IN_T2, "Energy in T2 (1.8.2)", 17736010);
+   failed += checkSlot(parser, SML_ENERGY_OUT, "Energy out (2.8.0)", 31492600);
+   failed += checkSlot(parser, SML_VOLTAGE_L1, "Voltage L1 (32.7.0)", 232300);
+   failed += checkSlot(parser, SML_VOLTAGE_L3, "Voltage L3 (72.7.0)", 232500);
+   failed += checkSlot(parser, SML_CURRENT_L1, "Current L1 (31.7.0)", 1060);
+   failed += checkSlot(parser, SML_CURRENT_L2, "Current L2 (51.7.0)", 1740);
+   bool testOk = (parser.getPowerIn() == 46000U) && (parser.getPowerOut() == 0U) && !parser.hasValue(SML_POWER_L1);
+   printf("%s: Power in %u, power out %u, power L1 %s\n", testOk ? "OK" : "ERROR",
+          parser.getPowerIn(), parser.getPowerOut(), parser.hasValue(SML_POWER_L1) ? "received" : "not received");
+   failed += testOk ? 0 : 1;
+
+   // A meter, which sends the power as 1-1:16.7.0*0 (the message CRC isn't updated, so it's not checked)
+   std::vector<uint8_t> otherChannel(reader.getData(), reader.getData() + reader.getLength());
+   const uint8_t POWER_SUM_CODE[] = { 0x07, 0x01, 0x00, 0x10, 0x07, 0x00, 0xff };
+   int patched = 0;
+   for (size_t i = 0; i + sizeof(POWER_SUM_CODE) <= otherChannel.size(); ++i) {
+      if (memcmp(&otherChannel[i], POWER_SUM_CODE, sizeof(POWER_SUM_CODE)) == 0) {
+         otherChannel[i + 2] = 0x01;
+         otherChannel[i + 6] = 0x00;
+         ++patched;
+      }
+   }
+   SmlParser otherChannelParser(true, SmlParser::CRC_NONE);
+   testOk = (patched == 1) && otherChannelParser.parsePacket(otherChannel.data(), (int)otherChannel.size()) &&
+            (otherChannelParser.getPowerIn() == 46000U);
+   printf("%s: Power in of 1-1:16.7.0*0 %u\n", testOk ? "OK" : "ERROR", otherChannelParser.getPowerIn());
+   failed += testOk ? 0 : 1;
+   return failed;
+}
+
+int testShapeCache(bool frame) {
+   SmlStreamReader reader(1000);
+   SmlParser cachedParser;
+   SmlParser fullParser(false);
+   int packets = 0;
+   int errors = 0;
+
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      while (length > 0) {
+         int result = reader.addData(pData, length);
+         if (result < 0) {
+            break;
+         }
+         pData += result;
+         length -= result;
+         ++packets;
+         bool cachedOk = frame ? cachedParser.parseFrame(reader.getData(), reader.getLength()) :
+                                 cachedParser.parsePacket(reader.getData(), reader.getLength());
+         bool fullOk = frame ? fullParser.parseFrame(reader.getData(), reader.getLength()) :
+                               fullParser.parsePacket(reader.getData(), reader.getLength());
+         bool equal = (cachedOk == fullOk) && (cachedParser.getPowerIn() == fullParser.getPowerIn()) &&
+                      (cachedParser.getPowerOut() == fullParser.getPowerOut()) &&
+                      (!frame || (memcmp(&cachedParser.getFrameInfo(), &fullParser.getFrameInfo(), sizeof(SmlFrameInfo)) == 0));
+         for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+            equal = equal && (cachedParser.hasValue((SmlValueSlot)slot) == fullParser.hasValue((SmlValueSlot)slot)) &&
+                    (cachedParser.getValue((SmlValueSlot)slot) == fullParser.getValue((SmlValueSlot)slot));
+         }
+         if (!equal) {
+            printf("ERROR: Shape cache, %s differs\n", SML_DATA[i].name);
+            ++errors;
+         }
+      }
+   }
+   bool testOk = (errors == 0) && (cachedParser.getParsedOk() == fullParser.getParsedOk()) &&
+                 (cachedParser.getParseErrors() == fullParser.getParseErrors()) && (cachedParser.getShapeHits() > 0U);
+   printf("%s: Shape cache (%s), %d packets, %u hits, %u misses, %d errors\n", testOk ? "OK" : "ERROR",
+          frame ? "frame" : "packet", packets,
+          cachedParser.getShapeHits(), cachedParser.getShapeMisses(), errors);
+   return testOk ? 0 : 1;
+}
+
+/**
+ * @brief Copy the messages of a packet (without the end of message marker) and return the new length.
+ */
+int appendMessages(uint8_t *pFrame, int frameLength, const uint8_t *pPacket, int packetLength, int first, int count) {
+   SmlCursor message(pPacket, packetLength);
+   message.skip(first);
+   for (int i = 0; (i < count) && message.isValid() && !message.isEndOfMessage(); ++i) {
+      const uint8_t *pStart = message.getElement();
+      message.next();
+      memcpy(pFrame + frameLength, pStart, message.getElement() - pStart);
+      frameLength += (int)(message.getElement() - pStart);
+   }
+   return frameLength;
+}
+
+int testFrame() {
+   SmlStreamReader reader(1000);
+   uint8_t holley[1000];
+   uint8_t dzg[1000];
+   int holleyLength = (reader.addData(HOLLEY_DTZ541_ZDBA_1, HOLLEY_DTZ541_ZDBA_1_LENGTH) >= 0) ? reader.getLength() : 0;
+   memcpy(holley, reader.getData(), holleyLength);
+   int dzgLength = (reader.addData(DZG_DWS74_1, DZG_DWS74_1_LENGTH) >= 0) ? reader.getLength() : 0;
+   memcpy(dzg, reader.getData(), dzgLength);
+   int failed = 0;
+
+   // Single frame: the status of all messages and the meta data is collected
+   SmlParser parser;
+   bool parsedOk = parser.parseFrame(holley, holleyLength);
+   const SmlFrameInfo &info = parser.getFrameInfo();
+   bool testOk = parsedOk && (info.messageCount == 3) && (info.crcErrors == 0) && (info.listResponses == 1) &&
+                 info.openResponse && info.closeResponse && (info.serverIdLength == 10) &&
+                 (memcmp(info.serverId, "\x0a\x01HLY", 5) == 0) && (info.timeType == SmlFrameInfo::SML_TIME_NONE);
+   printf("%s: Frame, %d messages, %d lists, open %d, close %d, server id length %d, time type %d, time %u\n", testOk ? "OK" : "ERROR",
+          info.messageCount, info.listResponses, info.openResponse, info.closeResponse, info.serverIdLength, info.timeType, info.time);
+   failed += testOk ? 0 : 1;
+
+   // The time of the meter is read from the list response and the cached layout returns the same information
+   SmlParser dzgFrameParser;
+   dzgFrameParser.parseFrame(dzg, dzgLength);
+   const SmlFrameInfo &dzgInfo = dzgFrameParser.getFrameInfo();
+   SmlFrameInfo first = dzgInfo;
+   dzgFrameParser.parseFrame(dzg, dzgLength);
+   testOk = (dzgFrameParser.getShapeHits() == 1U) && (memcmp(&first, &dzgInfo, sizeof(first)) == 0) &&
+            (dzgInfo.timeType == SmlFrameInfo::SML_TIME_SEC_INDEX) && (dzgInfo.time == 1943210U);
+   printf("%s: Frame from shape cache, %u hits, time type %d, time %u\n", testOk ? "OK" : "ERROR",
+          dzgFrameParser.getShapeHits(), dzgInfo.timeType, dzgInfo.time);
+   failed += testOk ? 0 : 1;
+
+   // A wrong CRC in the open response only discards this message
+   holley[20] ^= 0xff;
+   SmlParser packetParser;
+   SmlParser frameParser;
+   bool packetOk = packetParser.parsePacket(holley, holleyLength);
+   bool frameOk = frameParser.parseFrame(holley, holleyLength);
+   testOk = !packetOk && frameOk && (frameParser.getFrameInfo().crcErrors == 1) && !frameParser.getFrameInfo().messages[0].crcOk &&
+            frameParser.getFrameInfo().messages[1].crcOk && (frameParser.getValue(SML_POWER_SUM) == 46000) &&
+            (frameParser.getParsedOk() == 1U) && (frameParser.getParseErrors() == 1U);
+   printf("%s: Frame with CRC error, parsePacket %d, parseFrame %d, %d CRC errors\n", testOk ? "OK" : "ERROR",
+          packetOk, frameOk, frameParser.getFrameInfo().crcErrors);
+   failed += testOk ? 0 : 1;
+   holley[20] ^= 0xff;
+
+   // Values split across two list responses
+   uint8_t frame[2000];
+   int frameLength = appendMessages(frame, 0, holley, holleyLength, 0, 2);
+   frameLength = appendMessages(frame, frameLength, dzg, dzgLength, 1, 1);
+   frameLength = appendMessages(frame, frameLength, holley, holleyLength, 2, 1);
+   SmlParser holleyParser;
+   SmlParser dzgParser;
+   holleyParser.parsePacket(holley, holleyLength);
+   dzgParser.parsePacket(dzg, dzgLength);
+   packetParser = SmlParser();
+   frameParser = SmlParser();
+   packetParser.parsePacket(frame, frameLength);
+   frameParser.parseFrame(frame, frameLength);
+   int errors = 0;
+   for (int i = 0; i < SML_VALUE_SLOTS; ++i) {
+      SmlValueSlot slot = (SmlValueSlot)i;
+      const SmlParser &expected = dzgParser.hasValue(slot) ? dzgParser : holleyParser;
+      if ((frameParser.hasValue(slot) != expected.hasValue(slot)) || (frameParser.getValue(slot) != expected.getValue(slot)) ||
+          (packetParser.hasValue(slot) != holleyParser.hasValue(slot)) || (packetParser.getValue(slot) != holleyParser.getValue(slot))) {
+         ++errors;
+      }
+   }
+   testOk = (errors == 0) && (frameParser.getFrameInfo().listResponses == 2) && (frameParser.getFrameInfo().messageCount == 4);
+   printf("%s: Frame with two list responses, %d lists, %d errors\n", testOk ? "OK" : "ERROR",
+          frameParser.getFrameInfo().listResponses, errors);
+   failed += testOk ? 0 : 1;
+
+   return failed;
+}
+
+int testStreamParser(int chunkSize) {
+   SmlStreamReader reader(1000);
+   SmlStreamParser streamParser;
+   SmlParser frameParser(false);
+   int packets = 0;
+   int errors = 0;
+
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      while (length > 0) {
+         int chunkLength = (length < chunkSize) ? length : chunkSize;
+         int result = reader.addData(pData, chunkLength);
+         if (result < 0) {
+            streamParser.update(reader);
+            pData += chunkLength;
+            length -= chunkLength;
+            continue;
+         }
+         pData += result;
+         length -= result;
+         ++packets;
+         bool streamOk = streamParser.finish(reader);
+         bool frameOk = frameParser.parseFrame(reader.getData(), reader.getLength());
+         bool equal = (streamOk == frameOk) && (streamParser.getPowerIn() == frameParser.getPowerIn()) &&
+                      (streamParser.getPowerOut() == frameParser.getPowerOut()) &&
+                      (memcmp(&streamParser.getFrameInfo(), &frameParser.getFrameInfo(), sizeof(SmlFrameInfo)) == 0);
+         for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+            equal = equal && (streamParser.hasValue((SmlValueSlot)slot) == frameParser.hasValue((SmlValueSlot)slot)) &&
+                    (streamParser.getValue((SmlValueSlot)slot) == frameParser.getValue((SmlValueSlot)slot));
+         }
+         if (!equal) {
+            printf("ERROR: Stream parser, %s differs\n", SML_DATA[i].name);
+            ++errors;
+         }
+      }
+   }
+   bool testOk = (errors == 0) && (streamParser.getParsedOk() == frameParser.getParsedOk()) &&
+                 (streamParser.getParseErrors() == frameParser.getParseErrors()) && (streamParser.getFullParses() == 0U) &&
+                 (streamParser.getMessageCrcChecks() == frameParser.getMessageCrcChecks()) &&
+                 (streamParser.getMessageCrcErrors() == frameParser.getMessageCrcErrors()) &&
+                 (streamParser.getMessageCrcSkipped() == frameParser.getMessageCrcSkipped());
+   printf("%s: Stream parser, chunk size %d, %d packets, %u parsed, %u full parses, %d errors\n", testOk ? "OK" : "ERROR",
+          chunkSize, packets, streamParser.getParsedOk(), streamParser.getFullParses(), errors);
+   return testOk ? 0 : 1;
+}
+
+int testStreamParserTransportCrc() {
+   SmlStreamReader reader(1000);
+   SmlStreamParser streamParser;
+   SmlParser frameParser(false);
+   uint8_t corrupted[HOLLEY_DTZ541_ZDBA_1_LENGTH];
+   memcpy(corrupted, HOLLEY_DTZ541_ZDBA_1, HOLLEY_DTZ541_ZDBA_1_LENGTH);
+   corrupted[30] ^= 0xff;
+
+   // The corrupted packet is rejected by the transport CRC, so its messages must not be counted
+   int packets = 0;
+   for (const uint8_t *pPacket : { (const uint8_t *)corrupted, HOLLEY_DTZ541_ZDBA_1 }) {
+      const uint8_t *pData = pPacket;
+      int length = HOLLEY_DTZ541_ZDBA_1_LENGTH;
+      while (length > 0) {
+         int chunkLength = (length < 7) ? length : 7;
+         int result = reader.addData(pData, chunkLength);
+         if (result < 0) {
+            streamParser.update(reader);
+            pData += chunkLength;
+            length -= chunkLength;
+            continue;
+         }
+         pData += result;
+         length -= result;
+         ++packets;
+         streamParser.finish(reader);
+         frameParser.parseFrame(reader.getData(), reader.getLength());
+      }
+   }
+   bool testOk = (packets == 1) && (reader.getParseErrors() == 1U) && (streamParser.getParsedOk() == 1U) &&
+                 (streamParser.getMessageCrcErrors() == 0U) &&
+                 (streamParser.getMessageCrcChecks() == frameParser.getMessageCrcChecks());
+   printf("%s: Stream parser, transport CRC error, %d packets, %u message CRC checks, %u message CRC errors\n",
+          testOk ? "OK" : "ERROR", packets, streamParser.getMessageCrcChecks(), streamParser.getMessageCrcErrors());
+   return testOk ? 0 : 1;
+}
+
+int testBatchParser(int threads) {
+   static uint8_t buffer[100000];
+   static SmlFrame frames[200];
+   static uint32_t status[200];
+   static int64_t values[SML_VALUE_SLOTS][200];
+   SmlStreamReader reader(1000);
+   int frameCount = 0;
+   int bufferLength = 0;
+
+   // Decode all packets of the demo data into an archive of frames
+   for (int i = 0; (i < SML_DATA_LENGTH) && (frameCount < 200); ++i) {
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      int result;
+      while ((length > 0) && ((result = reader.addData(pData, length)) >= 0) && (frameCount < 200)) {
+         pData += result;
+         length -= result;
+         if (bufferLength + reader.getLength() > (int)sizeof(buffer)) {
+            break;
+         }
+         memcpy(buffer + bufferLength, reader.getData(), reader.getLength());
+         frames[frameCount].pData = buffer + bufferLength;
+         frames[frameCount].length = reader.getLength();
+         bufferLength += reader.getLength();
+         ++frameCount;
+      }
+   }
+
+   SmlBatchParser batchParser(threads);
+   SmlBatchColumns columns = {};
+   columns.pStatus = status;
+   for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+      columns.pValues[slot] = values[slot];
+   }
+   int parsedOk = batchParser.parse(frames, frameCount, columns);
+
+   // Every frame must have the same result as a sequential parser
+   SmlParser frameParser;
+   int expectedOk = 0;
+   int errors = 0;
+   for (int i = 0; i < frameCount; ++i) {
+      bool ok = frameParser.parseFrame(frames[i].pData, frames[i].length);
+      expectedOk += ok ? 1 : 0;
+      bool equal = (((status[i] & SML_BATCH_PARSED) != 0) == ok) &&
+                   (((status[i] & SML_BATCH_CRC_ERROR) != 0) == (frameParser.getFrameInfo().crcErrors > 0)) &&
+                   ((status[i] & SML_BATCH_SLOT_MASK) == (ok ? frameParser.getPacketSlots() : 0U));
+      for (int slot = 0; slot < SML_VALUE_SLOTS; ++slot) {
+         bool received = (status[i] & (1U << slot)) != 0;
+         equal = equal && (values[slot][i] == (received ? frameParser.getValue((SmlValueSlot)slot) : 0));
+      }
+      if (!equal) {
+         printf("ERROR: Batch parser, frame %d differs\n", i);
+         ++errors;
+      }
+   }
+   bool testOk = (errors == 0) && (parsedOk == expectedOk) && (frameCount > 0) &&
+                 (batchParser.parse(frames, frameCount, columns) == parsedOk);
+   printf("%s: Batch parser, %d threads, %d frames, %d parsed, %d errors\n", testOk ? "OK" : "ERROR",
+          batchParser.getThreadCount(), frameCount, parsedOk, errors);
+   return testOk ? 0 : 1;
+}
+
+int testPipeline() {
+   // Count the packets of the demo data
+   SmlStreamReader reader(1000);
+   int packets = 0;
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      int result;
+      while ((length > 0) && ((result = reader.addData(pData, length)) >= 0)) {
+         pData += result;
+         length -= result;
+         ++packets;
+      }
+   }
+
+   // Feed the demo data in chunks of 100 bytes, with a pause after every block (like a meter)
+   int dataIndex = 0;
+   int dataPos = 0;
+   SmlPipeline pipeline([&](uint8_t *pBuffer, int size) {
+      if (dataIndex >= SML_DATA_LENGTH) {
+         return -1;
+      }
+      int length = SML_DATA[dataIndex].length - dataPos;
+      length = (length < size) ? length : size;
+      length = (length < 100) ? length : 100;
+      memcpy(pBuffer, SML_DATA[dataIndex].data + dataPos, length);
+      dataPos += length;
+      if (dataPos >= SML_DATA[dataIndex].length) {
+         ++dataIndex;
+         dataPos = 0;
+         std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+      return length;
+   });
+
+   // Every published frame must have the same values as a sequential parser
+   SmlParser frameParser;
+   int errors = 0;
+   pipeline.addPublisher([&](const SmlPipelineFrame &frame) {
+      bool ok = frameParser.parseFrame(frame.data.data(), frame.length);
+      bool equal = (ok == frame.parsedOk) && (!ok || (frame.parser.getPacketSlots() == frameParser.getPacketSlots()));
+      for (int slot = 0; ok && (slot < SML_VALUE_SLOTS); ++slot) {
+         if (frameParser.getPacketSlots() & (1U << slot)) {
+            equal = equal && (frame.parser.getValue((SmlValueSlot)slot) == frameParser.getValue((SmlValueSlot)slot));
+         }
+      }
+      errors += equal ? 0 : 1;
+   });
+   // A slow publisher must not block the other stages, it misses frames instead
+   pipeline.addPublisher([](const SmlPipelineFrame &frame) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+   });
+   pipeline.start();
+   pipeline.join();
+
+   SmlPipelineStats ingest = pipeline.getIngestStats();
+   SmlPipelineStats decode = pipeline.getDecodeStats();
+   SmlPipelineStats fast = pipeline.getPublisherStats(0);
+   SmlPipelineStats slow = pipeline.getPublisherStats(1);
+   // The snapshot for other threads contains the state of the parser after the last frame
+   SmlParser snapshot;
+   pipeline.getParserSnapshot(snapshot);
+   errors += ((snapshot.getParsedOk() == decode.frames) && (pipeline.getReaderStats().parseErrors == 0U)) ? 0 : 1;
+   // Whether frames are dropped depends on the scheduling of the threads, but every frame must be accounted for
+   bool testOk = (errors == 0) && (packets > 0) && (ingest.frames + ingest.drops == (uint32_t)packets) && (ingest.frames > 0U) &&
+                 (decode.frames == ingest.frames) && (fast.frames > 0U) && (fast.frames + fast.drops == decode.frames) &&
+                 (slow.frames + slow.drops == decode.frames) && (slow.maxQueueDepth <= SmlPipeline::PUBLISHER_QUEUE_SIZE) &&
+                 !pipeline.isRunning();
+   printf("%s: Pipeline, %d packets, %u decoded, %u/%u published (fast), %u/%u published (slow), %d errors\n",
+          testOk ? "OK" : "ERROR", packets, decode.frames, fast.frames, decode.frames, slow.frames, decode.frames, errors);
+   return testOk ? 0 : 1;
+}
+
+int testPipelineIdle() {
+#if defined(__linux__)
+   // Between two packets of a meter, the stages must block instead of polling their queues
+   std::atomic<bool> done(false);
+   SmlPipeline pipeline([&](uint8_t *pBuffer, int size) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      return done ? -1 : 0;
+   });
+   pipeline.addPublisher([](const SmlPipelineFrame &frame) {});
+   pipeline.addPublisher([](const SmlPipelineFrame &frame) {});
+   pipeline.start();
+   std::this_thread::sleep_for(std::chrono::milliseconds(20));
+   struct rusage before;
+   struct rusage after;
+   getrusage(RUSAGE_SELF, &before);
+   std::this_thread::sleep_for(std::chrono::milliseconds(300));
+   getrusage(RUSAGE_SELF, &after);
+   done = true;
+   pipeline.join();
+   // Only the source wakes up (every 50 ms), polling stages would wake up thousands of times
+   long wakeups = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+   bool testOk = (wakeups < 50) && !pipeline.isRunning();
+   printf("%s: Pipeline idle, %ld context switches in 300 ms\n", testOk ? "OK" : "ERROR", wakeups);
+   return testOk ? 0 : 1;
+#else
+   return 0;
+#endif
+}
+
+/**
+ * @brief Find the value of a measurement channel in a rendered energy meter packet.
+ */
+uint32_t getMeasurementValue(const EmeterPacket &packet, uint32_t id) {
+   for (int i = 28; i + 8 <= packet.getLength(); i += 4) {
+      const uint8_t *pData = packet.getData() + i;
+      if (((uint32_t)pData[0] << 24 | (uint32_t)pData[1] << 16 | (uint32_t)pData[2] << 8 | pData[3]) == id) {
+         return (uint32_t)pData[4] << 24 | (uint32_t)pData[5] << 16 | (uint32_t)pData[6] << 8 | pData[7];
+      }
+   }
+   return 0xffffffffU;
+}
+
+int testEmeterMapping() {
+   SmlStreamReader reader(1000);
+   SmlParser parser;
+   if ((reader.addData(HOLLEY_DTZ541_ZDBA_1, HOLLEY_DTZ541_ZDBA_1_LENGTH) < 0) ||
+       !parser.parsePacket(reader.getData(), reader.getLength())) {
+      printf("ERROR: Parsing of HOLLEY_DTZ541_ZDBA_1 failed\n");
+      return 1;
+   }
+   EmeterPacket packet(1234U);
+   SmlEmeterMapping mapping;
+   mapping.update(packet, parser);
+
+   uint32_t packetVoltage = getMeasurementValue(packet, EmeterPacket::phaseId(EmeterPacket::SMA_VOLTAGE, 1));
+   // Only values of the meter are part of the packet (0 would mean e.g. 0 Hz or cos phi = 0)
+   const uint32_t MISSING = 0xffffffffU;
+   bool onlyMeterValues = (getMeasurementValue(packet, EmeterPacket::SMA_POWER_FACTOR) == MISSING) &&
+                          (getMeasurementValue(packet, EmeterPacket::SMA_POSITIVE_REACTIVE_POWER) == MISSING) &&
+                          (getMeasurementValue(packet, EmeterPacket::phaseId(EmeterPacket::SMA_POSITIVE_ACTIVE_POWER, 1)) == MISSING) &&
+                          !parser.hasValue(SML_POWER_L1) && (mapping.getChannel(7) < 0) &&
+                          (getMeasurementValue(packet, EmeterPacket::SMA_FREQUENCY) == (uint32_t)parser.getValue(SML_FREQUENCY));
+   uint64_t values[SmlEmeterMapping::ENTRY_COUNT];
+   for (int i = 0; i < SmlEmeterMapping::ENTRY_COUNT; ++i) {
+      values[i] = (mapping.getChannel(i) >= 0) ? packet.getChannelValue(mapping.getChannel(i)) : 0U;
+   }
+   // Entries: 0/1 power (16.7.0), 5 energy out, 9 current L1, 10 voltage L1, 13 current L2
+   bool testOk = (packet.getChannelCount() == 10) && (packet.getLength() == 124) && (values[0] == 4600U) &&
+                 (values[1] == 0U) && (values[5] == 31492600ULL * 36U) && (values[9] == 1060U) &&
+                 (values[10] == 232300U) && (values[13] == 1740U) && (packetVoltage == 232300U) && onlyMeterValues;
+   printf("%s: Emeter mapping, %d channels, length %d, power %u, voltage L1 %u\n", testOk ? "OK" : "ERROR",
+          packet.getChannelCount(), packet.getLength(), (unsigned int)values[0], packetVoltage);
+
+   // A meter with other values changes the layout
+   SmlStreamReader otherReader(1000);
+   bool changedOk = (otherReader.addData(EMH_EHZ_GW8E2A500AK2_1, EMH_EHZ_GW8E2A500AK2_1_LENGTH) >= 0) &&
+                    parser.parsePacket(otherReader.getData(), otherReader.getLength());
+   mapping.update(packet, parser);
+   changedOk = changedOk && ((mapping.getLayoutSlots() & ~parser.getPacketSlots()) == 0U) &&
+               (getMeasurementValue(packet, EmeterPacket::phaseId(EmeterPacket::SMA_VOLTAGE, 1)) == MISSING) &&
+               (packet.getChannelCount() == 1) && (packet.getLength() == 48);
+   printf("%s: Emeter mapping, changed values, %d channels, length %d\n", changedOk ? "OK" : "ERROR",
+          packet.getChannelCount(), packet.getLength());
+   return (testOk && changedOk) ? 0 : 1;
+}
+
+int testEmeterPacketInit() {
+   SmlStreamReader reader(1000);
+   SmlParser parser;
+   if ((reader.addData(HOLLEY_DTZ541_ZDBA_1, HOLLEY_DTZ541_ZDBA_1_LENGTH) < 0) ||
+       !parser.parsePacket(reader.getData(), reader.getLength())) {
+      printf("ERROR: Parsing of HOLLEY_DTZ541_ZDBA_1 failed\n");
+      return 1;
+   }
+   SmlEmeterMapping mapping;
+   EmeterPacket packet(1234U);
+   packet.setTimeStamp(1000UL);
+   mapping.update(packet, parser);
+
+   // A new serial number (e.g. a changed configuration) must keep the frozen layout valid
+   packet.init(5678U);
+   packet.setTimeStamp(2000UL);
+   mapping.update(packet, parser);
+
+   EmeterPacket expected(5678U);
+   expected.setTimeStamp(2000UL);
+   mapping.update(expected, parser);
+
+   const uint8_t *pData = packet.getData();
+   uint16_t dataSize = (uint16_t)(pData[12] << 8 | pData[13]);
+   bool testOk = packet.isFrozen() && (packet.getLength() == expected.getLength()) && (dataSize == packet.getLength() - 20) &&
+                 (memcmp(pData, expected.getData(), expected.getLength()) == 0);
+   printf("%s: Emeter packet init with frozen layout, length %d, data size %u\n", testOk ? "OK" : "ERROR",
+          packet.getLength(), dataSize);
+   return testOk ? 0 : 1;
+}
+
+int testAggregateMeter() {
+   SmlStreamReader reader(1000);
+   SmlParser gridParser;
+   SmlParser heatPumpParser;
+   if ((reader.addData(HOLLEY_DTZ541_ZDBA_1, HOLLEY_DTZ541_ZDBA_1_LENGTH) < 0) ||
+       !gridParser.parsePacket(reader.getData(), reader.getLength()) ||
+       !heatPumpParser.parsePacket(SML_TEST_PACKET + 8, SML_TEST_PACKET_LENGTH - 8)) {
+      printf("ERROR: Parsing of the aggregate inputs failed\n");
+      return 1;
+   }
+   int64_t gridPower = gridParser.hasValue(SML_POWER_SUM) ? gridParser.getValue(SML_POWER_SUM) :
+                       gridParser.getValue(SML_POWER_IN) - gridParser.getValue(SML_POWER_OUT);
+   int64_t heatPumpPower = heatPumpParser.hasValue(SML_POWER_SUM) ? heatPumpParser.getValue(SML_POWER_SUM) :
+                           heatPumpParser.getValue(SML_POWER_IN) - heatPumpParser.getValue(SML_POWER_OUT);
+   int64_t power = gridPower - heatPumpPower;
+   int64_t energyIn = gridParser.getValue(SML_ENERGY_IN) - heatPumpParser.getValue(SML_ENERGY_IN);
+
+   SmlAggregateMeter aggregate(4711U, 5000UL);
+   int grid = aggregate.addInput(1);
+   int heatPump = aggregate.addInput(-1);
+
+   // The packet is only updated, if both inputs are available and within the staleness window
+   bool missing = aggregate.update(grid, gridParser, 1000UL);
+   bool complete = aggregate.update(heatPump, heatPumpParser, 1500UL);
+   bool valuesOk = (aggregate.getValue(SML_POWER_SUM) == power) &&
+                   (aggregate.getValue(SML_ENERGY_IN) == ((energyIn > 0) ? energyIn : 0)) &&
+                   !aggregate.hasValue(SML_POWER_IN) &&
+                   (aggregate.hasValue(SML_CURRENT_L1) == heatPumpParser.hasValue(SML_CURRENT_L1)) &&
+                   (aggregate.hasValue(SML_VOLTAGE_L1) && (aggregate.getValue(SML_VOLTAGE_L1) == gridParser.getValue(SML_VOLTAGE_L1)));
+   const EmeterPacket &packet = aggregate.getPacket();
+   uint32_t positivePower = getMeasurementValue(packet, EmeterPacket::SMA_POSITIVE_ACTIVE_POWER);
+   uint32_t negativePower = getMeasurementValue(packet, EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER);
+   bool packetOk = (positivePower == (uint32_t)((power > 0) ? power / 10 : 0)) &&
+                   (negativePower == (uint32_t)((power < 0) ? -power / 10 : 0)) &&
+                   (packet.getData()[20] == 0) && (packet.getData()[22] == 0x12) && (packet.getData()[23] == 0x67);
+   bool stale = aggregate.update(heatPump, heatPumpParser, 7000UL);
+   // A stale aggregate doesn't keep the sums of the last update in the packet
+   bool staleCleared = ((positivePower != 0U) || (negativePower != 0U)) &&
+                       (getMeasurementValue(packet, EmeterPacket::SMA_POSITIVE_ACTIVE_POWER) == 0U) &&
+                       (getMeasurementValue(packet, EmeterPacket::SMA_NEGATIVE_ACTIVE_POWER) == 0U);
+   // Repeated updates replace the contribution of the input
+   bool updated = aggregate.update(grid, gridParser, 7100UL) && aggregate.update(grid, gridParser, 7200UL);
+
+   // A value, which is missing in the next packet of an input, doesn't contribute any more and is removed from the packet
+   SmlAggregateMeter currentSum(4712U, 5000UL);
+   int first = currentSum.addInput(1);
+   int second = currentSum.addInput(1);
+   SmlParser firstParser;
+   SmlParser secondParser;
+   bool fedBoth = firstParser.parsePacket(reader.getData(), reader.getLength()) &&
+                  secondParser.parsePacket(reader.getData(), reader.getLength()) &&
+                  !currentSum.update(first, firstParser, 1000UL) && currentSum.update(second, secondParser, 1000UL);
+   int64_t current = secondParser.getValue(SML_CURRENT_L1);
+   const uint32_t CURRENT_L1_ID = EmeterPacket::phaseId(EmeterPacket::SMA_CURRENT, 1);
+   bool bothOk = fedBoth && currentSum.hasValue(SML_CURRENT_L1) && (currentSum.getValue(SML_CURRENT_L1) == 2 * current) &&
+                 (getMeasurementValue(currentSum.getPacket(), CURRENT_L1_ID) == (uint32_t)(2 * current));
+   // The second packet of the first meter has no currents (the parser still has the old values)
+   SmlStreamReader otherReader(1000);
+   bool removedOk = (otherReader.addData(EMH_EHZ_GW8E2A500AK2_1, EMH_EHZ_GW8E2A500AK2_1_LENGTH) >= 0) &&
+                    firstParser.parsePacket(otherReader.getData(), otherReader.getLength()) &&
+                    firstParser.hasValue(SML_CURRENT_L1) && currentSum.update(first, firstParser, 1100UL) &&
+                    !currentSum.hasValue(SML_CURRENT_L1) && (currentSum.getValue(SML_CURRENT_L1) == current) &&
+                    (getMeasurementValue(currentSum.getPacket(), CURRENT_L1_ID) == 0xffffffffU);
+
+   bool testOk = !missing && complete && valuesOk && packetOk && !stale && staleCleared && updated &&
+                 (aggregate.getValue(SML_POWER_SUM) == power) && (aggregate.getUpdates() == 3U) &&
+                 (aggregate.getStaleUpdates() == 2U) && bothOk && (current > 0) && removedOk;
+   printf("%s: Aggregate meter, power %.2fW - %.2fW = %.2fW, %u updates, %u stale\n", testOk ? "OK" : "ERROR",
+          gridPower / 100.0, heatPumpPower / 100.0, aggregate.getValue(SML_POWER_SUM) / 100.0,
+          aggregate.getUpdates(), aggregate.getStaleUpdates());
+   return testOk ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
    int failed = 0;
 
    BaseDecodeTests baseDecodeTests;
    failed += baseDecodeTests.run();
 
+   for (int length : { 0, 1, 3, 4, 7, 8, 9, 17, 100, SML_TEST_PACKET_LENGTH }) {
+      failed += testCrc(length, Crc16Ccitt::INIT_FCS);
+      failed += testCrc(length, 0x91dc);
+   }
+
    SmlParser smlParser;
 
    memcpy(smlPacket, SML_TEST_PACKET, SML_TEST_PACKET_LENGTH);
@@ -132,6 +826,27 @@ int main(int argc, char **argv) {
    smlPacket[219] = 0x70; // Checksum 2
    failed += checkResult(0U,14214U,25213320UL,2U,1U);
 
+   failed += testCrcPolicy(SmlParser::CRC_FULL, "full");
+   failed += testCrcPolicy(SmlParser::CRC_TRANSPORT_ONLY, "transport only");
+   failed += testCrcPolicy(SmlParser::CRC_MESSAGE_ONLY, "message only");
+   failed += testCrcPolicy(SmlParser::CRC_NONE, "none");
+   failed += testObisTable();
+   failed += testValueSlots();
+   failed += testShapeCache(false);
+   failed += testShapeCache(true);
+   failed += testFrame();
+   for (int chunkSize : { 1, 7, 64, 1000 }) {
+      failed += testStreamParser(chunkSize);
+   }
+   failed += testStreamParserTransportCrc();
+   failed += testBatchParser(1);
+   failed += testBatchParser(3);
+   failed += testPipeline();
+   failed += testPipelineIdle();
+   failed += testEmeterMapping();
+   failed += testEmeterPacketInit();
+   failed += testAggregateMeter();
+
    if (failed == 0) {
       printf("ALL TESTS PASSED.\n");
    }
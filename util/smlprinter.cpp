@@ -6,39 +6,7 @@
 #include "sml_testpacket.h"
 #include "sml_demodata.h"
 #include "../smlstreamreader.h"
-
-const uint8_t* getOctetString(uint8_t *pBuffer, int *pBufferSize, const uint8_t *pPacket, const int length) {
-   ++pPacket;
-   *pBufferSize = (length < *pBufferSize) ? length : *pBufferSize;
-   for (int i = 0; i < *pBufferSize; ++i) {
-      *(pBuffer++) = pPacket[i];
-   }
-   return pPacket + length;
-}
-
-const uint8_t* getInt(int64_t *pValue, const uint8_t *pPacket, const int length) {
-   ++pPacket;
-   *pValue = 0;
-   for (int i = 1; i < length; ++i) {
-      *pValue = (*pValue << 8) | *(pPacket++);
-   }
-   return pPacket;
-}
-
-const uint8_t* getUint(uint64_t *pValue, const uint8_t *pPacket, const int length) {
-   ++pPacket;
-   *pValue = 0;
-   for (int i = 1; i < length; ++i) {
-      *pValue = (*pValue << 8) | *(pPacket++);
-   }
-   return pPacket;
-}
-
-const uint8_t* getBool(uint8_t *pValue, const uint8_t *pPacket, const int length) {
-   ++pPacket;
-   *pValue = *(pPacket++);
-   return pPacket;
-}
+#include "../smlcursor.h"
 
 const uint8_t* printHex(const uint8_t *pPacket, const int length, const int depth, const char* pMessage) {
    for (int i = 0; i < depth; ++i) {
@@ -55,87 +23,72 @@ const uint8_t* printHex(const uint8_t *pPacket, const int length, const int dept
    return pPacket;
 }
 
-const uint8_t* printString(const uint8_t *pPacket, const int length, const int depth) {
+void printString(const SmlCursor &element, const int depth) {
    char s[100] = { 0 };
    strncpy(s, "string = ", sizeof(s));
-   for (int i = 1; i < length; ++i) {
-      char c = pPacket[i];
-      s[i + 8] = (c >= ' ' && c <= 'Z') ? c : '.';
+   int length = (element.getDataLength() < 90) ? element.getDataLength() : 90;
+   for (int i = 0; i < length; ++i) {
+      char c = element.getData()[i];
+      s[i + 9] = (c >= ' ' && c <= 'Z') ? c : '.';
    }
-   return printHex(pPacket, length, depth, s);
+   printHex(element.getElement(), element.getHeaderLength() + element.getDataLength(), depth, s);
 }
 
-#define SML_TAG_MASK 0x70
-#define SML_MORE_FLAG 0x80
-#define SML_LENGTH_MASK 0x0F
-#define SML_OCTED_ID 0x00
-#define SML_BOOL_ID 0x40
-#define SML_INT_ID 0x50
-#define SML_UINT_ID 0x60
-#define SML_LIST_ID 0x70
-
-void parseSml(const uint8_t* pPacket) {
+void printElements(SmlCursor element, const int depth) {
    char message[100];
-   int listStack[10] = { 0 };
-   int depth = 1;
-   listStack[1] = 1;
-   do {
-      // Take current element from list-stack
-      listStack[depth]--;
-      while ((listStack[depth] == 0) && (depth > 0)) {
-         depth--;
-         listStack[depth]--;
-      }
-
-      // Identify type and length
-      uint8_t type = *pPacket & SML_TAG_MASK;
-      int16_t length = *pPacket & SML_LENGTH_MASK;
-      while (*pPacket & SML_MORE_FLAG) {
-         length = (length << 4) | (*(++pPacket) & SML_LENGTH_MASK);
-      }
+   for (; element.isValid(); element.next()) {
+      const uint8_t *pElement = element.getElement();
+      int size = element.getHeaderLength() + element.getDataLength();
 
       // Handle the current type
-      switch (type) {
-      case SML_OCTED_ID: {
-         if (length == 0) {
-            pPacket = printHex(pPacket, 1, depth, "endOfMessage");
+      switch (element.getType()) {
+      case SmlCursor::SML_OCTET_ID: {
+         if (element.isEndOfMessage()) {
+            printHex(pElement, 1, depth, "endOfMessage");
          }
-         else if (length == 1) {
-            pPacket = printHex(pPacket, 1, depth, "optional, not used");
+         else if (element.isOptional()) {
+            printHex(pElement, 1, depth, "optional, not used");
          }
          else {
-            pPacket = printString(pPacket, length, depth);
+            printString(element, depth);
          }
          break;
       }
-      case SML_BOOL_ID: {
-         uint8_t value;
-         getBool(&value, pPacket, length);
-         snprintf(message, sizeof(message), "bool = %d", value);
-         pPacket = printHex(pPacket, length, depth, message);
+      case SmlCursor::SML_BOOL_ID: {
+         snprintf(message, sizeof(message), "bool = %d", element.getBool());
+         printHex(pElement, size, depth, message);
+         break;
+      }
+      case SmlCursor::SML_INT_ID: {
+         snprintf(message, sizeof(message), "int = %" PRId64, element.getInt());
+         printHex(pElement, size, depth, message);
          break;
       }
-      case SML_INT_ID: {
-         int64_t value;
-         getInt(&value, pPacket, length);
-         snprintf(message, sizeof(message), "int = %" PRId64, value);
-         pPacket = printHex(pPacket, length, depth, message);
+      case SmlCursor::SML_UINT_ID: {
+         snprintf(message, sizeof(message), "uint = %" PRIu64, (uint64_t)element.getInt());
+         printHex(pElement, size, depth, message);
          break;
       }
-      case SML_UINT_ID: {
-         uint64_t value;
-         getUint(&value, pPacket, length);
-         snprintf(message, sizeof(message), "uint = %" PRIu64, value);
-         pPacket = printHex(pPacket, length, depth, message);
+      case SmlCursor::SML_LIST_ID: {
+         printHex(pElement, element.getHeaderLength(), depth, "list");
+         printElements(element.getChildren(), depth + 1);
          break;
       }
-      case SML_LIST_ID: {
-         pPacket = printHex(pPacket, 1, depth, "list");
-         listStack[++depth] = length + 1;
+      default: {
+         printHex(pElement, size, depth, "unknown");
          break;
       }
       }
-   } while (depth > 0);
+
+      // The messages of a packet are followed by an end of message marker
+      if ((depth == 0) && element.isEndOfMessage()) {
+         break;
+      }
+   }
+}
+
+void parseSml(const uint8_t* pPacket, int length) {
+   printElements(SmlCursor(pPacket, length), 0);
 }
 
 void parseFile(int argc, char** argv) {
@@ -145,16 +98,17 @@ void parseFile(int argc, char** argv) {
    int parsed = 0;
    FILE* pFile = fopen(argv[1], "rb");
    if (pFile) {
-      uint8_t buffer[1];
+      static uint8_t buffer[65536];
       while (!feof(pFile)) {
          int bytesRead = fread(buffer, 1, sizeof(buffer), pFile);
-         if (smlReader.addData(buffer, bytesRead) > 0) {
+         smlReader.addFrames(buffer, bytesRead, [&parsed](const SmlFrame &frame) {
             parsed++;
-            printf("Packet %d, size: %d\n", parsed, smlReader.getLength());
-            //printHex(smlReader.getData(), smlReader.getLength(), 0, "");
-            parseSml(smlReader.getData());
-         }
+            printf("Packet %d, size: %d\n", parsed, frame.length);
+            //printHex(frame.pData, frame.length, 0, "");
+            parseSml(frame.pData, frame.length);
+         });
       }
+      fclose(pFile);
    }
 }
 
@@ -162,7 +116,7 @@ int main(int argc, char** argv) {
    if (argc > 1) {
       if (strcmp(argv[1], "demo") == 0) {
          // Parse demo packet without start-marker and version (1b1b1b1b 01010101)
-         parseSml(SML_DATA[1].data + 8);
+         parseSml(SML_DATA[1].data + 8, SML_DATA[1].length - 8);
       }
       else {
          parseFile(argc, argv);
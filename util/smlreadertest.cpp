@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <initializer_list>
 #include "util/sml_demodata.h"
+#include "util/sml_encoder.h"
 #include "smlstreamreader.h"
 #include "smlparser.h"
 
@@ -43,6 +46,271 @@ int testDataPacket(SmlStreamReader &reader, int length) {
    return result;
 }
 
+int testEscapeSequences(SmlStreamReader::CrcMode crcMode) {
+   // Payload with escaped runs of 1b and an unknown escape sequence (02 02 02 02), which is not part of the packet
+   uint8_t data[] = { 0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x01, 0x01, 0x01,
+                      0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x1b, 0x1b,
+                      0x1b, 0x1b, 0x02, 0x02, 0x02, 0x02, 0x05, 0x06,
+                      0x1b, 0x1b, 0x1b, 0x1b, 0x1a, 0x00, 0x00, 0x00 };
+   const uint8_t expected[] = { 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x05, 0x06 };
+   Crc16Ccitt crc16;
+   crc16.calc(data, 34);
+   data[34] = crc16.getCrc() >> 8;
+   data[35] = crc16.getCrc() & 0xff;
+
+   SmlStreamReader reader(500, true, crcMode);
+   int result = reader.addData(data, sizeof(data));
+   bool testOk = (result == sizeof(data)) && (reader.getLength() == sizeof(expected)) &&
+                 (memcmp(reader.getData(), expected, sizeof(expected)) == 0);
+   printf("%s: Escape sequences, CRC mode %d\n", testOk ? "OK" : "ERROR", crcMode);
+   return testOk ? 0 : 1;
+}
+
+int testEscapeRuns(int chunkSize, SmlStreamReader::CrcMode crcMode) {
+   // Runs of 1 - 9 escape bytes, partial escape sequences and 1b 1b 1b 1b between the packets
+   uint8_t payload[64];
+   uint8_t stream[1000];
+   int length = 0;
+   int streamLength = 0;
+   for (int run = 1; run <= 9; ++run) {
+      for (int i = 0; i < run; ++i) {
+         payload[length++] = 0x1b;
+      }
+      payload[length++] = (uint8_t)run;
+      streamLength += encodeSmlPacket(payload, length, stream + streamLength);
+      for (int i = 0; i < 3; ++i) {
+         stream[streamLength++] = 0x1b;
+      }
+      stream[streamLength++] = 0x1a;
+   }
+
+   SmlStreamReader reader(500, true, crcMode);
+   int packets = 0;
+   int errors = 0;
+   for (int chunkStart = 0; chunkStart < streamLength; chunkStart += chunkSize) {
+      int chunkLength = (streamLength - chunkStart < chunkSize) ? streamLength - chunkStart : chunkSize;
+      int offset = 0;
+      int result;
+      while ((result = reader.addData(stream + chunkStart + offset, chunkLength - offset)) >= 0) {
+         offset += result;
+         ++packets;
+         // Packet n contains the runs 1 - n, each followed by the run length
+         int expectedLength = packets * (packets + 3) / 2;
+         if ((reader.getLength() != expectedLength) || (memcmp(reader.getData(), payload, expectedLength) != 0)) {
+            ++errors;
+         }
+      }
+   }
+   if ((packets != 9) || (reader.getParseErrors() != 0U)) {
+      ++errors;
+   }
+   printf("%s: Escape runs, chunk size %d, CRC mode %d, %d packets, %d errors\n", errors == 0 ? "OK" : "ERROR", chunkSize, crcMode, packets, errors);
+   return errors;
+}
+
+int testChunkedStream(int chunkSize, SmlStreamReader::CrcMode crcMode) {
+   SmlStreamReader bytewiseReader(500);
+   SmlStreamReader chunkedReader(500, true, crcMode);
+   int packets = 0;
+   int errors = 0;
+
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      int bytewisePos = 0;
+      int chunkStart = 0;
+      while (chunkStart < length) {
+         int chunkLength = (length - chunkStart < chunkSize) ? length - chunkStart : chunkSize;
+         int offset = 0;
+         int result;
+         while ((result = chunkedReader.addData(pData + chunkStart + offset, chunkLength - offset)) >= 0) {
+            offset += result;
+            ++packets;
+            // Feed the reference reader up to the same position
+            while ((bytewisePos < chunkStart + offset) && (bytewiseReader.addData(pData + bytewisePos, 1) < 0)) {
+               ++bytewisePos;
+            }
+            ++bytewisePos;
+            if ((bytewisePos != chunkStart + offset) ||
+                (bytewiseReader.getLength() != chunkedReader.getLength()) ||
+                (memcmp(bytewiseReader.getData(), chunkedReader.getData(), chunkedReader.getLength()) != 0)) {
+               ++errors;
+            }
+         }
+         chunkStart += chunkLength;
+      }
+      while (bytewisePos < length) {
+         bytewiseReader.addData(pData + bytewisePos++, 1);
+      }
+   }
+   if (chunkedReader.getParseErrors() != bytewiseReader.getParseErrors()) {
+      ++errors;
+   }
+   printf("%s: Chunk size %d, CRC mode %d, %d packets, %d errors\n", errors == 0 ? "OK" : "ERROR", chunkSize, crcMode, packets, errors);
+   return errors;
+}
+
+int testFrameIterator(int chunkSize, bool resync) {
+   SmlStreamReader reader(500);
+   SmlStreamReader iteratingReader(500, true, SmlStreamReader::CRC_PER_BYTE, resync);
+   uint8_t expected[500];
+   int expectedLength = -1;
+   int packets = 0;
+   int errors = 0;
+
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      int readerPos = 0;
+      for (int chunkStart = 0; chunkStart < length; chunkStart += chunkSize) {
+         int chunkLength = (length - chunkStart < chunkSize) ? length - chunkStart : chunkSize;
+         iteratingReader.addFrames(pData + chunkStart, chunkLength, [&](const SmlFrame &frame) {
+            // Get the next packet from the reference reader
+            expectedLength = -1;
+            int result = reader.addData(pData + readerPos, length - readerPos);
+            if (result >= 0) {
+               readerPos += result;
+               expectedLength = reader.getLength();
+               memcpy(expected, reader.getData(), expectedLength);
+            }
+            if ((frame.length != expectedLength) || (frame.crc16 != reader.getCrc16()) ||
+                (memcmp(frame.pData, expected, frame.length) != 0)) {
+               ++errors;
+            }
+            ++packets;
+         });
+      }
+   }
+   printf("%s: Frame iterator, chunk size %d, resync %d, %d packets, %d errors\n", errors == 0 ? "OK" : "ERROR", chunkSize, resync, packets, errors);
+   return errors;
+}
+
+int testRingBuffer(int ringSize, int chunkSize, SmlStreamReader::CrcMode crcMode) {
+   SmlStreamReader reader(500);
+   SmlStreamReader ringReader(500, true, crcMode);
+   uint8_t ring[2000];
+   int ringPos = 0;
+   int packets = 0;
+   int packetsInPlace = 0;
+   int errors = 0;
+
+   ringReader.setRingBuffer(ring, ringSize);
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      int readerPos = 0;
+      for (int chunkStart = 0; chunkStart < length; chunkStart += chunkSize) {
+         int chunkLength = (length - chunkStart < chunkSize) ? length - chunkStart : chunkSize;
+         int offset = ringPos;
+         for (int j = 0; j < chunkLength; ++j) {
+            ring[ringPos] = pData[chunkStart + j];
+            ringPos = (ringPos + 1) % ringSize;
+         }
+         ringReader.addRingData(offset, chunkLength, [&](const SmlFrame &frame) {
+            int result = reader.addData(pData + readerPos, length - readerPos);
+            readerPos += result;
+            if ((result < 0) || (frame.length != reader.getLength()) || (frame.padding != (SML_DATA[i].data[readerPos - 3])) ||
+                (memcmp(frame.pData, reader.getData(), frame.length) != 0) ||
+                ((frame.offset >= 0) && (frame.pData != ring + frame.offset))) {
+               ++errors;
+            }
+            packetsInPlace += (frame.offset >= 0) ? 1 : 0;
+            ++packets;
+         });
+      }
+   }
+   printf("%s: Ring buffer size %d, chunk size %d, CRC mode %d, %d packets, %d in place, %d errors\n", 
+          errors == 0 ? "OK" : "ERROR", ringSize, chunkSize, crcMode, packets, packetsInPlace, errors);
+   return errors;
+}
+
+int testResync() {
+   // Noise made of bytes which are likely to confuse the reader, e.g. partial start sequences
+   const uint8_t NOISE_BYTES[] = { 0x1b, 0x1b, 0x01, 0x00, 0x1a, 0x42 };
+   const uint8_t START[] = { 0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x01, 0x01, 0x01 };
+   uint8_t stream[20000];
+   int length = 0;
+   uint32_t random = 12345U;
+   uint32_t noiseTotal = 0U;
+   uint32_t longestNoise = 0U;
+   uint32_t bursts = 0U;
+   int expectedPackets = 0;
+
+   for (int i = 0; i < 30; ++i) {
+      int noiseLength = (i % 3 == 0) ? 0 : (i * 37) % 400;
+      for (int j = 0; j < noiseLength; ++j) {
+         random = random * 1103515245U + 12345U;
+         stream[length++] = NOISE_BYTES[(random >> 16) % sizeof(NOISE_BYTES)];
+         if ((length >= 8) && (memcmp(stream + length - 8, START, 8) == 0)) {
+            stream[length - 1] = 0x42;
+         }
+      }
+      noiseTotal += noiseLength;
+      bursts += (noiseLength > 0) ? 1 : 0;
+      longestNoise = ((uint32_t)noiseLength > longestNoise) ? noiseLength : longestNoise;
+      if (i == 10) {
+         // Start of a packet which overflows the buffer of the reader (discarded as part of the packet)
+         memcpy(stream + length, START, sizeof(START));
+         memset(stream + length + sizeof(START), 0x42, 600);
+         length += sizeof(START) + 600;
+      }
+      memcpy(stream + length, SML_DATA[0].data, SML_DATA[0].length);
+      length += SML_DATA[0].length;
+      ++expectedPackets;
+   }
+
+   SmlStreamReader reader(500, true, SmlStreamReader::CRC_PER_FRAME, true);
+   int packets = 0;
+   for (int chunkStart = 0; chunkStart < length; chunkStart += 50) {
+      int chunkLength = (length - chunkStart < 50) ? length - chunkStart : 50;
+      packets += reader.addFrames(stream + chunkStart, chunkLength, [](const SmlFrame &frame) {});
+   }
+
+   // The rest of the overflowed packet is discarded too
+   uint32_t overflowGap = 600 - 500;
+   bool testOk = (packets == expectedPackets) && (reader.getParseErrors() == 1U) &&
+                 (reader.getDiscardedBytes() == noiseTotal + overflowGap) &&
+                 (reader.getResyncCount() == bursts + 1) &&
+                 (reader.getLongestGap() == longestNoise);
+   printf("%s: Resync, %d packets, %u errors, %u bytes discarded, %u resyncs, longest gap %u\n", testOk ? "OK" : "ERROR",
+          packets, (unsigned int)reader.getParseErrors(), (unsigned int)reader.getDiscardedBytes(),
+          (unsigned int)reader.getResyncCount(), (unsigned int)reader.getLongestGap());
+   return testOk ? 0 : 1;
+}
+
+template <class StaticReader>
+int testStaticReader(const char *pName, StaticReader &staticReader, SmlStreamReader &reader, bool stripPadding, bool statistics) {
+   int packets = 0;
+   int errors = 0;
+
+   for (int i = 0; i < SML_DATA_LENGTH; ++i) {
+      const uint8_t *pData = SML_DATA[i].data;
+      int length = SML_DATA[i].length;
+      int offset = 0;
+      int staticOffset = 0;
+      int result;
+      while ((result = reader.addData(pData + offset, length - offset)) >= 0) {
+         offset += result;
+         ++packets;
+         int staticResult = staticReader.addData(pData + staticOffset, length - staticOffset);
+         staticOffset += staticResult;
+         int expectedLength = reader.getLength() + (stripPadding ? 0 : staticReader.getPadding());
+         if ((staticResult < 0) || (staticOffset != offset) || (staticReader.getLength() != expectedLength) ||
+             (memcmp(staticReader.getData(), reader.getData(), reader.getLength()) != 0)) {
+            ++errors;
+         }
+      }
+      if (staticReader.addData(pData + staticOffset, length - staticOffset) >= 0) {
+         ++errors;
+      }
+   }
+   if (staticReader.getParseErrors() != (statistics ? reader.getParseErrors() : 0U)) {
+      ++errors;
+   }
+   printf("%s: Static reader %s, %d packets, %d errors\n", errors == 0 ? "OK" : "ERROR", pName, packets, errors);
+   return errors;
+}
+
 int main(int argc, char ** argv) {
    SmlStreamReader reader(500);
    SmlParser parser;
@@ -70,5 +338,40 @@ int main(int argc, char ** argv) {
       } while (offset >= 0);
    } 
 
-   return 0;
+   // Every test returns the number of errors
+   int failed = 0;
+   for (SmlStreamReader::CrcMode crcMode : { SmlStreamReader::CRC_PER_BYTE, SmlStreamReader::CRC_PER_FRAME }) {
+      failed += (testEscapeSequences(crcMode) != 0);
+      failed += (testEscapeRuns(1, crcMode) != 0);
+      failed += (testEscapeRuns(1000, crcMode) != 0);
+      failed += (testChunkedStream(3, crcMode) != 0);
+      failed += (testChunkedStream(64, crcMode) != 0);
+      failed += (testChunkedStream(100000, crcMode) != 0);
+   }
+   failed += (testFrameIterator(7, false) != 0);
+   failed += (testFrameIterator(65536, false) != 0);
+   failed += (testFrameIterator(7, true) != 0);
+   failed += (testFrameIterator(65536, true) != 0);
+   failed += (testRingBuffer(564, 64, SmlStreamReader::CRC_PER_BYTE) != 0);
+   failed += (testRingBuffer(2000, 100, SmlStreamReader::CRC_PER_FRAME) != 0);
+   failed += (testResync() != 0);
+
+   StaticSmlStreamReader<500> staticReader;
+   SmlStreamReader reader1(500);
+   failed += (testStaticReader("default", staticReader, reader1, true, true) != 0);
+   StaticSmlStreamReader<500, SmlStaticPolicy<true, SmlStreamReaderBase::CRC_PER_FRAME> > perFrameReader;
+   SmlStreamReader reader2(500, true, SmlStreamReader::CRC_PER_FRAME);
+   failed += (testStaticReader("crc/frame", perFrameReader, reader2, true, true) != 0);
+   StaticSmlStreamReader<500, SmlStaticPolicy<false, SmlStreamReaderBase::CRC_PER_BYTE, false, false, false> > minimalReader;
+   SmlStreamReader reader3(500, false);
+   failed += (testStaticReader("minimal", minimalReader, reader3, false, false) != 0);
+
+   if (failed == 0) {
+      printf("ALL TESTS PASSED.\n");
+   }
+   else {
+      printf("%d TEST(S) FAILED.\n", failed);
+   }
+
+   return (failed == 0) ? 0 : 1;
 }
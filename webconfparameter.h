@@ -63,6 +63,14 @@ public:
     return _pParameter;  
   }
   
+  /**
+   * @brief Returns the maximum length of the value of the parameter.
+   */
+  int getLength()
+  {
+    return _length;
+  }
+
   /**
    * @brief Checks, whether the parameter is empty.
    */